@@ -252,6 +252,9 @@ This file implements a Forth library, so a Forth interpreter can be embedded
 in another application, as such a subset of the functions in this file are
 exported, and are documented in the *libforth.h* header 
 **/
+#ifdef USE_SUBROUTINE_THREADING
+#define _DEFAULT_SOURCE /* for MAP_ANONYMOUS, see "Subroutine threading" */
+#endif
 #include "libforth.h"
 
 /**
@@ -272,6 +275,32 @@ more memory.
 #include <string.h>
 #include <setjmp.h>
 #include <time.h>
+#include <sys/stat.h>
+
+/**
+Loading plugins needs **dlopen**, which is not part of the C standard
+library, so it is only available if **USE_PLUGINS** is defined (see the
+"plugins" make target).
+**/
+#ifdef USE_PLUGINS
+#include <dlfcn.h>
+#endif
+
+/**
+The subroutine threaded backend generates x86-64 machine code, which has to
+be placed in memory allocated with **mmap**, so it is only available on
+that processor and on Unix systems, and only if **USE_SUBROUTINE_THREADING**
+is defined (see the "subroutine" make target).
+**/
+#ifdef USE_SUBROUTINE_THREADING
+#if !defined(__x86_64__) || !defined(__unix__)
+#error "subroutine threading is only available on x86-64 Unix systems"
+#endif
+#include <stddef.h>
+#include <sys/mman.h>
+#define SUBROUTINE_ARENA_SIZE (4u * 1024u * 1024u) /**< bytes of machine code */
+#define SUBROUTINE_MAXIMUM_DEPTH (64u) /**< nesting of words compiled at once */
+#endif
 
 /**
 Traditionally Forth implementations were the only program running on the
@@ -359,12 +388,105 @@ code in *forth.fth* will not work.
 **/
 #define MINIMUM_STACK_SIZE  (64u)
 
+/**
+@brief The number of input sources, strings passed to **evaluate** and files
+being included, that can be nested within each other.
+**/
+#define MAXIMUM_SOURCE_DEPTH (32u)
+
+/**
+@brief The cache file for a module is kept next to it, with the same name
+and this added on to the end.
+**/
+#define MODULE_SUFFIX        ".cache"
+
+/**
+@brief Writes to memory are tracked in chunks of this many cells so that
+**forth_checkpoint_delta** only has to save the chunks that have changed, it
+must be a power of two and divide **MINIMUM_CORE_SIZE**.
+**/
+#define CHECKPOINT_CHUNK    (64u)
+
+/**
+@brief The number of bytes needed for a bitmap with one bit for each chunk
+in a core of **SIZE** cells.
+**/
+#define CHECKPOINT_BITMAP(SIZE) ((((SIZE) / CHECKPOINT_CHUNK) + CHAR_BIT - 1) / CHAR_BIT)
+
 /** 
 @brief The start of the dictionary is after the registers and the 
 **STRING_OFFSET**, this is the area where Forth definitions are placed. 
 **/
 #define DICTIONARY_START (STRING_OFFSET+MAXIMUM_WORD_LENGTH)
 
+/**
+@brief Two cells before the registers that **forth_execute** uses as a
+thread to run a single word, the cell at location two cannot be used as it
+contains the fake word used for pushing literals.
+**/
+#define EXECUTE_THREAD   (4u)
+
+/**
+@brief The cell after the fake word used for pushing literals holds the 
+head of a list of the plugin libraries loaded with **forth_load_library**,
+each entry of which is stored in the dictionary. Unlike the other cells
+below the registers this one is saved and restored with the core.
+**/
+#define LIBRARY_LIST     (3u)
+
+/**
+@brief The number of cells in the header of a library list entry, they
+contain a link to the previous entry, the first foreign function index
+used by the library and the number of functions, the path of the library
+follows as a NUL terminated string.
+**/
+#define LIBRARY_HEADER   (3u)
+
+/**
+@brief With 32-bit cells a host pointer is stored as a slot number in the
+top bits of a cell and an offset in the rest, see **host_to_cell**.
+**/
+#define HOST_OFFSET_BITS (24u)
+#define HOST_OFFSET_MASK ((1u << HOST_OFFSET_BITS) - 1u) /**< offset part of cell */
+#define HOST_SLOTS       (1u << (32u - HOST_OFFSET_BITS)) /**< size of table */
+#define HOST_CORE        (1u) /**< slot of the Forth core */
+#define HOST_STRING_IN   (2u) /**< slot of string input from C */
+#define HOST_DYNAMIC     (3u) /**< first slot handed out as needed */
+
+/**
+@brief File handles are an index into a table of open files in the bottom
+**HANDLE_INDEX_BITS** of a cell and a generation number in the rest, see
+**handle_open**. 
+**/
+#define HANDLE_INDEX_BITS (8u)
+#define HANDLE_SLOTS      (1u << HANDLE_INDEX_BITS) /**< size of file table */
+#define HANDLE_MASK       (HANDLE_SLOTS - 1u)       /**< index part of a handle */
+#define HANDLE_GENERATION_MAX (((forth_cell_t)-1) >> HANDLE_INDEX_BITS) /**< largest generation */
+
+/**
+@brief The cell at location one holds the generation number given to the
+last file opened, it is saved with the core so that handles that were open
+when a core was saved can never match a file opened after it is loaded.
+**/
+#define HANDLE_GENERATION (1u)
+
+/**
+@brief Slots in the file table that do not change between instances, the 
+standard streams have these handles in every core. The file input and
+output slots are used for files set through the C API that are not already
+in the table.
+**/
+enum handles {
+	HANDLE_INVALID,  /**< zero is never a valid handle */
+	HANDLE_STDIN,    /**< standard input */
+	HANDLE_STDOUT,   /**< standard output */
+	HANDLE_STDERR,   /**< standard error */
+	HANDLE_FILE_IN,  /**< input set with forth_set_file_input */
+	HANDLE_FILE_OUT, /**< output set with forth_set_file_output */
+	HANDLE_BUFFER_OUT, /**< output set with forth_set_buffer_output */
+	HANDLE_DYNAMIC,  /**< first slot handed out by open-file */
+};
+
 /**
 Later we will encounter a field called **CODE**, a field in every Word
 definition and is always present in the Words header. This field contains
@@ -414,6 +536,24 @@ order for the dictionary.
 **/
 #define WORD_HIDDEN(CODE) ((CODE) & 0x80)
 
+/**
+@brief Offset for the bit that allows a word to be inlined
+**/
+#define INLINE_BIT_OFFSET (13)
+
+/**
+@brief Only a word with this bit set in its CODE field, by the Forth word
+**inline**, can be inlined when it is compiled into another word, see
+"Inlining".
+**/
+#define INLINE_BIT (1u << INLINE_BIT_OFFSET)
+
+/**
+@brief A word with this bit set in its CODE field can be jumped to instead
+of being called from the end of another word, see "Tail calls".
+**/
+#define TAIL_CALL_BIT (1u << 14)
+
 /**
 @brief The lower 7 bits of the CODE field are used for the VM instruction,
 limiting the number of instructions the virtual machine can have in it, the
@@ -427,6 +567,13 @@ higher bits are used for other purposes.
 **/
 #define instruction(k)      ((k) & INSTRUCTION_MASK)
 
+/**
+@brief Words compiled to C by **forth_generate_native** have the **NATIVE**
+instruction in their CODE field, and the index of their C function in the
+bits above those described so far.
+**/
+#define NATIVE_INDEX_OFFSET (16)
+
 /**
 @brief **VERIFY** is our assert macro that will always been defined 
 regardless of whether **NDEBUG** is defined.
@@ -446,6 +593,18 @@ when they get to the Forth interpreter.
 **/
 #define BIAS_SIGNAL         (-512)
 
+/**
+@brief The size of a single block buffer in characters, this is the
+traditional Forth block size.
+**/
+#define BLOCK_SIZE          (1024u)
+
+/**
+@brief The maximum length of the name of the file backing the block
+buffers, including the terminating NUL.
+**/
+#define BLOCK_NAME_LENGTH   (128u)
+
 /**
 @brief This is a useful function for performing what is in effect a
 static assert by abusing the language.
@@ -511,6 +670,7 @@ A short description of the words defined in **initial_forth_program**
 follows, bear in mind that they depend on the built in primitives, the
 named registers being defined, as well as **state** and **;**.
 
+	inline    - let the word being defined be copied into other words
 	here      - push the current dictionary pointer
 	[         - immediately enter command mode
 	]         - enter compile mode
@@ -537,9 +697,10 @@ named registers being defined, as well as **state** and **;**.
 static const char *initial_forth_program = 
 ": smudge pwd @ 1 + dup @ hidden-mask xor swap ! _exit\n"
 ": (;) ' _exit , 0 state ! _exit\n"
-": ; immediate (;) smudge _exit\n"
+": ; immediate (;) (tail-call) smudge _exit\n"
 ": : immediate :: smudge _exit\n"
-": here h @ ; \n"
+": inline immediate pwd @ 1 + dup @ inline-mask or swap ! ; \n"
+": here inline h @ ; \n"
 ": [ immediate 0 state ! ; \n"
 ": ] 1 state ! ; \n"
 ": >mark here 0 , ; \n"
@@ -550,11 +711,11 @@ static const char *initial_forth_program =
 ": begin immediate here ; \n"
 ": until immediate ' ?branch , here - , ; \n"
 ": ( immediate begin key ')' = until ; \n"
-": rot >r swap r> swap ; \n"
+": rot inline >r swap r> swap ; \n"
 ": -rot rot rot ; \n"
-": tuck swap over ; \n"
-": nip swap drop ; \n"
-": 2drop drop drop ; \n"
+": tuck inline swap over ; \n"
+": nip inline swap drop ; \n"
+": 2drop inline drop drop ; \n"
 ": allot here + h ! ; \n"
 ": emit _emit drop ; \n" 
 ": space bl emit ; \n"
@@ -592,6 +753,42 @@ static const char *fams[] = {
 	NULL 
 };
 
+/**
+@brief The block word set keeps its state in a control area that lives
+within the dictionary, so that it is saved along with the rest of the core.
+**enum block_control** names the fields at the start of that area.
+
+The control area looks like this, for *N* buffers:
+
+	.--------.-------------------------.----------------------.
+	| Header | N * BLOCK_FIELDS cells  | N * BLOCK_SIZE chars |
+	.--------.-------------------------.----------------------.
+
+The header holds the number of buffers, a clock used for least recently
+used replacement, the buffer last returned by **BLOCK** (which **UPDATE**
+acts upon), a read ahead flag and the name of the file backing the blocks.
+Block *n* lives at offset *(n - 1) * BLOCK_SIZE* within that single file,
+block zero being invalid.
+**/
+enum block_control {
+	BLOCK_COUNT, /**< number of block buffers */
+	BLOCK_CLOCK, /**< incremented on each access, for LRU replacement */
+	BLOCK_LAST,  /**< index of the buffer most recently returned */
+	BLOCK_AHEAD, /**< if non zero, read in block n+1 when n is loaded */
+	BLOCK_NAME,  /**< start of the NUL terminated backing file name */
+	BLOCK_HEADER = BLOCK_NAME + (BLOCK_NAME_LENGTH / sizeof(forth_cell_t))
+};
+
+/**
+@brief Each buffer has the following fields in the control area.
+**/
+enum block_fields {
+	BLOCK_NUMBER, /**< block number held in buffer, zero if free */
+	BLOCK_DIRTY,  /**< non zero if the buffer needs writing back */
+	BLOCK_USED,   /**< value of BLOCK_CLOCK when buffer was last used */
+	BLOCK_FIELDS
+};
+
 /**
 @brief The following are different reactions errors can take when
 using **longjmp** to a previous **setjump**.
@@ -627,7 +824,10 @@ the version of the file format.
 
 **ENDIAN** is the endianess of the VM
 
-**MAGIC7** is the last magic number.
+**LOG2_SIZE** is the binary logarithm of the size of the core in cells.
+
+**FORMAT** contains flags describing how the data following the header is
+stored, see **enum core_format**.
 
 When loading the image the magic numbers are checked as well as
 compatibility between the saved image and the compiled Forth interpreter. 
@@ -641,9 +841,59 @@ enum header { /**< Forth header description enum */
 	VERSION,    /**< Version of the image */
 	ENDIAN,     /**< Endianess of the interpreter */
 	LOG2_SIZE,  /**< Log-2 of the size */
+	FORMAT,     /**< How the data following the header is stored */
 	MAX_HEADER_FIELD
 };
 
+/**
+The data following the header is either the raw contents of **m**, or
+**m** encoded with a simple run length encoding scheme. Core files consist
+mostly of zeros, between the end of the dictionary and the stacks, so the
+encoding has a special case for runs of zeros. Each command byte is followed
+by zero or more bytes of data:
+
+	Command byte    Meaning
+	0x00 - 0x7F     'command + 1' literal bytes follow
+	0x80 - 0xBF     repeat the next byte 'command - 0x80 + 3' times
+	0xC0 - 0xFF     zero run, length is 'command & 0x3F' followed by a 16
+	                bit big endian number, plus one
+
+Decoding is done into memory that has already been zeroed, so zero runs cost
+no more than advancing a pointer.
+
+A sparse core only contains the parts of **m** that are in use, which are the
+dictionary, from zero up to the dictionary pointer, and the live portions of
+the variable and return stacks. After the header comes a count of segments and
+then a start and length pair for each segment, all stored as cells, followed
+by the data for each segment in turn, which may also be compressed. Anything
+not in a segment is zero when the core is loaded back in, so the cost of
+saving and loading does not depend on the size of the core.
+
+A delta checkpoint is a sparse core containing only the chunks of memory that
+have changed since the last checkpoint, along with the registers and the live
+parts of the stacks. It cannot be loaded by itself, it must be applied on top
+of the core, and any deltas, that it follows.
+**/
+enum core_format {
+	CORE_RAW        = 0,        /**< no flags set, core is stored as is */
+	CORE_COMPRESSED = 1u << 0,  /**< core is run length encoded */
+	CORE_SPARSE     = 1u << 1,  /**< only the used segments are stored */
+	CORE_DELTA      = 1u << 2,  /**< changes since the previous checkpoint */
+};
+
+/**
+@brief Number of segments written out to a sparse core
+**/
+#define CORE_SEGMENTS   (3u)
+
+/**
+@brief Limits for each of the run length encoding commands
+**/
+#define RLE_LITERAL_MAX (0x80u)
+#define RLE_REPEAT_MIN  (3u)
+#define RLE_REPEAT_MAX  (0x40u + RLE_REPEAT_MIN - 1)
+#define RLE_ZERO_MAX    (1u << 22)
+
 /** 
 The header itself, this will be copied into the **forth_t** structure on
 initialization, the **ENDIAN** field is filled in then as it seems impossible
@@ -657,7 +907,22 @@ static const uint8_t header[MAX_HEADER_FIELD] = {
 	[CELL_SIZE] = sizeof(forth_cell_t),
 	[VERSION]   = FORTH_CORE_VERSION,
 	[ENDIAN]    = -1,
-	[LOG2_SIZE]  = -1 
+	[LOG2_SIZE] = -1,
+	[FORMAT]    = CORE_RAW
+};
+
+/**
+@brief An input source put aside by **evaluator** while it reads another,
+along with where to carry on when the new one runs out.
+**/
+struct forth_source {
+	forth_cell_t sin, sidx, slen, fin, source_id; /**< input registers */
+	int unget;            /**< character of push back */
+	bool unget_set;       /**< character is in the push back buffer? */
+	forth_cell_t rstk;    /**< return stack pointer when it was put aside */
+	forth_cell_t I;       /**< instruction after the call to **evaluator** */
+	forth_cell_t handler; /**< throw handler when it was put aside */
+	struct forth_module *module; /**< changes being recorded, if any */
 };
 
 /**
@@ -717,12 +982,210 @@ struct forth { /**< FORTH environment */
 	forth_cell_t *vstart;/**< index into m[] where variable stack starts*/
 	forth_cell_t *vend;  /**< index into m[] where variable stack ends*/
 	const struct forth_functions *calls; /**< functions for CALL instruction */
+	struct forth_cfunction *cfunctions; /**< functions for CCALL instruction */
+	forth_cell_t cfunction_count; /**< number of entries in **cfunctions** */
+	void **libraries;    /**< handles of loaded plugin libraries */
+	size_t library_count; /**< number of entries in **libraries** */
+	FILE *files[HANDLE_SLOTS]; /**< open files referred to by handles */
+	forth_cell_t generations[HANDLE_SLOTS]; /**< generation of each file */
+#ifdef USE_32BIT_CELLS
+	void *host[HOST_SLOTS]; /**< host pointers referred to by cells */
+#endif
 	int unget;           /**< single character of push back */
 	bool unget_set;      /**< character is in the push back buffer? */
 	size_t line;         /**< count of new lines read in */
+	FILE *block_file;    /**< file backing the block buffers, opened lazily */
+	forth_cell_t block_ctl; /**< block control area block_file belongs to */
+	bool subroutine_threading; /**< run words as subroutine threaded code? */
+	struct forth_subroutine *subroutines; /**< words compiled to machine code */
+	forth_cell_t subroutine_count; /**< number of entries in **subroutines** */
+	uint8_t *arena;      /**< executable memory holding the machine code */
+	size_t arena_used;   /**< bytes of **arena** in use */
+	struct forth_effect *effects; /**< stack effects of words, indexed by xt */
+	uint8_t *analysed;   /**< bitmap of the cells those effects depend on */
+	forth_cell_t effect_count; /**< number of valid entries in **effects** */
+	forth_cell_t effect_size;  /**< number of entries allocated */
+	forth_cell_t resume; /**< where a run that used up its budget carries on */
+	forth_cell_t resume_base; /**< **source_depth** when that run started */
+	forth_cell_t resume_rstk; /**< return stack pointer when that run started */
+	struct forth_source sources[MAXIMUM_SOURCE_DEPTH]; /**< nested input */
+	forth_cell_t source_depth; /**< number of entries in **sources** */
+	bool module_cache;   /**< load included files from their caches? */
+	forth_cell_t error_count; /**< recoverable errors there have been */
+	uint64_t instructions; /**< instructions the virtual machine has run */
+	uint64_t colon_calls; /**< calls to words defined in Forth */
+	forth_cell_t stack_max; /**< most cells seen on the variable stack */
+	forth_cell_t return_max; /**< most cells seen on the return stack */
+	uint64_t allocations; /**< blocks of memory given out by allocate */
+	uint64_t allocated;  /**< how many of those have not been freed */
+	void **heap;         /**< those not freed, see "Allocated memory" */
+	size_t heap_size;    /**< number of slots in **heap** */
+	clock_t run_time;    /**< processor time spent in forth_run */
+	struct forth_module *module; /**< recording for the next file read */
+	forth_buffer_t *buffer; /**< output set with forth_set_buffer_output */
+	char *feed;          /**< input given to forth_feed not yet read */
+	size_t feed_length;  /**< number of characters in **feed** */
+	size_t feed_size;    /**< number of characters allocated for **feed** */
+	bool feeding;        /**< is more input to come from forth_feed? */
+	bool starved;        /**< did the last run stop to wait for input? */
+	forth_cell_t feed_depth; /**< **source_depth** of the fed input */
+	forth_cell_t feed_mark;  /**< where the last word the interpreter read began */
+	int feed_unget;      /**< push back when that word was read */
+	bool feed_unget_set; /**< was there push back then? */
+	uint8_t *dirty;      /**< bitmap of changed chunks, stored after **m** */
 	forth_cell_t m[];    /**< ~~ Forth Virtual Machine memory */
 };
 
+/**
+## Host pointers
+
+File handles, allocated memory and other pointers that come from the C
+library are stored in cells, and "real addresses" can be made by adding
+the start address of the core to an address within it. Normally this is
+simple as a cell is large enough to hold a pointer. If cells are 32-bits
+wide on a 64-bit machine they are not, so the top bits of a cell holding a
+pointer select a slot in a table of host pointers and the bottom bits are
+an offset from it, preserving the ability to do address arithmetic. Slot
+zero is NULL, slot one is the core itself, the next is overwritten whenever
+the input string is changed through the C API (so it does not fill up the
+table) and the rest are handed out as needed. File handles are not stored
+this way, see the next section.
+
+The functions **host_to_cell**, **cell_to_host** and **host_release** 
+convert to and from the cell representation, when cells can hold pointers
+they are just casts.
+**/
+#ifdef USE_32BIT_CELLS
+static forth_cell_t host_to_cell(forth_t *o, const void *p, forth_cell_t fixed)
+{
+	const char *c = p, *core = (char*)o->m;
+	forth_cell_t i;
+	if (!p)
+		return 0;
+	if (c >= core && c < core + o->core_size * sizeof(forth_cell_t))
+		return (HOST_CORE << HOST_OFFSET_BITS) | (forth_cell_t)(c - core);
+	for (i = HOST_CORE + 1; i < HOST_SLOTS; i++)
+		if (o->host[i] == p)
+			return i << HOST_OFFSET_BITS;
+	if (fixed) {
+		o->host[fixed] = (void*)p;
+		return fixed << HOST_OFFSET_BITS;
+	}
+	for (i = HOST_DYNAMIC; i < HOST_SLOTS; i++)
+		if (!o->host[i]) {
+			o->host[i] = (void*)p;
+			return i << HOST_OFFSET_BITS;
+		}
+	warning("host pointer table full (%u slots)", HOST_SLOTS);
+	return 0;
+}
+
+static void *cell_to_host(forth_t *o, forth_cell_t c)
+{
+	char *p = o->host[c >> HOST_OFFSET_BITS];
+	return p ? p + (c & HOST_OFFSET_MASK) : NULL;
+}
+
+static void host_release(forth_t *o, forth_cell_t c)
+{
+	if ((c >> HOST_OFFSET_BITS) >= HOST_DYNAMIC)
+		o->host[c >> HOST_OFFSET_BITS] = NULL;
+}
+#else
+#define host_to_cell(O, P, FIXED) ((void)(O), (forth_cell_t)(P))
+#define cell_to_host(O, C)        ((void)(O), (void*)(C))
+#define host_release(O, C)        ((void)(O), (void)(C))
+#endif
+
+/**
+## Allocated memory
+
+**FREE** and **RESIZE** are handed whatever pointer is on the stack, which
+may not have come from **ALLOCATE** at all, or may have been freed already.
+The blocks given out are kept in **heap**, a hash set using linear probing,
+and only a block found in there is passed on to the C library and counted
+as freed for **forth_stats**, anything else is refused with an error. The
+set is at most half full, and removing a block moves later entries back
+into the gap so that no entry ever becomes unreachable.
+**/
+static size_t heap_hash(forth_t *o, const void *p)
+{
+	uint64_t h = (uint64_t)(uintptr_t)p >> 4;
+	h *= 0x9E3779B97F4A7C15ull;
+	return (size_t)(h ^ (h >> 29)) & (o->heap_size - 1);
+}
+
+/**
+@brief Remember a block handed out by **ALLOCATE** or **RESIZE**
+@param o Forth environment to add the block to
+@param p block to add, not NULL
+@return true on success, false if memory could not be found for the set
+**/
+static bool heap_add(forth_t *o, void *p)
+{
+	size_t i;
+	if ((o->allocated + 1) * 2 > o->heap_size) {
+		size_t size = o->heap_size ? o->heap_size * 2 : 64, old = o->heap_size;
+		void **heap = o->heap;
+		if (!(o->heap = calloc(size, sizeof(*heap)))) {
+			o->heap = heap;
+			return false;
+		}
+		o->heap_size = size;
+		for (size_t j = 0; j < old; j++)
+			if (heap[j]) {
+				for (i = heap_hash(o, heap[j]); o->heap[i]; i = (i + 1) & (size - 1))
+					;
+				o->heap[i] = heap[j];
+			}
+		free(heap);
+	}
+	for (i = heap_hash(o, p); o->heap[i]; i = (i + 1) & (o->heap_size - 1))
+		;
+	o->heap[i] = p;
+	o->allocated++;
+	return true;
+}
+
+/**
+@brief Forget a block that is being freed or resized
+@param o Forth environment holding the set of blocks
+@param p block to remove
+@return true if 'p' was in the set, false if it was not given out by us
+**/
+static bool heap_remove(forth_t *o, void *p)
+{
+	const size_t mask = o->heap_size - 1;
+	size_t i, j, k;
+	if (!p || !o->heap_size)
+		return false;
+	for (i = heap_hash(o, p); o->heap[i] != p; i = (i + 1) & mask)
+		if (!o->heap[i])
+			return false;
+	o->heap[i] = NULL;
+	for (j = (i + 1) & mask; o->heap[j]; j = (j + 1) & mask) {
+		k = heap_hash(o, o->heap[j]);
+		/* move the entry back if its home is not between the gap and it */
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			o->heap[i] = o->heap[j];
+			o->heap[j] = NULL;
+			i = j;
+		}
+	}
+	o->allocated--;
+	return true;
+}
+
+/**
+@brief A foreign function defined with **forth_define_cfunction**, along
+with the number of stack items it consumes and produces.
+**/
+struct forth_cfunction {
+	unsigned arity;   /**< number of arguments popped off the stack */
+	unsigned results; /**< number of results pushed, zero or one */
+	forth_cfunction_t function; /**< function to call */
+};
+
 /**
 @brief This enumeration describes the possible actions that can be taken when an
 error occurs, by setting the right register value it is possible to make errors
@@ -932,6 +1395,23 @@ up for debugging purposes (like **pnum**).
  X(2, RESIZE,    "resize",         " r-addr u -- r-addr ior : resize a block of memory")\
  X(2, GETENV,    "getenv",         " c-addr u -- r-addr u : return an environment variable")\
  X(1, BYE,       "(bye)",          " u -- : bye, bye!")\
+ X(2, BLOCK,     "(block)",        " n ctl -- c-addr ior : load block n into a buffer")\
+ X(1, BUPDATE,   "(update)",       " ctl -- : mark last block returned as modified")\
+ X(1, BSAVE,     "(save-buffers)", " ctl -- ior : write back modified buffers")\
+ X(1, BEMPTY,    "(empty-buffers)"," ctl -- : unassign all buffers")\
+ X(3, BFILE,     "(block-file)",   " c-addr u ctl -- ior : set file backing blocks")\
+ X(0, CCALL,     "ccall",          " n1...nn -- u? : call a named foreign function")\
+ X(2, LIBRARY,   "load-library",   " c-addr u -- ior : load a plugin library")\
+ X(0, NATIVE,    "run-native",     " -- : run a Forth word compiled to C")\
+ X(3, GENERATE,  "core2native",    " c-addr u xt -- ior : compile words to C")\
+ X(0, TAILCALL,  "(tail-call)",    " -- : turn a call ending the latest word into a jump")\
+ X(1, EFFECT,    "stack-effect",   " xt -- u n -1 | 0 : stack items a word needs and adds")\
+ X(3, FREADLINE, "read-line",      "c-addr u1 file-id -- u2 flag ior : read a line")\
+ X(3, FWRITELINE, "write-line",    "c-addr u file-id -- ior : write a line")\
+ X(3, ACCEPTER,  "(accept)",       "c-addr u char -- u | -1 : read input until char")\
+ X(1, STRIP,     "strip-core",     " xt-1 ... xt-n n -- ior : remove words not used by the xts")\
+ X(2, MODULE,    "(module)",       " c-addr u -- bool : load a file from its cache, or record it")\
+ X(0, STATS,     "stats",          " -- : print how much of its resources the interpreter has used")\
  X(0, LAST_INSTRUCTION, NULL, "")
 
 /**
@@ -992,12 +1472,18 @@ Forth interpreter.
  X("hidden-bit",  WORD_HIDDEN_BIT_OFFSET, "hide bit in CODE field")\
  X("hidden-mask", 1u << WORD_HIDDEN_BIT_OFFSET, "hide mask for CODE ")\
  X("compile-bit", COMPILING_BIT_OFFSET, "compile/immediate bit in CODE field")\
+ X("inline-mask", INLINE_BIT,   "inlining mask for CODE field")\
  X("dolist",      RUN,          "instruction for executing a words body")\
  X("dolit",       2,            "location of fake word for pushing numbers")\
  X("doconst",     CONST,        "instruction for pushing a constant")\
+ X("donative",    NATIVE,       "instruction for executing a word compiled to C")\
  X("bl",          ' ',          "space character")\
  X("')'",         ')',          "')' character")\
- X("cell",        1,            "space a single cell takes up")
+ X("cell",        1,            "space a single cell takes up")\
+ X("block-header", BLOCK_HEADER, "cells in the header of a block control area")\
+ X("block-fields", BLOCK_FIELDS, "cells used per buffer in a block control area")\
+ X("block-ahead", BLOCK_AHEAD,   "read ahead field in a block control area")\
+ X("block-dirty", BLOCK_DIRTY,   "modified field of a block buffer")
 
 /**
 @brief A structure that contains a constant to be added to the
@@ -1048,6 +1534,189 @@ int forth_logger(const char *prefix, const char *func,
 	return r;
 }
 
+/**
+@brief Forget the stack effects worked out for any word at or after **addr**,
+which is being written to as the dictionary grows, so a new word that ends
+up where a forgotten one was is worked out afresh, see "Stack effects".
+@param o    Forth environment being written to
+@param addr first cell written to
+**/
+static void effects_forget(forth_t *o, forth_cell_t addr)
+{
+	if (o->effect_count > addr)
+		o->effect_count = addr;
+}
+
+/**
+@brief Forget every stack effect that has been worked out if any of the
+cells written to are part of the threaded code of a word whose effect is
+known, as it, and the words that call it, may now have a different one,
+see "Stack effects".
+@param o     Forth environment being written to
+@param addr  first cell written to
+@param cells number of cells written, within the core
+@return true if the effects were forgotten
+**/
+static bool effects_written(forth_t *o, forth_cell_t addr, forth_cell_t cells)
+{
+	if (!o->analysed)
+		return false;
+	for (forth_cell_t i = addr; i < addr + cells; i++) {
+		if (o->analysed[i / CHAR_BIT] & (1u << (i % CHAR_BIT))) {
+			memset(o->analysed, 0, (o->core_size + CHAR_BIT - 1) / CHAR_BIT);
+			effects_forget(o, 0);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+@brief Record that a range of cells has been written to, so that the chunks
+containing them are saved by the next delta checkpoint. Writes to the
+registers and the stacks do not need recording as they are always saved.
+@param o     Forth environment whose memory has been written to
+@param addr  first cell written to
+@param cells number of cells written, the range is clipped to the core
+@return true if the threaded code of a word whose stack effect was worked
+out has been written to, and the effects have been forgotten
+**/
+static bool mark_dirty(forth_t *o, forth_cell_t addr, forth_cell_t cells)
+{
+	if (!cells || addr >= o->core_size)
+		return false;
+	if (cells > o->core_size - addr)
+		cells = o->core_size - addr;
+	forth_cell_t last = (addr + cells - 1) / CHECKPOINT_CHUNK;
+	for (forth_cell_t i = addr / CHECKPOINT_CHUNK; i <= last; i++)
+		o->dirty[i / CHAR_BIT] |= 1u << (i % CHAR_BIT);
+	return effects_written(o, addr, cells);
+}
+
+/**
+@brief The same as **mark_dirty**, but for a range of characters.
+@param o     Forth environment whose memory has been written to
+@param addr  character address of the first character written to
+@param chars number of characters written
+**/
+static bool mark_dirty_chars(forth_t *o, forth_cell_t addr, forth_cell_t chars)
+{
+	if (!chars || addr >= o->core_size * sizeof(forth_cell_t))
+		return false;
+	forth_cell_t end = addr + chars < addr ? (forth_cell_t)-1 : addr + chars;
+	forth_cell_t first = addr / sizeof(forth_cell_t);
+	return mark_dirty(o, first, ((end - 1) / sizeof(forth_cell_t)) - first + 1);
+}
+
+/**
+@brief The same as **mark_dirty**, but for a raw pointer which may or may not
+point into the Forth core, as used by instructions such as **MEMSET**.
+@param o     Forth environment whose memory may have been written to
+@param p     pointer to start of memory written to
+@param chars number of characters written
+**/
+static bool mark_dirty_pointer(forth_t *o, const void *p, forth_cell_t chars)
+{
+	uintptr_t start = (uintptr_t)o->m, addr = (uintptr_t)p;
+	if (addr >= start && addr < start + (o->core_size * sizeof(forth_cell_t)))
+		return mark_dirty_chars(o, addr - start, chars);
+	return false;
+}
+
+/**
+@brief Has a chunk been modified since the last checkpoint?
+@param o     Forth environment to check
+@param chunk chunk number, a cell address divided by **CHECKPOINT_CHUNK**
+@return true if the chunk is dirty
+**/
+static bool is_dirty(forth_t *o, forth_cell_t chunk)
+{
+	return o->dirty[chunk / CHAR_BIT] & (1u << (chunk % CHAR_BIT));
+}
+
+/**
+## File handles
+
+Files are never stored in cells as pointers, instead a file handle is an 
+index into **files**, a table held by the Forth object, along with a
+generation number. Each file opened gets a new generation number, so
+when a file is closed, or the core is saved and loaded again, any copies of
+its handle left lying around no longer match the table entry and are
+rejected, instead of referring to freed memory or an unrelated file. 
+Looking up a handle is a single comparison.
+
+The standard streams always have the same handles, with a generation of
+zero, so saved cores can keep referring to them.
+**/
+static forth_cell_t handle_make(forth_t *o, forth_cell_t i, FILE *file, forth_cell_t generation)
+{
+	o->files[i] = file;
+	o->generations[i] = generation;
+	return (generation << HANDLE_INDEX_BITS) | i;
+}
+
+/**
+@brief Get a handle for a file, allocating a new slot for it.
+@param o    Forth object holding the file table
+@param file file to get a handle for, may be NULL
+@return a new handle, or zero if 'file' is NULL or the table is full
+**/
+static forth_cell_t handle_open(forth_t *o, FILE *file)
+{
+	forth_cell_t *g = &o->m[HANDLE_GENERATION];
+	if (!file)
+		return 0;
+	for (forth_cell_t i = HANDLE_DYNAMIC; i < HANDLE_SLOTS; i++)
+		if (!o->files[i]) {
+			*g = *g >= HANDLE_GENERATION_MAX ? 1 : *g + 1;
+			mark_dirty(o, HANDLE_GENERATION, 1);
+			return handle_make(o, i, file, *g);
+		}
+	warning("file table full (%u files)", HANDLE_SLOTS);
+	return 0;
+}
+
+/**
+@brief Get a handle for a file passed in through the C API, if the file is
+already in the table its handle is reused, otherwise it takes a fixed slot.
+@param o     Forth object holding the file table
+@param file  file to get a handle for
+@param fixed slot to use if the file is not already present
+@return handle for 'file'
+**/
+static forth_cell_t handle_set(forth_t *o, FILE *file, forth_cell_t fixed)
+{
+	for (forth_cell_t i = HANDLE_STDIN; i < HANDLE_SLOTS; i++)
+		if (o->files[i] == file)
+			return (o->generations[i] << HANDLE_INDEX_BITS) | i;
+	return handle_make(o, fixed, file, 0);
+}
+
+/**
+@brief Look up the file a handle refers to.
+@param o Forth object holding the file table
+@param h handle to look up
+@return the file, or NULL if the handle is not valid
+**/
+static FILE *handle_file(forth_t *o, forth_cell_t h)
+{
+	forth_cell_t i = h & HANDLE_MASK;
+	return o->generations[i] == (h >> HANDLE_INDEX_BITS) ? o->files[i] : NULL;
+}
+
+/**
+@brief Remove a file from the file table, after which its handle is no
+longer valid, the file is not closed.
+@param o Forth object holding the file table
+@param h handle to remove, which must be valid
+**/
+static void handle_close(forth_t *o, forth_cell_t h)
+{
+	forth_cell_t i = h & HANDLE_MASK;
+	if (i >= HANDLE_DYNAMIC)
+		handle_make(o, i, NULL, 0);
+}
+
 /**
 @brief  Get a char from string input or a file
 @param  o   forth image containing information about current input stream
@@ -1088,12 +1757,15 @@ static int forth_get_char(forth_t *o)
 	}
 	switch (o->m[SOURCE_ID]) {
 	case FILE_IN:   
-		r = fgetc((FILE*)(o->m[FIN])); 
+		{
+			FILE *in = handle_file(o, o->m[FIN]);
+			r = in ? fgetc(in) : EOF;
+		}
 		break;
 	case STRING_IN: 
 		r = o->m[SIDX] >= o->m[SLEN] ? 
 			EOF : 
-			((char*)(o->m[SIN]))[o->m[SIDX]++];
+			((char*)cell_to_host(o, o->m[SIN]))[o->m[SIDX]++];
 			break;
 	default:        r = EOF;
 	}
@@ -1255,6 +1927,8 @@ static forth_cell_t compile(forth_t *o, forth_cell_t code, const char *str,
 		| (l << WORD_LENGTH_OFFSET) 
 		| (hide << WORD_HIDDEN_BIT_OFFSET)
 		| code; 
+	mark_dirty(o, head, m[DIC] - head);
+	effects_forget(o, head);
 	return cf;
 }
 
@@ -1338,6 +2012,9 @@ forth_cell_t forth_find(forth_t *o, const char *s)
 		m[grandparent] = pwd; /* grandparent = current */
 		m[parent] = m[pwd];   /* parent = current next */
 		m[pwd] = parent;      /* new next = parent */
+		mark_dirty(o, grandparent, 1);
+		mark_dirty(o, parent, 1);
+		mark_dirty(o, pwd, 1);
 	} 
 #else
 	for (;pwd > DICTIONARY_START && !match(m, pwd, s);)
@@ -1346,32 +2023,6 @@ forth_cell_t forth_find(forth_t *o, const char *s)
 	return pwd > DICTIONARY_START ? pwd + 1 : 0;
 }
 
-/**
-@brief Print a number in a given base to an output stream
-@param o    initialized forth environment
-@param out  output file stream
-@param u    number to print
-@return number of characters written, or negative on failure 
-**/
-static int print_cell(forth_t *o, FILE *out, forth_cell_t u)
-{
-	int i = 0, r = 0;
-	char s[64 + 1] = {0}; 
-	unsigned base = o->m[BASE];
-	base = base != 0 ? base : 10 ;
-	if (base >= 37)
-		return -1;
-	if (base == 10)
-		return fprintf(out, "%"PRIdCell, u);
-	do 
-		s[i++] = conv[u % base];
-	while ((u /= base));
-	for (r = --i; i >= 0; i--)
-		if (fputc(s[i], out) != s[i])
-			return -1;
-	return r;
-}
-
 /**
 **check_bounds** is used to both check that a memory access performed by
 the virtual machine is within range and as a crude method of debugging the
@@ -1447,13 +2098,94 @@ be converted to a C string so it can be passed to a C function.
 static char *forth_get_string(forth_t *o, jmp_buf *on_error, 
 		forth_cell_t **S, forth_cell_t f)
 {
-	forth_cell_t length = f + 1;
 	char *string = ((char*)o->m) + **S;
 	(*S)--;
-	check_is_asciiz(on_error, string, length);
+	check_is_asciiz(on_error, string, f);
 	return string;
 }
 
+/**
+@brief Get the file a handle on the stack refers to, throwing an error if 
+the handle is not valid, for example if the file has been closed.
+@param o        Forth environment holding the file table
+@param on_error error handler
+@param h        handle to look up
+@return a valid file
+**/
+static FILE *forth_get_file(forth_t *o, jmp_buf *on_error, forth_cell_t h)
+{
+	FILE *file = handle_file(o, h);
+	if (!file) {
+		error("invalid file-id %"PRIxCell, h);
+		longjmp(*on_error, RECOVERABLE);
+	}
+	return file;
+}
+
+/**
+All output made by the interpreter, as opposed to the output written by
+words such as **see** for debugging, goes through **output**. The handle
+**HANDLE_BUFFER_OUT** does not refer to a file but to the buffer given to
+**forth_set_buffer_output**, characters sent to it are copied straight on
+to the end of the buffer, which is grown as needed and always has a NUL
+after its contents.
+@param o        Forth environment holding the file table
+@param on_error error handler, if NULL an invalid handle is ignored
+@param h        handle to write to
+@param s        characters to write
+@param n        number of characters to write
+@return number of characters written
+**/
+static size_t output(forth_t *o, jmp_buf *on_error, forth_cell_t h, const char *s, size_t n)
+{
+	forth_buffer_t *b = o->buffer;
+	if (h != HANDLE_BUFFER_OUT || !b) {
+		FILE *file = on_error ? forth_get_file(o, on_error, h) : handle_file(o, h);
+		return file ? fwrite(s, 1, n, file) : 0;
+	}
+	if (b->length + n >= b->size) {
+		size_t size = b->size ? b->size : 64;
+		char *data = NULL;
+		while (b->length + n >= size)
+			size *= 2;
+		if (!(data = realloc(b->data, size)))
+			return 0;
+		b->data = data;
+		b->size = size;
+	}
+	memcpy(b->data + b->length, s, n);
+	b->length += n;
+	b->data[b->length] = '\0';
+	return n;
+}
+
+/**
+@brief Print a number in a given base to an output handle
+@param o        initialized forth environment
+@param on_error error handler, as for **output**
+@param h        handle to write to
+@param u        number to print
+@return number of characters written, or negative on failure 
+**/
+static int print_cell(forth_t *o, jmp_buf *on_error, forth_cell_t h, forth_cell_t u)
+{
+	char s[64 + 1] = {0}; 
+	int i = sizeof(s) - 1;
+	unsigned base = o->m[BASE];
+	base = base != 0 ? base : 10 ;
+	if (base >= 37)
+		return -1;
+	if (base == 10) {
+		i = sprintf(s, "%"PRIdCell, u);
+		return output(o, on_error, h, s, i) == (size_t)i ? i : -1;
+	}
+	do 
+		s[--i] = conv[u % base];
+	while ((u /= base));
+	i = sizeof(s) - 1 - i;
+	return output(o, on_error, h, s + sizeof(s) - 1 - i, i) == (size_t)i ? i : -1;
+}
+
 /** 
 Forth file access methods (or *fam*s) must be held in a single cell, this
 requires a method of translation from this cell into a string that can be
@@ -1471,18 +2203,19 @@ static const char* forth_get_fam(jmp_buf *on_error, forth_cell_t f)
 /**
 This prints out the Forth stack, which is useful for debugging. 
 **/
-static void print_stack(forth_t *o, FILE *out, forth_cell_t *S, forth_cell_t f)
+static void print_stack(forth_t *o, jmp_buf *on_error, forth_cell_t h, forth_cell_t *S, forth_cell_t f)
 { 
 	forth_cell_t depth = (forth_cell_t)(S - o->vstart);
-	fprintf(out, "%"PRIdCell": ", depth);
+	char s[64 + 3] = {0};
+	output(o, on_error, h, s, sprintf(s, "%"PRIdCell": ", depth));
 	if (!depth)
 		return;
 	for (forth_cell_t j = (S - o->vstart), i = 1; i < j; i++) {
-		print_cell(o, out, *(o->S + i + 1));
-		fputc(' ', out);
+		print_cell(o, on_error, h, *(o->S + i + 1));
+		output(o, on_error, h, " ", 1);
 	}
-	print_cell(o, out, f);
-	fputc(' ', out);
+	print_cell(o, on_error, h, f);
+	output(o, on_error, h, " ", 1);
 }
 
 /**
@@ -1497,39 +2230,331 @@ static void trace(forth_t *o, forth_cell_t instruction,
 	if (o->m[DEBUG] < FORTH_DEBUG_INSTRUCTION)
 		return;
 	fprintf(stderr, "\t( %s\t ", instruction_names[instruction]);
-	print_stack(o, stderr, S, f);
+	print_stack(o, NULL, o->m[STDERR], S, f);
 	fputs(" )\n", stderr);
 }
 
-/** 
-## API related functions and Initialization code 
+/**
+### Block buffers
+
+The following functions implement the block word set, a traditional Forth
+mechanism for accessing mass storage in fixed sized blocks. The buffers are
+managed with a least recently used replacement policy and modified buffers are
+only written back when they are evicted or when **save-buffers** is called.
+All blocks are stored in a single file which is seeked within, the file is
+opened on first use and kept open, it is not saved in the core file but is
+reopened from the name held in the control area after a core is loaded.
 **/
 
-void forth_set_file_input(forth_t *o, FILE *in)
+/**
+@brief Get the meta data fields of the buffer 'i' in a block control area
+@param ctl block control area
+@param i   buffer index
+@return pointer to that buffers fields, as described by **enum block_fields**
+**/
+static forth_cell_t *block_meta(forth_cell_t *ctl, forth_cell_t i)
 {
-	assert(o); 
-	assert(in);
-	o->unget_set    = false; /* discard character of push back */
-	o->m[SOURCE_ID] = FILE_IN;
-	o->m[FIN]       = (forth_cell_t)in;
+	return ctl + BLOCK_HEADER + (i * BLOCK_FIELDS);
 }
 
-void forth_set_file_output(forth_t *o, FILE *out)
+/**
+@brief Get a pointer to the data of buffer 'i' in a block control area
+@param ctl block control area
+@param i   buffer index
+@return pointer to the start of that buffers data
+**/
+static uint8_t *block_data(forth_cell_t *ctl, forth_cell_t i)
 {
-	assert(o);
-       	assert(out);
-	o->m[FOUT] = (forth_cell_t)out;
+	return (uint8_t*)(block_meta(ctl, ctl[BLOCK_COUNT])) + (i * BLOCK_SIZE);
 }
 
-void forth_set_block_input(forth_t *o, const char *s, size_t length)
+/**
+@brief Get the file backing a block control area, opening it if needed.
+@param o   initialized forth environment
+@param ctl block control area
+@return open file or NULL on failure
+**/
+static FILE *block_backing_file(forth_t *o, forth_cell_t *ctl)
+{
+	forth_cell_t c = ctl - o->m;
+	char *name = (char*)(ctl + BLOCK_NAME);
+	if (o->block_file && o->block_ctl == c)
+		return o->block_file;
+	if (o->block_file)
+		fclose(o->block_file);
+	o->block_file = NULL;
+	name[BLOCK_NAME_LENGTH - 1] = '\0';
+	if (!name[0])
+		return NULL;
+	errno = 0;
+	if (!(o->block_file = fopen(name, "r+b")))
+		o->block_file = fopen(name, "w+b");
+	o->block_ctl = c;
+	return o->block_file;
+}
+
+/**
+@brief Transfer a buffer to or from the backing file, reads past the end of
+the file result in a buffer full of zeros.
+@param o     initialized forth environment
+@param ctl   block control area
+@param i     buffer index
+@param write if true, write the buffer out, otherwise read it in
+@return zero on success, non zero on failure
+**/
+static int block_transfer(forth_t *o, forth_cell_t *ctl, forth_cell_t i, bool write)
+{
+	FILE *file = block_backing_file(o, ctl);
+	uint8_t *data = block_data(ctl, i);
+	forth_cell_t n = block_meta(ctl, i)[BLOCK_NUMBER];
+	size_t r;
+	if (!file || fseek(file, (long)((n - 1) * BLOCK_SIZE), SEEK_SET))
+		return -1;
+	if (write)
+		return fwrite(data, 1, BLOCK_SIZE, file) != BLOCK_SIZE;
+	mark_dirty_chars(o, data - (uint8_t*)o->m, BLOCK_SIZE);
+	r = fread(data, 1, BLOCK_SIZE, file);
+	memset(data + r, 0, BLOCK_SIZE - r);
+	r = ferror(file);
+	clearerr(file);
+	return r;
+}
+
+/**
+@brief Record that the control area and buffer meta data have been modified.
+@param o   initialized forth environment
+@param ctl block control area
+**/
+static void block_dirty(forth_t *o, forth_cell_t *ctl)
+{
+	mark_dirty(o, ctl - o->m, BLOCK_HEADER + (ctl[BLOCK_COUNT] * BLOCK_FIELDS));
+}
+
+/**
+@brief Find the buffer holding block 'n'
+@param ctl block control area
+@param n   block number to look for
+@return index of buffer, or the buffer count if block 'n' is not loaded
+**/
+static forth_cell_t block_lookup(forth_cell_t *ctl, forth_cell_t n)
+{
+	forth_cell_t i;
+	for (i = 0; i < ctl[BLOCK_COUNT]; i++)
+		if (block_meta(ctl, i)[BLOCK_NUMBER] == n)
+			break;
+	return i;
+}
+
+/**
+@brief Pick the least recently used buffer, free buffers are always picked
+first as their **BLOCK_USED** field is zero.
+@param ctl block control area
+@return index of buffer to replace
+**/
+static forth_cell_t block_victim(forth_cell_t *ctl)
+{
+	forth_cell_t v = 0;
+	for (forth_cell_t i = 1; i < ctl[BLOCK_COUNT]; i++)
+		if (block_meta(ctl, i)[BLOCK_USED] < block_meta(ctl, v)[BLOCK_USED])
+			v = i;
+	return v;
+}
+
+/**
+@brief Load block 'n' into buffer 'i', writing back what was in that buffer
+if it was modified.
+@param o   initialized forth environment
+@param ctl block control area
+@param i   buffer to replace
+@param n   block number to load
+@return zero on success, or a Forth exception number on failure
+**/
+static int block_fill(forth_t *o, forth_cell_t *ctl, forth_cell_t i, forth_cell_t n)
+{
+	forth_cell_t *meta = block_meta(ctl, i);
+	if (meta[BLOCK_NUMBER] && meta[BLOCK_DIRTY]) {
+		if (block_transfer(o, ctl, i, true))
+			return -34; /* block write exception */
+		meta[BLOCK_DIRTY] = 0;
+	}
+	meta[BLOCK_NUMBER] = n;
+	if (block_transfer(o, ctl, i, false)) {
+		meta[BLOCK_NUMBER] = 0;
+		return -33; /* block read exception */
+	}
+	return 0;
+}
+
+/**
+@brief Get a buffer containing block 'n', loading it if needed.
+@param o        initialized forth environment
+@param ctl      block control area
+@param n        block number
+@param[out] ior zero on success, or a Forth exception number
+@return character address of buffer within the Forth core
+**/
+static forth_cell_t block_get(forth_t *o, forth_cell_t *ctl, forth_cell_t n, forth_cell_t *ior)
+{
+	forth_cell_t i, a;
+	*ior = 0;
+	block_dirty(o, ctl);
+	if (!n || !ctl[BLOCK_COUNT]) {
+		*ior = -35; /* invalid block number */
+		return 0;
+	}
+	if ((i = block_lookup(ctl, n)) == ctl[BLOCK_COUNT]) {
+		i = block_victim(ctl);
+		if ((*ior = block_fill(o, ctl, i, n)))
+			return 0;
+		block_meta(ctl, i)[BLOCK_USED] = ++ctl[BLOCK_CLOCK];
+		/* read ahead only into a clean buffer, and not into the one
+		 * last returned as it may still be in use, failure is ignored */
+		a = block_victim(ctl);
+		if (ctl[BLOCK_AHEAD] && a != i && a != ctl[BLOCK_LAST]
+				&& !block_meta(ctl, a)[BLOCK_DIRTY] 
+				&& block_lookup(ctl, n + 1) == ctl[BLOCK_COUNT])
+			if (!block_fill(o, ctl, a, n + 1))
+				block_meta(ctl, a)[BLOCK_USED] = ctl[BLOCK_CLOCK];
+	}
+	block_meta(ctl, i)[BLOCK_USED] = ++ctl[BLOCK_CLOCK];
+	ctl[BLOCK_LAST] = i;
+	return block_data(ctl, i) - (uint8_t*)o->m;
+}
+
+/**
+@brief Write back all modified buffers to the backing file.
+@param o   initialized forth environment
+@param ctl block control area
+@return zero on success, or a Forth exception number on failure
+**/
+static int block_save(forth_t *o, forth_cell_t *ctl)
+{
+	int r = 0;
+	block_dirty(o, ctl);
+	for (forth_cell_t i = 0; i < ctl[BLOCK_COUNT]; i++) {
+		forth_cell_t *meta = block_meta(ctl, i);
+		if (!meta[BLOCK_NUMBER] || !meta[BLOCK_DIRTY])
+			continue;
+		if (block_transfer(o, ctl, i, true)) {
+			r = -34; /* block write exception */
+			continue;
+		}
+		meta[BLOCK_DIRTY] = 0;
+	}
+	if (o->block_file && fflush(o->block_file))
+		r = -34;
+	return r;
+}
+
+/**
+@brief Unassign all buffers, discarding any modifications.
+@param o   initialized forth environment
+@param ctl block control area
+**/
+static void block_empty(forth_t *o, forth_cell_t *ctl)
+{
+	block_dirty(o, ctl);
+	for (forth_cell_t i = 0; i < ctl[BLOCK_COUNT]; i++)
+		memset(block_meta(ctl, i), 0, BLOCK_FIELDS * sizeof(forth_cell_t));
+	ctl[BLOCK_CLOCK] = 0;
+}
+
+/**
+@brief Change the file backing the blocks, buffers are written back and 
+emptied first.
+@param o    initialized forth environment
+@param ctl  block control area
+@param name new file name
+@return zero on success, or a Forth exception number on failure
+**/
+static int block_set_file(forth_t *o, forth_cell_t *ctl, const char *name)
+{
+	int r = 0;
+	if (strlen(name) >= BLOCK_NAME_LENGTH)
+		return -35;
+	if ((r = block_save(o, ctl)))
+		return r;
+	block_empty(o, ctl);
+	if (o->block_file)
+		fclose(o->block_file);
+	o->block_file = NULL;
+	strcpy((char*)(ctl + BLOCK_NAME), name);
+	return 0;
+}
+
+/** 
+## API related functions and Initialization code 
+**/
+
+/**
+@brief Read from a file, without cancelling a run that stopped before it
+finished, as **EVALUATOR** does when it puts the input aside
+@param o  forth environment
+@param in file to read from
+**/
+static void input_file(forth_t *o, FILE *in)
+{
+	o->unget_set    = false; /* discard character of push back */
+	o->m[SOURCE_ID] = FILE_IN;
+	o->m[FIN]       = handle_set(o, in, HANDLE_FILE_IN);
+}
+
+/**
+@brief Read from a block of memory, without cancelling a run that stopped
+before it finished, as **EVALUATOR** and **forth_feed** need
+@param o      forth environment
+@param s      memory to read from
+@param length number of characters in **s**
+**/
+static void input_block(forth_t *o, const char *s, size_t length)
 {
-	assert(o);
-	assert(s);
 	o->unget_set = false;        /* discard character of push back */
 	o->m[SIDX] = 0;              /* m[SIDX] == start of string input */
 	o->m[SLEN] = length;         /* m[SLEN] == string len */
 	o->m[SOURCE_ID] = STRING_IN; /* read from string, not a file handle */
-	o->m[SIN] = (forth_cell_t)s; /* sin  == pointer to string input */
+	o->m[SIN] = host_to_cell(o, s, HOST_STRING_IN); /* sin  == pointer to string input */
+}
+
+void forth_set_file_input(forth_t *o, FILE *in)
+{
+	assert(o); 
+	assert(in);
+	forth_run_reset(o);
+	input_file(o, in);
+}
+
+void forth_set_file_output(forth_t *o, FILE *out)
+{
+	assert(o);
+       	assert(out);
+	o->m[FOUT] = handle_set(o, out, HANDLE_FILE_OUT);
+}
+
+void forth_set_buffer_output(forth_t *o, forth_buffer_t *b)
+{
+	assert(o);
+	o->buffer = b;
+	if (b)
+		o->m[FOUT] = HANDLE_BUFFER_OUT;
+	else if (o->m[FOUT] == HANDLE_BUFFER_OUT)
+		o->m[FOUT] = o->m[STDOUT];
+}
+
+const char *forth_output_view(forth_t *o, size_t *length)
+{
+	assert(o);
+	forth_buffer_t *b = o->buffer;
+	if (length)
+		*length = b ? b->length : 0;
+	return b && b->data ? b->data : "";
+}
+
+void forth_set_block_input(forth_t *o, const char *s, size_t length)
+{
+	assert(o);
+	assert(s);
+	forth_run_reset(o);
+	input_block(o, s, length);
 }
 
 void forth_set_string_input(forth_t *o, const char *s)
@@ -1546,6 +2571,59 @@ int forth_eval_block(forth_t *o, const char *s, size_t length)
 	return forth_run(o);
 }
 
+/**
+**forth_feed** runs input that is given to it a piece at a time, carrying
+on from where the last piece left off. Only what has not been read yet is
+kept between calls, usually part of a word, so a piece is read from where
+it is unless there is something left from the last one to put in front of
+it.
+**/
+int forth_feed(forth_t *o, const char *s, size_t length, int last)
+{
+	assert(o);
+	assert(s || !length);
+	const int unget = o->unget;
+	const bool unget_set = o->unget_set;
+	int r = 0;
+	if (o->feed_length) {
+		if (o->feed_length + length > o->feed_size) {
+			char *feed = realloc(o->feed, o->feed_length + length);
+			if (!feed)
+				return -1;
+			o->feed = feed;
+			o->feed_size = o->feed_length + length;
+		}
+		if (length)
+			memcpy(o->feed + o->feed_length, s, length);
+		s = o->feed;
+		length += o->feed_length;
+		o->feed_length = 0;
+	}
+	input_block(o, s ? s : "", length);
+	o->unget = unget;
+	o->unget_set = unget_set;
+	o->feeding = !last;
+	o->feed_depth = o->source_depth;
+	r = forth_run(o);
+	o->feeding = false;
+	if (r != FORTH_YIELDED || !o->starved)
+		return r;
+	o->starved = false;
+	const forth_cell_t rest = o->m[SLEN] - o->m[SIDX];
+	if (rest > o->feed_size) {
+		char *feed = realloc(o->feed, rest);
+		if (!feed) {
+			o->resume = 0;
+			return -1;
+		}
+		o->feed = feed;
+		o->feed_size = rest;
+	}
+	memmove(o->feed, (char*)cell_to_host(o, o->m[SIN]) + o->m[SIDX], rest);
+	o->feed_length = rest;
+	return 0;
+}
+
 int forth_eval(forth_t *o, const char *s)
 {
 	assert(o);
@@ -1563,15 +2641,215 @@ int forth_define_constant(forth_t *o, const char *name, forth_cell_t c)
 		return -1;
 	if (o->m[DIC] + 1 >= o->core_size)
 		return -1;
+	mark_dirty(o, o->m[DIC], 1);
 	o->m[o->m[DIC]++] = c; 
 	return 0;
 }
 
+/**
+@brief Make sure the foreign function table has at least 'count' entries,
+new entries are unbound until filled in.
+@param o     Forth object holding the table
+@param count minimum number of entries
+@return zero on success, negative if the table could not be grown
+**/
+static int cfunction_reserve(forth_t *o, forth_cell_t count)
+{
+	struct forth_cfunction *n = NULL;
+	if (count <= o->cfunction_count)
+		return 0;
+	if (!(n = realloc(o->cfunctions, sizeof(*n) * count)))
+		return -1;
+	memset(n + o->cfunction_count, 0, sizeof(*n) * (count - o->cfunction_count));
+	o->cfunctions = n;
+	o->cfunction_count = count;
+	return 0;
+}
+
+/**
+A foreign function word is made out of a header with the CCALL instruction
+followed by a single cell, an index into the **cfunctions** table held
+outside of the core. Host function pointers are meaningless in a saved
+core, the index is not, so after a core is loaded each word is bound to
+its function again at the index it already has, by name, with
+**forth_rebind_cfunction**, or by **plugins_rebind** for libraries.
+**/
+int forth_define_cfunction(forth_t *o, const char *name, 
+		forth_cfunction_t function, unsigned arity, unsigned results)
+{
+	assert(o);
+	assert(name);
+	if (arity > FORTH_CFUNCTION_MAX_ARITY || results > 1)
+		return -1;
+	if (strlen(name) >= MAXIMUM_WORD_LENGTH)
+		return -1;
+	if (o->m[DIC] + MAXIMUM_WORD_LENGTH/sizeof(forth_cell_t) + 3 >= o->core_size)
+		return -1;
+	if (cfunction_reserve(o, o->cfunction_count + 1) < 0)
+		return -1;
+	o->cfunctions[o->cfunction_count - 1] = (struct forth_cfunction) { 
+		.arity = arity, .results = results, .function = function 
+	};
+	compile(o, CCALL, name, true, false);
+	mark_dirty(o, o->m[DIC], 1);
+	o->m[o->m[DIC]++] = o->cfunction_count - 1; 
+	return 0;
+}
+
+int forth_rebind_cfunction(forth_t *o, const char *name, 
+		forth_cfunction_t function, unsigned arity, unsigned results)
+{
+	assert(o);
+	assert(name);
+	forth_cell_t xt = 0, index = 0;
+	if (arity > FORTH_CFUNCTION_MAX_ARITY || results > 1)
+		return -1;
+	if (!(xt = forth_find(o, name)) || instruction(o->m[xt]) != CCALL || xt + 1 >= o->core_size)
+		return -1;
+	if ((index = o->m[xt + 1]) >= o->core_size || cfunction_reserve(o, index + 1) < 0)
+		return -1;
+	o->cfunctions[index] = (struct forth_cfunction) { 
+		.arity = arity, .results = results, .function = function 
+	};
+	return 0;
+}
+
+/**
+@brief Open a plugin library and look up its descriptor, the handle is
+kept until the Forth object is freed.
+@param o    Forth object to hold the library handle
+@param path path of library
+@return the plugin descriptor, or NULL on failure
+**/
+#ifdef USE_PLUGINS
+static const struct forth_plugin *plugin_open(forth_t *o, const char *path)
+{
+	void *handle = NULL, **n = NULL;
+	const struct forth_plugin *p = NULL;
+	if (!(handle = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+		warning("could not load library, %s", dlerror());
+		return NULL;
+	}
+	p = dlsym(handle, FORTH_PLUGIN_SYMBOL);
+	if (!p || p->version != FORTH_PLUGIN_VERSION) {
+		warning("'%s' is not a libforth plugin", path);
+		goto fail;
+	}
+	if (!(n = realloc(o->libraries, sizeof(*n) * (o->library_count + 1))))
+		goto fail;
+	o->libraries = n;
+	n[o->library_count++] = handle;
+	return p;
+fail:
+	dlclose(handle);
+	return NULL;
+}
+
+/**
+@brief Close the library opened last by **plugin_open**, when its words
+could not be installed
+@param o Forth object holding the library handle
+**/
+static void plugin_close(forth_t *o)
+{
+	dlclose(o->libraries[--o->library_count]);
+}
+#else
+static const struct forth_plugin *plugin_open(forth_t *o, const char *path)
+{
+	(void)o;
+	warning("could not load library '%s', plugins are not supported", path);
+	return NULL;
+}
+
+static void plugin_close(forth_t *o)
+{
+	(void)o;
+}
+#endif
+
+int forth_load_library(forth_t *o, const char *path)
+{
+	assert(o);
+	assert(path);
+	const struct forth_plugin *p = NULL;
+	forth_cell_t *m = o->m, base = o->cfunction_count, l = strlen(path) + 1;
+	const forth_cell_t here = m[DIC], pwd = m[PWD], limit = o->vstart - m;
+	const forth_cell_t word = MAXIMUM_WORD_LENGTH/sizeof(forth_cell_t) + 3; /* most room a word takes */
+	l = (l + (sizeof(forth_cell_t) - 1)) / sizeof(forth_cell_t);
+	if (!(p = plugin_open(o, path)))
+		return -1;
+	if (here + LIBRARY_HEADER + l >= limit || p->count >= (limit - here - LIBRARY_HEADER - l) / word)
+		goto fail;
+	for (size_t i = 0; i < p->count; i++) {
+		const struct forth_plugin_word *w = &p->words[i];
+		if (forth_define_cfunction(o, w->name, w->function, w->arity, w->results) < 0)
+			goto fail;
+	}
+	m[m[DIC]]     = m[LIBRARY_LIST];
+	m[m[DIC] + 1] = base;
+	m[m[DIC] + 2] = p->count;
+	strcpy((char*)(m + m[DIC] + LIBRARY_HEADER), path);
+	mark_dirty(o, m[DIC], LIBRARY_HEADER + l);
+	mark_dirty(o, LIBRARY_LIST, 1);
+	m[LIBRARY_LIST] = m[DIC];
+	m[DIC] += LIBRARY_HEADER + l;
+	return 0;
+fail: /* take back any words that were defined */
+	m[DIC] = here;
+	m[PWD] = pwd;
+	o->cfunction_count = base;
+	effects_forget(o, here);
+	plugin_close(o);
+	return -1;
+}
+
+/**
+@brief After a core has been loaded the foreign functions it refers to
+have to be bound again, the libraries recorded in the core are loaded
+and their functions put back at the same indices they were given when
+they were first loaded. Libraries that cannot be loaded are skipped with
+a warning, calling their words will cause an error, and their indices are
+still kept so that functions defined afterwards do not take them.
+@param o Forth object that has just been loaded
+**/
+static void plugins_rebind(forth_t *o)
+{
+	forth_cell_t *m = o->m, e = m[LIBRARY_LIST], prev = o->core_size;
+	for (; e; prev = e, e = m[e]) {
+		const struct forth_plugin *p = NULL;
+		const char *path = (char*)(m + e + LIBRARY_HEADER);
+		forth_cell_t base = m[e + 1], count = m[e + 2];
+		if (e < DICTIONARY_START || e >= prev || e + LIBRARY_HEADER >= o->core_size
+		|| !memchr(path, 0, (o->core_size - e - LIBRARY_HEADER) * sizeof(forth_cell_t))) {
+			warning("corrupt library list entry %"PRIdCell, e);
+			return;
+		}
+		if (base + count < base || base + count >= o->core_size 
+		|| cfunction_reserve(o, base + count) < 0) {
+			warning("corrupt library list entry %"PRIdCell, e);
+			return;
+		}
+		if (!(p = plugin_open(o, path)))
+			continue;
+		if (p->count != count) {
+			warning("library '%s' does not match the core", path);
+			continue;
+		}
+		for (forth_cell_t i = 0; i < count; i++)
+			o->cfunctions[base + i] = (struct forth_cfunction) {
+				.arity   = p->words[i].arity,
+				.results = p->words[i].results, 
+				.function = p->words[i].function
+			};
+	}
+}
+
 void forth_set_args(forth_t *o, int argc, char **argv)
 { /* currently this is of little use to the interpreter */
 	assert(o);
 	o->m[ARGC] = argc;
-	o->m[ARGV] = (forth_cell_t)argv;
+	o->m[ARGV] = host_to_cell(o, argv, 0);
 }
 
 int forth_is_invalid(forth_t *o)
@@ -1624,16 +2902,20 @@ static void forth_make_default(forth_t *o, size_t size, FILE *in, FILE *out)
 {
 	assert(o && size >= MINIMUM_CORE_SIZE && in && out);
 	o->core_size     = size;
+	o->dirty         = (uint8_t*)(o->m + size); /* bitmap follows core */
 	o->m[STACK_SIZE] = size / MINIMUM_STACK_SIZE > MINIMUM_STACK_SIZE ?
 				size / MINIMUM_STACK_SIZE :
 				MINIMUM_STACK_SIZE;
 
 	o->s             = (uint8_t*)(o->m + STRING_OFFSET); /*skip registers*/
-	o->m[FOUT]       = (forth_cell_t)out;
-	o->m[START_ADDR] = (forth_cell_t)&(o->m);
-	o->m[STDIN]      = (forth_cell_t)stdin;
-	o->m[STDOUT]     = (forth_cell_t)stdout;
-	o->m[STDERR]     = (forth_cell_t)stderr;
+#ifdef USE_32BIT_CELLS
+	o->host[HOST_CORE] = o->m;
+#endif
+	o->m[START_ADDR] = host_to_cell(o, o->m, 0);
+	o->m[STDIN]      = handle_make(o, HANDLE_STDIN,  stdin,  0);
+	o->m[STDOUT]     = handle_make(o, HANDLE_STDOUT, stdout, 0);
+	o->m[STDERR]     = handle_make(o, HANDLE_STDERR, stderr, 0);
+	o->m[FOUT]       = handle_set(o, out, HANDLE_FILE_OUT);
 	o->m[RSTK] = size - o->m[STACK_SIZE]; /* set up return stk ptr */
 	o->m[ARGC] = o->m[ARGV] = 0;
 	o->S       = o->m + size - (2 * o->m[STACK_SIZE]); /* v. stk pointer */
@@ -1678,6 +2960,79 @@ forth_cell_t forth_round_up_pow2(forth_cell_t r)
 	return up;
 }
 
+/**
+## Initial image
+
+Building the initial dictionary, which **forth_init** does by compiling the
+names of the instructions, defining constants and then evaluating the
+**initial_forth_program**, is the same every time apart from a few cells
+that depend on the size of the core. **forth_generate_image** writes out
+the dictionary it builds as a C array, and if the interpreter is rebuilt
+with **USE_INITIAL_IMAGE** defined the generated file is included here (see
+the "forth-image" make target), **forth_init** then copies it in instead,
+only having to fill in those few cells. The image records the size of a
+cell and the number of instructions it was made with, if these do not
+match this interpreter the dictionary is built as normal.
+**/
+#ifdef USE_INITIAL_IMAGE
+#include "image.gen.c"
+#endif
+
+/**
+@brief Copy the initial dictionary into a newly allocated Forth
+environment, if the interpreter has been built with one.
+@param o   Forth environment, with its defaults already set
+@param in  Input file, as passed to **forth_init**
+@param out Output file, as passed to **forth_init**
+@return true if the image was copied in, false if the dictionary has to
+be built instead
+**/
+static bool image_load(forth_t *o, FILE *in, FILE *out)
+{
+#ifdef USE_INITIAL_IMAGE
+	const forth_cell_t length = sizeof(forth_image) / sizeof(forth_image[0]);
+	const forth_cell_t stack_start = o->vstart - o->m;
+	if (forth_image_cell_size != sizeof(forth_cell_t) 
+	|| forth_image_instructions != LAST_INSTRUCTION 
+	|| length >= stack_start)
+		return false;
+	memcpy(o->m, forth_image, sizeof(forth_image));
+	forth_make_default(o, o->core_size, in, out); /* registers again */
+	o->m[forth_image_stack_start] = stack_start;
+	o->m[forth_image_max_core]    = o->core_size;
+	mark_dirty(o, 0, length);
+	return true;
+#else
+	(void)o;
+	(void)in;
+	(void)out;
+	return false;
+#endif
+}
+
+int forth_generate_image(FILE *out)
+{
+	assert(out);
+	forth_t *o = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL);
+	if (!o)
+		return -1;
+	const forth_cell_t length = o->m[DIC];
+	fprintf(out, "/* initial dictionary generated by forth_generate_image, do not edit */\n");
+	fprintf(out, "static const forth_cell_t forth_image_cell_size = %zu;\n", sizeof(forth_cell_t));
+	fprintf(out, "static const forth_cell_t forth_image_instructions = %d;\n", (int)LAST_INSTRUCTION);
+	fprintf(out, "static const forth_cell_t forth_image_stack_start = %"PRIdCell";\n", forth_find(o, "stack-start") + 1);
+	fprintf(out, "static const forth_cell_t forth_image_max_core = %"PRIdCell";\n", forth_find(o, "max-core") + 1);
+	fprintf(out, "static const forth_cell_t forth_image[] = {");
+	for (forth_cell_t i = 0; i < length; i++) {
+		/* host pointers are of no use to anyone else */
+		forth_cell_t c = i == START_ADDR || i == SIN ? 0 : o->m[i];
+		fprintf(out, "%s0x%"PRIxCell",", i % 8 ? " " : "\n\t", c);
+	}
+	fprintf(out, "\n};\n");
+	forth_free(o);
+	return ferror(out) ? -1 : 0;
+}
+
 /**
 **forth_init** is a complex function that returns a fully initialized forth
 environment we can start executing Forth in, it does the usual task of
@@ -1692,7 +3047,9 @@ forth_t *forth_init(size_t size, FILE *in, FILE *out,
 	forth_t *o;
 	assert(in);
 	assert(out);
+#ifndef USE_32BIT_CELLS
 	BUILD_BUG_ON(sizeof(forth_cell_t) < sizeof(uintptr_t));
+#endif
 	size = forth_round_up_pow2(size);
 	pow  = forth_blog2(size);
 /**
@@ -1718,7 +3075,11 @@ if we are passed a lower number the programmer has made a mistake somewhere
 and should be informed of this problem.
 **/
 	VERIFY(size >= MINIMUM_CORE_SIZE);
-	if (!(o = calloc(1, sizeof(*o) + sizeof(forth_cell_t)*size)))
+#ifdef USE_32BIT_CELLS
+	if (size > MAXIMUM_32BIT_CORE_SIZE)
+		return NULL;
+#endif
+	if (!(o = calloc(1, sizeof(*o) + sizeof(forth_cell_t)*size + CHECKPOINT_BITMAP(size))))
 		return NULL;
 
 /** 
@@ -1735,6 +3096,13 @@ the interpreter:
 	o->calls = calls; /* pass over functions for CALL */
 	m = o->m;         /* a local variable only for convenience */
 
+/**
+If there is an image of the dictionary we are about to build we are done,
+see "Initial image":
+**/
+	if (image_load(o, in, out))
+		goto finished;
+
 /**
 The next section creates a word that calls **READ**, then **TAIL**,
 then itself. This is what the virtual machine will run at startup so
@@ -1828,6 +3196,7 @@ conditional constructs
 set the input streams to point to a string, we need to reset them
 to they point to the file **in**
 **/
+finished:
 	forth_set_file_input(o, in);  /*set up input after our eval */
 	o->line = 1;
 	return o;
@@ -1846,122 +3215,907 @@ int forth_dump_core(forth_t *o, FILE *dump)
 	return w != fwrite(o, 1, w, dump) ? -1: 0;
 }
 
-/** 
-We can save the virtual machines working memory in a way, called serialization,
-such that we can load the saved file back in and continue execution using this
-save environment. Only the three previously mentioned fields are serialized;
-**m**, **core_size** and the **header**.
+/**
+### Core file compression
+
+The following functions implement the run length encoding described along
+with **enum core_format**, which is used to shrink core files.
 **/
-int forth_save_core_file(forth_t *o, FILE *dump)
+
+/**
+@brief Write out a run of literal bytes, if there are any.
+@param s   literal bytes to write
+@param n   number of bytes, no more than RLE_LITERAL_MAX
+@param out file to write to
+@return zero on success, non zero on failure
+**/
+static int rle_literals(const uint8_t *s, size_t n, FILE *out)
 {
-	assert(o && dump);
-	uint64_t r1, r2, core_size = o->core_size;
-	if (forth_is_invalid(o))
-		return -1;
-	r1 = fwrite(o->header,  1, sizeof(o->header), dump);
-	r2 = fwrite(o->m,       1, sizeof(forth_cell_t) * core_size, dump);
-	if (r1+r2 != (sizeof(o->header) + sizeof(forth_cell_t) * core_size))
+	if (!n)
+		return 0;
+	if (fputc(n - 1, out) == EOF)
 		return -1;
-	return 0;
+	return fwrite(s, 1, n, out) != n;
 }
 
-/** 
-Logically if we can save the core for future reuse, then we must have a
-function for loading the core back in, this function returns a reinitialized
-Forth object. Validation on the object is performed to make sure that it is
-a valid object and not some other random file, endianess, **core_size**, cell
-size and the headers magic constants field are all checked to make sure they
-are correct and compatible with this interpreter.
-
-**forth_make_default** is called to replace any instances of pointers stored
-in registers which are now invalid after we have loaded the file from disk.
+/**
+@brief Run length encode a block of memory and write it to a file.
+@param in  memory to encode
+@param len length of memory in bytes
+@param out file to write to
+@return zero on success, non zero on failure
 **/
-forth_t *forth_load_core_file(FILE *dump)
-{ 
-	uint8_t actual[sizeof(header)] = {0},   /* read in header */
-		expected[sizeof(header)] = {0}; /* what we expected */
-	forth_t *o = NULL;
-	uint64_t w = 0, core_size = 0;
-	assert(dump);
-	make_header(expected, 0);
-	if (sizeof(actual) != fread(actual, 1, sizeof(actual), dump)) {
-		goto fail; /* no header */
-	}
-	if (memcmp(expected, actual, sizeof(header)-1)) {
-		goto fail; /* invalid or incompatible header */
+static int rle_encode(const uint8_t *in, size_t len, FILE *out)
+{
+	size_t i = 0, lit = 0, run, max;
+	while (i < len) {
+		max = in[i] ? RLE_REPEAT_MAX : RLE_ZERO_MAX;
+		for (run = 1; i + run < len && run < max && in[i + run] == in[i]; run++)
+			;
+		if (run < RLE_REPEAT_MIN) {
+			i++;
+			if (++lit == RLE_LITERAL_MAX) {
+				if (rle_literals(in + i - lit, lit, out))
+					return -1;
+				lit = 0;
+			}
+			continue;
+		}
+		if (rle_literals(in + i - lit, lit, out))
+			return -1;
+		lit = 0;
+		if (in[i]) {
+			fputc(0x80 + run - RLE_REPEAT_MIN, out);
+			fputc(in[i], out);
+		} else {
+			fputc(0xC0 | ((run - 1) >> 16), out);
+			fputc(((run - 1) >> 8) & 0xFF, out);
+			fputc((run - 1) & 0xFF, out);
+		}
+		i += run;
 	}
-	core_size = 1 << actual[LOG2_SIZE];
+	if (rle_literals(in + i - lit, lit, out))
+		return -1;
+	return ferror(out);
+}
 
-	if (core_size < MINIMUM_CORE_SIZE) {
-		error("core size of %"PRIdCell" is too small", core_size);
-		goto fail; 
+/**
+@brief Decode run length encoded data, the output must already be zeroed.
+@param in        encoded data
+@param ilen      length of encoded data
+@param out       zeroed memory to decode into
+@param olen      number of bytes to decode
+@param[out] used number of bytes of encoded data consumed
+@return zero on success, non zero if the input is malformed
+**/
+static int rle_decode(const uint8_t *in, size_t ilen, uint8_t *out, size_t olen, size_t *used)
+{
+	size_t i = 0, j = 0, n;
+	*used = 0;
+	while (j < olen) {
+		if (i >= ilen)
+			return -1;
+		uint8_t c = in[i++];
+		if (c < 0x80) {
+			n = c + 1;
+			if (i + n > ilen || j + n > olen)
+				return -1;
+			memcpy(out + j, in + i, n);
+			i += n;
+		} else if (c < 0xC0) {
+			n = c - 0x80 + RLE_REPEAT_MIN;
+			if (i >= ilen || j + n > olen)
+				return -1;
+			memset(out + j, in[i++], n);
+		} else { /* zero run, nothing to do but advance */
+			if (i + 2 > ilen)
+				return -1;
+			n = (((size_t)(c & 0x3F) << 16) | ((size_t)in[i] << 8) | in[i + 1]) + 1;
+			i += 2;
+			if (j + n > olen)
+				return -1;
+		}
+		j += n;
+	}
+	*used = i;
+	return 0;
+}
+
+/**
+@brief Work out which parts of **m** need saving in a sparse core.
+@param o        forth object to inspect
+@param[out] seg start and length, in cells, of each segment
+**/
+static void core_segments(forth_t *o, forth_cell_t seg[CORE_SEGMENTS][2])
+{
+	forth_cell_t size = o->core_size;
+	forth_cell_t v = o->vstart - o->m, vtop = o->S - o->m;
+	forth_cell_t r = size - o->m[STACK_SIZE], rtop = o->m[RSTK];
+	seg[0][0] = 0;
+	seg[0][1] = o->m[DIC] < size ? o->m[DIC] : size;
+	seg[1][0] = v;
+	seg[1][1] = vtop >= v && vtop < size ? vtop - v + 1 : 0;
+	seg[2][0] = r;
+	seg[2][1] = rtop >= r && rtop < size ? rtop - r + 1 : 0;
+}
+
+/** 
+We can save the virtual machines working memory in a way, called serialization,
+such that we can load the saved file back in and continue execution using this
+save environment. Only the three previously mentioned fields are serialized;
+**m**, **core_size** and the **header**. The options determine whether all of
+**m** is written out or just the segments in use, and whether it is compressed.
+**/
+int forth_save_core_file_options(forth_t *o, FILE *dump, unsigned options)
+{
+	assert(o && dump);
+	uint8_t h[sizeof(o->header)];
+	forth_cell_t seg[CORE_SEGMENTS][2] = { { 0, o->core_size } }, count = 1;
+	if (forth_is_invalid(o))
+		return -1;
+	memcpy(h, o->header, sizeof(h));
+	h[FORMAT] = CORE_RAW;
+	if (options & FORTH_CORE_COMPRESS)
+		h[FORMAT] |= CORE_COMPRESSED;
+	if (options & FORTH_CORE_SPARSE) {
+		h[FORMAT] |= CORE_SPARSE;
+		core_segments(o, seg);
+		count = CORE_SEGMENTS;
+	}
+	if (fwrite(h, 1, sizeof(h), dump) != sizeof(h))
+		return -1;
+	if (h[FORMAT] & CORE_SPARSE) {
+		if (fwrite(&count, sizeof(count), 1, dump) != 1)
+			return -1;
+		if (fwrite(seg, sizeof(seg[0]), count, dump) != count)
+			return -1;
+	}
+	for (forth_cell_t i = 0; i < count; i++) {
+		uint8_t *start = (uint8_t*)(o->m + seg[i][0]);
+		size_t length  = sizeof(forth_cell_t) * seg[i][1];
+		if (h[FORMAT] & CORE_COMPRESSED) {
+			if (rle_encode(start, length, dump))
+				return -1;
+		} else if (fwrite(start, 1, length, dump) != length) {
+			return -1;
+		}
+	}
+	memset(o->dirty, 0, CHECKPOINT_BITMAP(o->core_size));
+	return 0;
+}
+
+int forth_save_core_file(forth_t *o, FILE *dump)
+{
+	return forth_save_core_file_options(o, dump, FORTH_CORE_SPARSE);
+}
+
+/**
+@brief Check a header read in from a core file against the one this
+interpreter would produce, and get the size of the core from it.
+@param actual         header read in
+@param delta          true if a delta checkpoint is expected, false if a core
+@param[out] core_size size of core in cells
+@return zero if the header is valid, non zero otherwise
+**/
+static int core_header_check(const uint8_t *actual, bool delta, uint64_t *core_size)
+{
+	uint8_t expected[sizeof(header)] = {0};
+	make_header(expected, 0);
+	*core_size = 0;
+	if (memcmp(expected, actual, LOG2_SIZE))
+		return -1; /* invalid or incompatible header */
+	if (actual[FORMAT] & ~(CORE_COMPRESSED | CORE_SPARSE | CORE_DELTA)) {
+		error("unknown core format %x", (unsigned)actual[FORMAT]);
+		return -1;
+	}
+	if (!!(actual[FORMAT] & CORE_DELTA) != delta) {
+		error("core format %x is %s delta checkpoint", (unsigned)actual[FORMAT], delta ? "not a" : "a");
+		return -1;
+	}
+	if (actual[LOG2_SIZE] >= sizeof(forth_cell_t) * CHAR_BIT) {
+		error("core size of 2^%u is too large", (unsigned)actual[LOG2_SIZE]);
+		return -1;
+	}
+	*core_size = (uint64_t)1 << actual[LOG2_SIZE];
+	if (*core_size < MINIMUM_CORE_SIZE) {
+		error("core size of %"PRIu64" is too small", *core_size);
+		return -1;
+	}
+#ifdef USE_32BIT_CELLS
+	if (*core_size > MAXIMUM_32BIT_CORE_SIZE) {
+		error("core size of %"PRIu64" is too large for 32-bit cells", *core_size);
+		return -1;
 	}
-	w = sizeof(*o) + (sizeof(forth_cell_t) * core_size);
+#endif
+	return 0;
+}
+
+/**
+@brief Allocate a Forth object large enough for a core of a given size
+@param core_size size of core in cells
+@return zeroed Forth object or NULL on failure
+**/
+static forth_t *core_allocate(uint64_t core_size)
+{
+	forth_t *o;
+	uint64_t w = sizeof(*o) + (sizeof(forth_cell_t) * core_size) + CHECKPOINT_BITMAP(core_size);
 	errno = 0;
-	if (!(o = calloc(w, 1))) {
-		error("allocation of size %"PRId64" failed, %s", w, forth_strerror());
-		goto fail; 
+	if (!(o = calloc(w, 1)))
+		error("allocation of size %"PRIu64" failed, %s", w, forth_strerror());
+	return o;
+}
+
+/**
+@brief Read in the rest of a file into memory
+@param in          file to read from
+@param[out] length number of bytes read in
+@return allocated memory containing the file contents, or NULL on failure
+**/
+static uint8_t *read_remaining(FILE *in, size_t *length)
+{
+	size_t size = 4096, r;
+	uint8_t *m = malloc(size), *n;
+	*length = 0;
+	if (!m)
+		return NULL;
+	while ((r = fread(m + *length, 1, size - *length, in)) > 0) {
+		*length += r;
+		if (*length < size)
+			continue;
+		if (!(n = realloc(m, size *= 2))) {
+			free(m);
+			return NULL;
+		}
+		m = n;
+	}
+	if (ferror(in)) {
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+/**
+@brief Fill in **m** from the data following a core files header, which
+may be compressed, sparse, both or neither.
+@param o         newly allocated and zeroed forth object
+@param core_size size of **m** in cells
+@param format    format flags from the header
+@param in        data following the header
+@param ilen      length of that data in bytes
+@return zero on success, non zero if the data is malformed
+**/
+static int core_load_segments(forth_t *o, uint64_t core_size, uint8_t format, const uint8_t *in, size_t ilen)
+{
+	forth_cell_t count = 1, start, length;
+	const uint8_t *table = NULL;
+	size_t used;
+	if (format & CORE_SPARSE) {
+		if (ilen < sizeof(count))
+			return -1;
+		memcpy(&count, in, sizeof(count));
+		in += sizeof(count), ilen -= sizeof(count);
+		if (count > ilen / (2 * sizeof(forth_cell_t)))
+			return -1;
+		table = in;
+		in += 2 * sizeof(forth_cell_t) * count;
+		ilen -= 2 * sizeof(forth_cell_t) * count;
 	}
+	for (forth_cell_t i = 0; i < count; i++) {
+		start = 0, length = core_size;
+		if (table) {
+			memcpy(&start,  table + (2 * i)     * sizeof(forth_cell_t), sizeof(start));
+			memcpy(&length, table + (2 * i + 1) * sizeof(forth_cell_t), sizeof(length));
+		}
+		if (start > core_size || length > core_size - start)
+			return -1;
+		uint8_t *out = (uint8_t*)(o->m + start);
+		size_t olen  = sizeof(forth_cell_t) * length;
+		if (format & CORE_COMPRESSED) {
+			if (rle_decode(in, ilen, out, olen, &used))
+				return -1;
+		} else {
+			if (ilen < olen)
+				return -1;
+			memcpy(out, in, olen);
+			used = olen;
+		}
+		in += used, ilen -= used;
+	}
+	return 0;
+}
+
+/** 
+Logically if we can save the core for future reuse, then we must have a
+function for loading the core back in, this function returns a reinitialized
+Forth object. Validation on the object is performed to make sure that it is
+a valid object and not some other random file, endianess, **core_size**, cell
+size and the headers magic constants field are all checked to make sure they
+are correct and compatible with this interpreter. Compressed and sparse cores
+are unpacked directly into the newly allocated object.
+
+**forth_make_default** is called to replace any instances of pointers stored
+in registers which are now invalid after we have loaded the file from disk.
+**/
+forth_t *forth_load_core_file(FILE *dump)
+{ 
+	uint8_t actual[sizeof(header)] = {0}; /* read in header */
+	forth_t *o = NULL;
+	uint8_t *data = NULL;
+	size_t length = 0;
+	uint64_t w = 0, core_size = 0;
+	assert(dump);
+	if (sizeof(actual) != fread(actual, 1, sizeof(actual), dump))
+		goto fail; /* no header */
+	if (core_header_check(actual, false, &core_size))
+		goto fail;
+	if (!(o = core_allocate(core_size)))
+		goto fail; 
 	w = sizeof(forth_cell_t) * core_size;
-	if (w != fread(o->m, 1, w, dump)) {
+	if (actual[FORMAT] != CORE_RAW) {
+		if (!(data = read_remaining(dump, &length))) {
+			error("reading core failed, %s", forth_strerror());
+			goto fail;
+		}
+		if (core_load_segments(o, core_size, actual[FORMAT], data, length)) {
+			error("invalid core (format %x, %zu bytes)", (unsigned)actual[FORMAT], length);
+			goto fail;
+		}
+		free(data);
+	} else if (w != fread(o->m, 1, w, dump)) {
 		error("file too small (expected %"PRId64")", w);
 		goto fail;
 	}
 	o->core_size = core_size;
-	memcpy(o->header, actual, sizeof(o->header));
+	make_header(o->header, actual[LOG2_SIZE]);
 	forth_make_default(o, core_size, stdin, stdout);
+	plugins_rebind(o);
 	return o;
 fail:
+	free(data);
 	free(o);
 	return NULL;
 }
 
 /**
-The following function allows us to load a core file from memory:
+The following function allows us to load a core file from memory, the memory
+should contain a core, including its header, as produced by either
+**forth_save_core_memory** or **forth_save_core_file_options**.
 **/
 forth_t *forth_load_core_memory(char *m, size_t size)
 {
 	assert(m); 
-	assert((size / sizeof(forth_cell_t)) >= MINIMUM_CORE_SIZE);
 	forth_t *o;
+	uint64_t core_size = 0;
+	const uint8_t *actual = (uint8_t*)m;
 	size_t offset = sizeof(o->header);
-	size -= offset;
-	errno = 0;
-	o = calloc(sizeof(*o) + size, 1);
-	if (!o) {
-		error("allocation of size %zu failed, %s", 
-				sizeof(*o) + size, forth_strerror());
+	if (size < offset || core_header_check(actual, false, &core_size))
+		return NULL;
+	if (!(o = core_allocate(core_size)))
+		return NULL;
+	if (core_load_segments(o, core_size, actual[FORMAT], actual + offset, size - offset)) {
+		error("invalid core (format %x, %zu bytes)", (unsigned)actual[FORMAT], size);
+		free(o);
 		return NULL;
 	}
-	make_header(o->header, forth_blog2(size));
-	memcpy(o->m, m + offset, size);
-	forth_make_default(o, size / sizeof(forth_cell_t), stdin, stdout);
+	make_header(o->header, actual[LOG2_SIZE]);
+	forth_make_default(o, core_size, stdin, stdout);
+	plugins_rebind(o);
 	return o;
 }
 
 /**
 And likewise we will want to be able to save to memory as well, the
-load and save functions for memory expect headers *not* to be present.
+memory contains a header followed by a sparse core, so only the
+segments in use are copied.
 **/
 char *forth_save_core_memory(forth_t *o, size_t *size)
 {
 	assert(o && size);
-	char *m;
+	char *m, *p;
+	forth_cell_t seg[CORE_SEGMENTS][2], count = CORE_SEGMENTS;
 	*size = 0;
 	errno = 0;
-	uint64_t w = o->core_size;
-	m = malloc(w * sizeof(forth_cell_t) + sizeof(o->header));
+	core_segments(o, seg);
+	uint64_t w = sizeof(o->header) + sizeof(count) + sizeof(seg);
+	for (forth_cell_t i = 0; i < count; i++)
+		w += sizeof(forth_cell_t) * seg[i][1];
+	m = malloc(w);
 	if (!m) {
-		error("allocation of size %zu failed, %s", 
-				o->core_size * sizeof(forth_cell_t), forth_strerror());
+		error("allocation of size %"PRIu64" failed, %s", w, forth_strerror());
 		return NULL;
 	}
 	memcpy(m, o->header, sizeof(o->header)); /* copy header */
-	memcpy(m + sizeof(o->header), o->m, w); /* core */
-	*size = o->core_size * sizeof(forth_cell_t) + sizeof(o->header);
+	m[FORMAT] = CORE_SPARSE;
+	p = m + sizeof(o->header);
+	memcpy(p, &count, sizeof(count));
+	p += sizeof(count);
+	memcpy(p, seg, sizeof(seg));
+	p += sizeof(seg);
+	for (forth_cell_t i = 0; i < count; i++) { /* core segments */
+		memcpy(p, o->m + seg[i][0], sizeof(forth_cell_t) * seg[i][1]);
+		p += sizeof(forth_cell_t) * seg[i][1];
+	}
+	*size = w;
 	return m;
 }
 
+/**
+@brief Find the next run of modified chunks.
+@param o          Forth environment to search
+@param[in,out] at chunk to start searching from, set to the end of the run
+@param[out] run   start and length, in cells, of the run found
+@return true if a run was found, false if there are no more
+**/
+static bool dirty_run(forth_t *o, forth_cell_t *at, forth_cell_t run[2])
+{
+	forth_cell_t i = *at, chunks = o->core_size / CHECKPOINT_CHUNK;
+	for (; i < chunks && !is_dirty(o, i); i++)
+		;
+	if (i >= chunks)
+		return false;
+	run[0] = i;
+	for (; i < chunks && is_dirty(o, i); i++)
+		;
+	run[1] = (i - run[0]) * CHECKPOINT_CHUNK;
+	run[0] *= CHECKPOINT_CHUNK;
+	*at = i;
+	return true;
+}
+
+/**
+Saving the entire core for every checkpoint of a long running interpreter is
+expensive when the core is large, instead every write to memory outside of
+the registers and stacks marks the chunk it falls within as being dirty, and
+a delta checkpoint only contains those chunks. The registers and the live
+parts of the stacks are always written out. The bitmap of dirty chunks is
+cleared by this function and by **forth_save_core_file_options**, which makes
+a full checkpoint that subsequent deltas can be applied to.
+**/
+int forth_checkpoint_delta(forth_t *o, FILE *delta)
+{
+	assert(o && delta);
+	uint8_t h[sizeof(o->header)];
+	forth_cell_t seg[CORE_SEGMENTS][2], run[2], at, count = 0;
+	if (forth_is_invalid(o))
+		return -1;
+	core_segments(o, seg);
+	mark_dirty(o, 0, DICTIONARY_START);
+	mark_dirty(o, seg[1][0], seg[1][1]);
+	mark_dirty(o, seg[2][0], seg[2][1]);
+	for (at = 0; dirty_run(o, &at, run);)
+		count++;
+
+	memcpy(h, o->header, sizeof(h));
+	h[FORMAT] = CORE_SPARSE | CORE_DELTA;
+	if (fwrite(h, 1, sizeof(h), delta) != sizeof(h))
+		return -1;
+	if (fwrite(&count, sizeof(count), 1, delta) != 1)
+		return -1;
+	for (at = 0; dirty_run(o, &at, run);)
+		if (fwrite(run, sizeof(run), 1, delta) != 1)
+			return -1;
+	for (at = 0; dirty_run(o, &at, run);)
+		if (fwrite(o->m + run[0], sizeof(forth_cell_t), run[1], delta) != run[1])
+			return -1;
+	memset(o->dirty, 0, CHECKPOINT_BITMAP(o->core_size));
+	return 0;
+}
+
+/**
+Applying a delta checkpoint overwrites the chunks it contains, if a core is
+loaded and then each delta made after it is applied in turn then the result
+is the same as the interpreter that made the last delta, which can then be
+saved as a single core again. Like loading a core the registers that contain
+pointers, and the input and output, are reset afterwards.
+**/
+int forth_apply_delta(forth_t *o, FILE *delta)
+{
+	assert(o && delta);
+	uint8_t actual[sizeof(header)] = {0};
+	uint8_t *data = NULL;
+	size_t length = 0;
+	uint64_t core_size = 0;
+	int r = -1;
+	if (sizeof(actual) != fread(actual, 1, sizeof(actual), delta))
+		return -1;
+	if (core_header_check(actual, true, &core_size))
+		return -1;
+	if (core_size != o->core_size || (actual[FORMAT] & CORE_COMPRESSED)) {
+		error("delta checkpoint does not match core (format %x)", (unsigned)actual[FORMAT]);
+		return -1;
+	}
+	if (!(data = read_remaining(delta, &length))) {
+		error("reading delta checkpoint failed, %s", forth_strerror());
+		return -1;
+	}
+	if (!(r = core_load_segments(o, core_size, CORE_SPARSE, data, length))) {
+		forth_make_default(o, core_size, stdin, stdout);
+		effects_forget(o, 0);
+	} else {
+		error("invalid delta checkpoint (%zu bytes)", length);
+	}
+	free(data);
+	return r;
+}
+
+/**
+## Module cache
+
+Including the same files every time a program starts means tokenizing and
+compiling them every time as well. When the module cache is turned on, with
+**forth_set_module_cache**, **included** asks **(module)** whether a file
+has been included before into a dictionary in the same state. If it has, the
+changes including it made are copied straight back in from a cache file kept
+next to it, named after it with **MODULE_SUFFIX** on the end. Otherwise a
+copy of the dictionary is taken, and when the file has been read (when its
+input source is popped, see "Input sources") the cells that differ from the
+copy are saved for next time.
+
+A cache file is only used if the file it was made from has the same size,
+modification time and contents, and if the registers and the dictionary it
+is being included into hash to the same value as when it was made. The
+changes saved include those made by any files it included in turn, so the
+names and keys of those are saved as well, and they have to be unchanged
+too. A file that read another file without going through **(module)** is
+not cached at all, as there is no way of telling if that file changes. As the
+dictionary has to be exactly the same nothing in the saved changes needs
+relocating, they go back to where they came from. Only changes to the
+dictionary are saved, so files that print things, open files, or store
+pointers to allocated memory when they are included should not be cached.
+
+The cache file is made up of a header, the key, the length of the list of
+files it depends on and that list, a key, name length and name for each of
+them, and then cells: the dictionary pointer before and after the file was read, the number of cells
+changed below the old dictionary pointer, pairs of address and value for
+those cells, and lastly the new part of the dictionary.
+**/
+
+/**@brief Fields of the key identifying a module and where it is included */
+enum module_key {
+	MODULE_SIZE,  /**< size of the file */
+	MODULE_MTIME, /**< modification time of the file */
+	MODULE_HASH,  /**< hash of the contents of the file */
+	MODULE_STATE, /**< hash of the dictionary before it was included */
+	MODULE_KEY_FIELDS
+};
+
+/**@brief A file being read, along with what the dictionary looked like */
+struct forth_module {
+	char *cache;       /**< cache file to write when it is finished */
+	uint64_t key[MODULE_KEY_FIELDS]; /**< what the cache file is for */
+	uint8_t *depends;  /**< files included while it was read, see **module_depend** */
+	size_t depends_length; /**< bytes in **depends** */
+	bool uncacheable;  /**< was a file read that cannot be depended on? */
+	forth_cell_t here; /**< dictionary pointer before it was read */
+	forth_cell_t before[]; /**< copy of the core up to **here** */
+};
+
+/**@brief Registers including a file can change, or that change how a file
+is compiled, the others are saved with the dictionary */
+static const forth_cell_t module_registers[] = {
+	DIC, PWD, STATE, BASE, INSTRUCTION, ERROR_HANDLER, SIGNAL_HANDLER
+};
+
+/**@brief The first eight bytes of a cache file */
+static const uint8_t module_header[8] = {
+	0xFF, '4', 'T', 'M', sizeof(forth_cell_t), 2 /* version */, 0, 0 
+};
+
+/**
+@brief Hash some bytes with FNV-1a
+@param  h hash so far, or **FNV_OFFSET** to start with
+@param  p bytes to hash
+@param  n number of bytes
+@return the new hash
+**/
+static uint64_t fnv1a(uint64_t h, const void *p, size_t n)
+{
+	const uint8_t *b = p;
+	for (size_t i = 0; i < n; i++)
+		h = (h ^ b[i]) * UINT64_C(0x100000001b3);
+	return h;
+}
+
+#define FNV_OFFSET UINT64_C(0xcbf29ce484222325) /**< FNV-1a initial hash */
+
+/**
+@brief Work out the part of a key that depends only on the file
+@param  name file being included
+@param  key  filled in with the key, **MODULE_STATE** is left as zero
+@return false if the file could not be read
+**/
+static bool module_file_key(const char *name, uint64_t key[MODULE_KEY_FIELDS])
+{
+	struct stat st;
+	uint8_t buf[BUFSIZ];
+	uint64_t h = FNV_OFFSET;
+	FILE *in = NULL;
+	size_t n;
+	if (stat(name, &st) < 0 || !(in = fopen(name, "rb")))
+		return false;
+	key[MODULE_SIZE]  = 0;
+	key[MODULE_MTIME] = st.st_mtime;
+	while ((n = fread(buf, 1, sizeof(buf), in))) {
+		h = fnv1a(h, buf, n);
+		key[MODULE_SIZE] += n;
+	}
+	key[MODULE_HASH] = h;
+	key[MODULE_STATE] = 0;
+	if (ferror(in)) {
+		fclose(in);
+		return false;
+	}
+	fclose(in);
+	return true;
+}
+
+/**
+@brief Work out the key for including a file in the current dictionary
+@param  o    forth environment the file is being included into
+@param  name file being included
+@param  key  filled in with the key
+@return false if the file could not be read
+**/
+static bool module_key(forth_t *o, const char *name, uint64_t key[MODULE_KEY_FIELDS])
+{
+	uint64_t h = FNV_OFFSET;
+	if (!module_file_key(name, key))
+		return false;
+	for (size_t i = 0; i < sizeof(module_registers)/sizeof(module_registers[0]); i++)
+		h = fnv1a(h, &o->m[module_registers[i]], sizeof(forth_cell_t));
+	h = fnv1a(h, &o->m[DICTIONARY_START], (o->m[DIC] - DICTIONARY_START) * sizeof(forth_cell_t));
+	key[MODULE_STATE] = h;
+	return true;
+}
+
+/**
+@brief Can a module change this cell, as far as its cache is concerned?
+@param  here dictionary pointer before the module was read
+@param  a    cell to check
+@return true if it can
+**/
+static bool module_changes(forth_cell_t here, forth_cell_t a)
+{
+	if (a >= DICTIONARY_START)
+		return a < here;
+	for (size_t i = 0; i < sizeof(module_registers)/sizeof(module_registers[0]); i++)
+		if (module_registers[i] == a)
+			return true;
+	return false;
+}
+
+/**
+@brief Add to the list of files each module being recorded depends on
+@param o      forth environment
+@param record entries to add, as they are stored in a cache file
+@param n      bytes in **record**
+**/
+static void module_depend(forth_t *o, const uint8_t *record, size_t n)
+{
+	for (forth_cell_t i = 0; i < o->source_depth; i++) {
+		struct forth_module *md = o->sources[i].module;
+		uint8_t *d = NULL;
+		if (!md || md->uncacheable)
+			continue;
+		if (!(d = realloc(md->depends, md->depends_length + n))) {
+			md->uncacheable = true;
+			continue;
+		}
+		memcpy(d + md->depends_length, record, n);
+		md->depends = d;
+		md->depends_length += n;
+	}
+}
+
+/**
+@brief A file is being read that the modules being recorded cannot depend
+on, so none of them can be cached
+@param o forth environment
+**/
+static void module_taint(forth_t *o)
+{
+	for (forth_cell_t i = 0; i < o->source_depth; i++)
+		if (o->sources[i].module)
+			o->sources[i].module->uncacheable = true;
+}
+
+/**
+@brief Check that all the files a cache depends on are unchanged
+@param  d list of files, as stored in a cache file
+@param  n bytes in **d**
+@return true if none have changed
+**/
+static bool module_depends_valid(const uint8_t *d, size_t n)
+{
+	uint64_t key[MODULE_KEY_FIELDS], saved[MODULE_KEY_FIELDS + 1];
+	char name[FILENAME_MAX];
+	for (size_t i = 0; i < n; i += sizeof(saved) + saved[MODULE_KEY_FIELDS]) {
+		if (n - i < sizeof(saved))
+			return false;
+		memcpy(saved, d + i, sizeof(saved));
+		if (saved[MODULE_KEY_FIELDS] >= sizeof(name) 
+		|| n - i - sizeof(saved) < saved[MODULE_KEY_FIELDS])
+			return false;
+		memcpy(name, d + i + sizeof(saved), saved[MODULE_KEY_FIELDS]);
+		name[saved[MODULE_KEY_FIELDS]] = '\0';
+		if (!module_file_key(name, key) || memcmp(key, saved, sizeof(key)))
+			return false;
+	}
+	return true;
+}
+
+/**
+@brief Copy the changes including a file made back in from its cache file,
+nothing is changed unless all of it can be
+@param  o     forth environment to load them into
+@param  cache name of the cache file
+@param  key   key the cache file must have
+@return true if the changes were copied in
+**/
+static bool module_load(forth_t *o, const char *cache, const uint64_t key[MODULE_KEY_FIELDS])
+{
+	uint8_t header[sizeof(module_header)], *depends = NULL;
+	uint64_t k[MODULE_KEY_FIELDS], length = 0;
+	forth_cell_t c[3], *patches = NULL, lowest = o->m[DIC];
+	forth_cell_t here, after, count, start = o->vstart - o->m;
+	bool r = false;
+	FILE *in = fopen(cache, "rb");
+	if (!in)
+		return false;
+	if (fread(header, 1, sizeof(header), in) != sizeof(header)
+	|| memcmp(header, module_header, sizeof(header))
+	|| fread(k, sizeof(k[0]), MODULE_KEY_FIELDS, in) != MODULE_KEY_FIELDS
+	|| memcmp(k, key, sizeof(k))
+	|| fread(&length, sizeof(length), 1, in) != 1
+	|| length > SIZE_MAX / 2
+	|| !(depends = malloc(length + 1))
+	|| fread(depends, 1, length, in) != length
+	|| !module_depends_valid(depends, length)
+	|| fread(c, sizeof(c[0]), 3, in) != 3)
+		goto end;
+	here = c[0], after = c[1], count = c[2];
+	if (here != o->m[DIC] || after < here || after >= start || count > here)
+		goto end;
+	if (!(patches = malloc(sizeof(*patches) * 2 * (count + 1)))
+	|| fread(patches, sizeof(*patches), 2 * count, in) != 2 * count)
+		goto end;
+	for (forth_cell_t i = 0; i < count; i++)
+		if (!module_changes(here, patches[2 * i]))
+			goto end;
+	if (fread(&o->m[here], sizeof(forth_cell_t), after - here, in) != after - here)
+		goto end; /* only free space was written to */
+	mark_dirty(o, here, after - here);
+	for (forth_cell_t i = 0; i < count; i++) {
+		forth_cell_t a = patches[2 * i];
+		o->m[a] = patches[2 * i + 1];
+		mark_dirty(o, a, 1);
+		if (a >= DICTIONARY_START && a < lowest)
+			lowest = a;
+	}
+	effects_forget(o, lowest);
+	module_depend(o, depends, length); /* they are depended on by the includer too */
+	r = true;
+end:
+	free(depends);
+	free(patches);
+	fclose(in);
+	return r;
+}
+
+/**
+@brief Save the changes reading a file made to the dictionary to its cache
+file, failing to do so is not an error
+@param o  forth environment the file was read into
+@param md recording started before the file was read
+**/
+static void module_save(forth_t *o, const struct forth_module *md)
+{
+	forth_cell_t here = md->here, after = o->m[DIC], count = 0;
+	const uint64_t length = md->depends_length;
+	FILE *out = NULL;
+	if (md->uncacheable) {
+		remove(md->cache);
+		return;
+	}
+	if (after < here || !(out = fopen(md->cache, "wb")))
+		return;
+	for (forth_cell_t a = 0; a < here; a++)
+		count += module_changes(here, a) && o->m[a] != md->before[a];
+	forth_cell_t c[3] = { here, after, count };
+	fwrite(module_header, 1, sizeof(module_header), out);
+	fwrite(md->key, sizeof(md->key[0]), MODULE_KEY_FIELDS, out);
+	fwrite(&length, sizeof(length), 1, out);
+	fwrite(md->depends, 1, length, out);
+	fwrite(c, sizeof(c[0]), 3, out);
+	for (forth_cell_t a = 0; a < here; a++)
+		if (module_changes(here, a) && o->m[a] != md->before[a]) {
+			forth_cell_t patch[2] = { a, o->m[a] };
+			fwrite(patch, sizeof(patch[0]), 2, out);
+		}
+	fwrite(&o->m[here], sizeof(forth_cell_t), after - here, out);
+	if (ferror(out)) {
+		fclose(out);
+		remove(md->cache);
+		return;
+	}
+	if (fclose(out))
+		remove(md->cache);
+}
+
+/**
+@brief Free a recording of a module, which may be NULL
+@param md recording to free
+**/
+static void module_free(struct forth_module *md)
+{
+	if (md) {
+		free(md->cache);
+		free(md->depends);
+	}
+	free(md);
+}
+
+/**
+@brief Load a file from its cache, or record the changes it makes as it is
+read so a cache can be made
+@param  o    forth environment the file is being included into
+@param  name file being included
+@return true if it was loaded from its cache, if not the file still needs
+reading, the next input source pushed records the changes made
+**/
+static bool module_begin(forth_t *o, const char *name)
+{
+	uint64_t key[MODULE_KEY_FIELDS], record[MODULE_KEY_FIELDS + 1];
+	const forth_cell_t here = o->m[DIC];
+	struct forth_module *md = NULL;
+	char *cache = NULL;
+	uint8_t *depend = NULL;
+	module_free(o->module);
+	o->module = NULL;
+	if (!o->module_cache || !module_key(o, name, key))
+		return false;
+	memcpy(record, key, sizeof(key));
+	record[MODULE_KEY_FIELDS] = strlen(name);
+	record[MODULE_STATE] = 0;
+	if (!(depend = malloc(sizeof(record) + strlen(name)))) {
+		module_taint(o);
+		return false;
+	}
+	memcpy(depend, record, sizeof(record));
+	memcpy(depend + sizeof(record), name, strlen(name));
+	module_depend(o, depend, sizeof(record) + strlen(name));
+	free(depend);
+	if (!(cache = malloc(strlen(name) + sizeof(MODULE_SUFFIX))))
+		return false;
+	strcpy(cache, name);
+	strcat(cache, MODULE_SUFFIX);
+	if (module_load(o, cache, key)) {
+		free(cache);
+		return true;
+	}
+	if (!(md = malloc(sizeof(*md) + sizeof(forth_cell_t) * here))) {
+		free(cache);
+		return false;
+	}
+	md->cache = cache;
+	md->depends = NULL;
+	md->depends_length = 0;
+	md->uncacheable = false;
+	memcpy(md->key, key, sizeof(key));
+	md->here = here;
+	memcpy(md->before, o->m, sizeof(forth_cell_t) * here);
+	o->module = md;
+	return false;
+}
+
+int forth_set_module_cache(forth_t *o, int on)
+{
+	assert(o);
+	o->module_cache = !!on;
+	return 0;
+}
+
 /**
 Free the Forth interpreter, we make sure to invalidate the interpreter
 in case there is a use after free.
@@ -1972,6 +4126,29 @@ void forth_free(forth_t *o)
 	/* invalidate the forth core, a sufficiently "smart" compiler 
 	 * might optimize this out */
 	forth_invalidate(o);
+	if (o->block_file)
+		fclose(o->block_file);
+	for (forth_cell_t i = HANDLE_DYNAMIC; i < HANDLE_SLOTS; i++)
+		if (o->files[i])
+			fclose(o->files[i]);
+	free(o->cfunctions);
+#ifdef USE_PLUGINS
+	for (size_t i = 0; i < o->library_count; i++)
+		dlclose(o->libraries[i]);
+#endif
+	free(o->libraries);
+#ifdef USE_SUBROUTINE_THREADING
+	if (o->arena)
+		munmap(o->arena, SUBROUTINE_ARENA_SIZE);
+#endif
+	free(o->subroutines);
+	free(o->effects);
+	free(o->analysed);
+	free(o->heap);
+	module_free(o->module);
+	for (forth_cell_t i = 0; i < o->source_depth; i++)
+		module_free(o->sources[i].module);
+	free(o->feed);
 	free(o);
 }
 
@@ -2021,80 +4198,1873 @@ achieved. They move data between a C program and a paused Forth interpreters
 variable stack.
 **/
 
-void forth_push(forth_t *o, forth_cell_t f)
+void forth_push(forth_t *o, forth_cell_t f)
+{
+	assert(o);
+       	assert(o->S < o->m + o->core_size);
+	*++(o->S) = o->m[TOP];
+	o->m[TOP] = f;
+}
+
+forth_cell_t forth_pop(forth_t *o)
+{
+	assert(o);
+	assert(o->S > o->m);
+	forth_cell_t f = o->m[TOP];
+	o->m[TOP] = *(o->S)--;
+	return f;
+}
+
+forth_cell_t forth_stack_position(forth_t *o)
+{
+	assert(o);
+	return o->S - o->vstart;
+}
+
+/**
+The top of the variable stack is held in the **TOP** register, and not on
+the stack itself, so the functions that deal with many items at once have
+to shuffle it in and out of the register. The bottom most cell of the stack,
+at **vstart + 1**, holds the stale value of **TOP** that was there before
+anything was pushed, so the bottom item on the stack is at **vstart + 2**.
+**/
+int forth_push_n(forth_t *o, const forth_cell_t *v, size_t n)
+{
+	assert(o && (v || !n));
+	if (!n)
+		return 0;
+	if (n >= (size_t)(o->vend - o->S))
+		return -1;
+	o->S[1] = o->m[TOP];
+	memcpy(o->S + 2, v, (n - 1) * sizeof(*v));
+	o->S += n;
+	o->m[TOP] = v[n - 1];
+	return 0;
+}
+
+int forth_pop_n(forth_t *o, forth_cell_t *v, size_t n)
+{
+	assert(o && (v || !n));
+	if (!n)
+		return 0;
+	if (n > (size_t)(o->S - o->vstart))
+		return -1;
+	v[n - 1] = o->m[TOP];
+	memcpy(v, o->S - n + 2, (n - 1) * sizeof(*v));
+	o->m[TOP] = *(o->S - n + 1);
+	o->S -= n;
+	return 0;
+}
+
+const forth_cell_t *forth_stack_view(forth_t *o, forth_cell_t *depth)
+{
+	assert(o && depth);
+	*depth = o->S - o->vstart;
+	if (o->S >= o->vend)
+		return NULL; /* no room to copy the top of the stack */
+	if (*depth)
+		o->S[1] = o->m[TOP]; /* make the stack contiguous */
+	return o->vstart + 2;
+}
+
+void forth_signal(forth_t *o, int sig)
+{
+	assert(o);
+	o->m[SIGNAL_HANDLER] = (forth_cell_t)((sig * -1) + BIAS_SIGNAL);
+}
+
+char *forth_strdup(const char *s)
+{
+	assert(s);
+	char *str;
+	if (!(str = malloc(strlen(s) + 1)))
+		return NULL;
+	strcpy(str, s);
+	return str;
+}
+
+void forth_free_words(char **s, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+		free(s[i]);
+	free(s);
+}
+
+char **forth_words(forth_t *o, size_t *length)
+{
+	assert(o);
+	assert(length);
+	forth_cell_t pwd = o->m[PWD];
+	forth_cell_t *m  = o->m;
+	size_t i;
+	char **n, **s = calloc(2, sizeof(*s));
+	if (!s)
+		return NULL;
+	for (i = 0 ;pwd > DICTIONARY_START; pwd = m[pwd], i++) {
+		forth_cell_t len = WORD_LENGTH(m[pwd + 1]);
+		s[i] = forth_strdup((char*)(&m[pwd-len]));
+		if (!s[i]) {
+			forth_free_words(s, i);
+			*length = 0;
+			return NULL;
+		}
+		n = realloc(s, sizeof(*s) * (i+2));
+		if (!n) {
+			forth_free_words(s, i);
+			*length = 0;
+			return NULL;
+		}
+		s = n;
+	}
+	*length = i;
+	return s;
+}
+
+/**
+## Ahead of time compilation
+
+The threaded code of a word can be translated into a C function, which
+does the same thing as the virtual machine would when interpreting that
+code, but without the dispatch overhead. **forth_generate_native** writes
+these functions out, along with a table of them, and marks the words it
+has translated with the **NATIVE** instruction. If the interpreter is then
+rebuilt with **USE_NATIVE_WORDS** defined the generated file is included
+here, along with the core it was generated from (see the "libforth-native"
+make target). 
+
+The generated functions share the stacks of the virtual machine, and call
+each other directly, pushing the same return addresses onto the return stack
+that the virtual machine would. Any instruction they do not handle, or a
+call to a word that has not been translated, makes the function return the
+address in the threaded code at which the virtual machine should carry on.
+This also happens if a word changes its return address.
+**/
+
+/**
+@brief An entry in the table of functions generated by **forth_generate_native**
+**/
+struct forth_native {
+	forth_cell_t xt; /**< CODE field of the word it was generated from */
+	/**@brief The function itself, it takes pointers to the stack pointer
+	 * and top of the stack, and returns the next instruction address */
+	forth_cell_t (*function)(forth_t *o, jmp_buf *on_error, forth_cell_t **S, forth_cell_t *f);
+};
+
+#ifndef NDEBUG
+#define nck(C) check_bounds(o, on_error, (C), __LINE__, o->core_size) /**< ck for compiled code */
+#define nckchar(C) check_bounds(o, on_error, (C), __LINE__, \
+			o->core_size * sizeof(forth_cell_t)) /**< ckchar for compiled code */
+#else
+#define nck(C) (C)
+#define nckchar(C) (C)
+#endif
+
+#ifdef USE_NATIVE_WORDS
+#define ncell(A, C) if (m[(A)] != (C)) { I = (A); goto end; } /**< has the code changed? */
+#include "native.gen.c"
+static const size_t forth_natives_count = sizeof(forth_natives) / sizeof(forth_natives[0]);
+#else
+static const struct forth_native *forth_natives = NULL;
+static const size_t forth_natives_count = 0;
+#endif
+
+/**
+@brief The instructions that can be translated into a simple sequence of
+statements, much the same as found in the virtual machine. The code
+operates on the variables "m", "S", "f", "w", "o" and "on_error", which
+is a pointer to a **jmp_buf**. This list is used both to write out C code
+and to make functions for subroutine threaded code.
+**/
+#define XMACRO_NATIVE_CODE\
+ X(LOAD,    f = m[nck(f)];)\
+ X(STORE,   m[nck(f)] = *S--; mark_dirty(o, f, 1); f = *S--;)\
+ X(CLOAD,   f = ((uint8_t*)m)[nckchar(f)];)\
+ X(CSTORE,  ((uint8_t*)m)[nckchar(f)] = *S--; mark_dirty_chars(o, f, 1); f = *S--;)\
+ X(SUB,     f = *S-- - f;)\
+ X(ADD,     f = *S-- + f;)\
+ X(AND,     f = *S-- & f;)\
+ X(OR,      f = *S-- | f;)\
+ X(XOR,     f = *S-- ^ f;)\
+ X(INV,     f = ~f;)\
+ X(SHL,     f = *S-- << f;)\
+ X(SHR,     f = *S-- >> f;)\
+ X(MUL,     f = *S-- * f;)\
+ X(DIV,     if (!f) { error("divide %"PRIdCell" by zero ", *S--); longjmp(*on_error, RECOVERABLE); } f = *S-- / f;)\
+ X(ULESS,   f = *S-- < f;)\
+ X(UMORE,   f = *S-- > f;)\
+ X(FROMR,   *++S = f; f = m[nck(m[RSTK]--)];)\
+ X(TOR,     m[nck(++m[RSTK])] = f; f = *S--;)\
+ X(EQUAL,   f = *S-- == f;)\
+ X(SWAP,    w = f; f = *S--; *++S = w;)\
+ X(DUP,     *++S = f;)\
+ X(DROP,    f = *S--;)\
+ X(OVER,    w = *S; *++S = f; f = w;)
+
+/**
+@brief Return the C code for an instruction in **XMACRO_NATIVE_CODE**
+@param  w instruction to translate
+@return C code for the instruction, or NULL if it needs special treatment
+**/
+static const char *native_code(forth_cell_t w)
+{
+	switch (w) {
+#define X(INSTRUCTION, ...) case INSTRUCTION: return #__VA_ARGS__;
+	XMACRO_NATIVE_CODE
+#undef X
+	default: return NULL;
+	}
+}
+
+/**
+@brief Get the instruction executed by the cell **a** of some threaded code,
+or **LAST_INSTRUCTION** if the cell does not point to a valid word.
+**/
+static forth_cell_t native_instruction(forth_t *o, forth_cell_t a)
+{
+	forth_cell_t c = o->m[a];
+	return c && c < o->core_size ? instruction(o->m[c]) : LAST_INSTRUCTION;
+}
+
+/**
+@brief Can execution carry on past an instruction in threaded code,
+either to the next cell or the one after it.
+**/
+static bool native_falls_through(forth_cell_t w)
+{
+	return w == PUSH || w == CONST || w == RUN || w == NATIVE
+		|| w == QBRANCH || native_code(w);
+}
+
+/**
+@brief The target of a branch instruction in cell **a**
+**/
+static forth_cell_t native_target(forth_t *o, forth_cell_t a)
+{
+	return a + 1 + o->m[(a + 1) % o->core_size];
+}
+
+/**
+@brief Work out which cells of a word could be executed, they are the
+ones that are translated into C. A cell could be executed if it is the
+first in the word, it follows a cell that falls through to the next one,
+or it is the target of a branch. Cells following the call of a word that
+alters its return address, for example to skip over a string, are treated
+as code as well, but they are never run as the generated code returns
+to the virtual machine when a call does not return where it should.
+@param o     Forth object containing the word
+@param start first cell of the threaded code of a word
+@param end   cell after the last one that can belong to the word
+@param[out] reach one byte per cell, non zero for each cell that can execute
+@param[out] label one byte per cell, non zero for each cell that is jumped to
+**/
+static void native_reach(forth_t *o, forth_cell_t start, forth_cell_t end,
+		uint8_t *reach, uint8_t *label)
+{
+	forth_cell_t a = start, w, t, b;
+	for (;;) { /* reach[] doubles as the work list, 2 means pending */
+		reach[a - start] = 1;
+		w = native_instruction(o, a);
+		t = native_target(o, a);
+		if ((w == BRANCH || w == QBRANCH) && t >= start && t < end) {
+			label[t - start] = 1;
+			if (!reach[t - start])
+				reach[t - start] = 2;
+		}
+		a += w == PUSH || w == QBRANCH ? 2 : 1;
+		if (w == BRANCH || !native_falls_through(w) || a >= end || reach[a - start] == 1) {
+			for (a = start; a < end && reach[a - start] != 2; a++)
+				;
+			if (a >= end)
+				break;
+		}
+	}
+	/* If execution falls through into a cell that is not the next one
+	 * translated, the code generator has to jump to it */
+	for (a = start; a < end; a++) {
+		if (reach[a - start] != 1)
+			continue;
+		w = native_instruction(o, a);
+		t = a + (w == PUSH || w == QBRANCH ? 2 : 1);
+		if (w == BRANCH || !native_falls_through(w) || t >= end)
+			continue;
+		for (b = a + 1; b < end && !reach[b - start]; b++)
+			;
+		if (b != t)
+			label[t - start] = 1;
+	}
+}
+
+/**
+@brief Write out the C function for a single word
+@param o      Forth object containing the word
+@param out    file to write to
+@param words  sorted list of words in the dictionary
+@param index  index of each word in the table of generated functions,
+              or -1 if it is not being generated
+@param i      the word to generate
+@param start  first cell of its threaded code
+@param end    cell after the last one that can belong to the word
+@return zero on success, negative on failure
+**/
+static int native_word(forth_t *o, FILE *out, forth_cell_t *words, long *index,
+		size_t count, size_t i, forth_cell_t start, forth_cell_t end)
+{
+	forth_cell_t *m = o->m, a, b, c, w, t, next;
+	uint8_t *reach = calloc(end - start, 1), *label = calloc(end - start, 1);
+	const char *name = NULL;
+	int r = -1;
+	if (!reach || !label)
+		goto fail;
+	native_reach(o, start, end, reach, label);
+	fputs("/* ", out); /* the name could contain a comment delimiter */
+	for (name = (char*)(&m[words[i] - 1 - WORD_LENGTH(m[words[i]])]); *name; name++) {
+		fputc(*name, out);
+		if ((name[0] == '*' && name[1] == '/') || (name[0] == '/' && name[1] == '*'))
+			fputc(' ', out);
+	}
+	fputs(" */\n", out);
+	fprintf(out, "static forth_cell_t native_%ld(forth_t *o, jmp_buf *on_error, forth_cell_t **Sp, forth_cell_t *fp)\n", index[i]);
+	fputs("{\n\tforth_cell_t *m = o->m, *S = *Sp, f = *fp, w = 0, I = 0;\n", out);
+	for (a = start; a < end; a++) {
+		if (reach[a - start] != 1)
+			continue;
+		c = m[a];
+		w = native_instruction(o, a);
+		next = a + (w == PUSH || w == QBRANCH ? 2 : 1);
+		if (label[a - start])
+			fprintf(out, "L%"PRIdCell":\n", a);
+		fprintf(out, "\tncell(%"PRIdCell", 0x%"PRIxCell") ", a, c);
+		switch (w) {
+		case PUSH:
+			fprintf(out, "*++S = f; f = m[%"PRIdCell"];", a + 1);
+			break;
+		case CONST:
+			fprintf(out, "*++S = f; f = m[%"PRIdCell"];", c + 1);
+			break;
+		case RUN:
+		case NATIVE:
+			fprintf(out, "m[nck(++m[RSTK])] = %"PRIdCell"; ", next);
+			for (b = 0; b < count && words[b] != c; b++)
+				;
+			if (b < count && index[b] >= 0)
+				fprintf(out, "if ((I = native_%ld(o, on_error, &S, &f)) != %"PRIdCell") goto end;", index[b], next);
+			else
+				fprintf(out, "I = %"PRIdCell"; goto end;", c + 1);
+			break;
+		case EXIT:
+			fputs("I = m[nck(m[RSTK]--)]; goto end;", out);
+			break;
+		case BRANCH:
+		case QBRANCH:
+			t = native_target(o, a);
+			fprintf(out, "if (m[%"PRIdCell"] != 0x%"PRIxCell") { I = %"PRIdCell"; goto end; } ", a + 1, m[a + 1], a);
+			if (w == QBRANCH)
+				fputs("w = f; f = *S--; if (!w) ", out);
+			if (t >= start && t < end && reach[t - start])
+				fprintf(out, "goto L%"PRIdCell";", t);
+			else
+				fprintf(out, "{ I = %"PRIdCell"; goto end; }", t);
+			break;
+		default:
+			if (native_code(w))
+				fputs(native_code(w), out);
+			else
+				fprintf(out, "I = %"PRIdCell"; goto end;", a);
+		}
+		fputc('\n', out);
+		if (w == BRANCH || !native_falls_through(w))
+			continue;
+		for (b = a + 1; b < end && !reach[b - start]; b++)
+			;
+		if (next >= end)
+			fprintf(out, "\tI = %"PRIdCell"; goto end;\n", next);
+		else if (b != next)
+			fprintf(out, "\tgoto L%"PRIdCell";\n", next);
+	}
+	fputs("end:\n\t*Sp = S;\n\t*fp = f;\n\t(void)w;\n\t(void)on_error;\n\treturn I;\n}\n\n", out);
+	r = ferror(out) ? -1 : 0;
+fail:
+	free(reach);
+	free(label);
+	return r;
+}
+
+/**
+**forth_generate_native** translates Forth words into C, see "Ahead of time
+compilation". Either all of the words defined with **:** are translated, if
+**entry** is zero, or **entry** and all the words it calls that are defined
+with **:**.
+
+The generated file contains a table of the functions, and the index of each
+translated word in this table is stored in its CODE field along with the
+**NATIVE** instruction, any word previously translated and not in the new
+set goes back to being a **RUN** word. The core must then be saved, so
+the interpreter built with the generated file can be built with this core
+as well.
+
+Words that have been redefined after this file is generated are not affected,
+as a new definition is added to the dictionary (and the old definition
+remains in use by the words compiled to use it), any other word that is not
+in the table is run by the virtual machine as normal.
+**/
+int forth_generate_native(forth_t *o, FILE *out, forth_xt_t entry)
+{
+	assert(o && out);
+	forth_cell_t *m = o->m, *words = NULL, *ends = NULL, pwd, a, w;
+	size_t count = 0, i, j, *work = NULL, worked = 0;
+	long *index = NULL, generated = 0;
+	uint8_t *reach = NULL, *label = NULL;
+	int r = -1;
+	for (pwd = m[PWD]; pwd > DICTIONARY_START && pwd < o->core_size; pwd = m[pwd])
+		count++;
+	if (!(words = calloc(count + 1, sizeof(*words)))
+	|| !(ends = calloc(count + 1, sizeof(*ends)))
+	|| !(index = calloc(count + 1, sizeof(*index)))
+	|| !(work = calloc(count + 1, sizeof(*work))))
+		goto fail;
+	/* the dictionary is a linked list from the latest word to the first,
+	 * a word ends where the name of the next one starts */
+	for (i = count, pwd = m[PWD]; i; pwd = m[pwd])
+		words[--i] = pwd + 1;
+	for (i = 0; i < count; i++) {
+		ends[i] = i + 1 < count ? words[i + 1] - 1 - WORD_LENGTH(m[words[i + 1]]) : m[DIC];
+		w = instruction(m[words[i]]);
+		index[i] = -1;
+		/* primitives such as "run" have no body and are not translated */
+		if (!entry && ends[i] > words[i] + 1 && (w == RUN || w == NATIVE))
+			index[i] = generated++;
+	}
+	/* starting at the entry word, follow the calls to other words */
+	if (entry) {
+		for (i = 0; i < count && words[i] != entry; i++)
+			;
+		w = i < count ? instruction(m[entry]) : LAST_INSTRUCTION;
+		if (i == count || ends[i] <= entry + 1 || (w != RUN && w != NATIVE))
+			goto fail;
+		index[i] = generated++;
+		work[worked++] = i;
+	}
+	while (worked) {
+		i = work[--worked];
+		if (!(reach = calloc(ends[i] - words[i] - 1, 1)) 
+		|| !(label = calloc(ends[i] - words[i] - 1, 1)))
+			goto fail;
+		native_reach(o, words[i] + 1, ends[i], reach, label);
+		for (a = words[i] + 1; a < ends[i]; a++) {
+			w = native_instruction(o, a);
+			if (reach[a - words[i] - 1] != 1 || (w != RUN && w != NATIVE))
+				continue;
+			for (j = 0; j < count && words[j] != m[a]; j++)
+				;
+			if (j < count && index[j] < 0 && ends[j] > words[j] + 1) {
+				index[j] = generated++;
+				work[worked++] = j;
+			}
+		}
+		free(reach);
+		free(label);
+		reach = label = NULL;
+	}
+
+	fputs("/* Forth words compiled to C by forth_generate_native, see libforth.c */\n", out);
+	for (i = 0; i < count; i++)
+		if (index[i] >= 0)
+			fprintf(out, "static forth_cell_t native_%ld(forth_t *o, jmp_buf *on_error, forth_cell_t **Sp, forth_cell_t *fp);\n", index[i]);
+	fputc('\n', out);
+	for (i = 0; i < count; i++)
+		if (index[i] >= 0 && native_word(o, out, words, index, count, i, words[i] + 1, ends[i]) < 0)
+			goto fail;
+	for (i = 0; i < count; i++) /* the table is in order of index */
+		if (index[i] >= 0)
+			work[index[i]] = i;
+	fputs("static const struct forth_native forth_natives[] = {\n", out);
+	for (j = 0; j < (size_t)generated; j++)
+		fprintf(out, "\t{ %"PRIdCell", native_%ld },\n", words[work[j]], (long)j);
+	fputs("\t{ 0, NULL }\n};\n", out);
+	if (ferror(out))
+		goto fail;
+
+	for (i = 0; i < count; i++) {
+		forth_cell_t code = m[words[i]] & ~INSTRUCTION_MASK & ((1u << NATIVE_INDEX_OFFSET) - 1);
+		if (index[i] >= 0)
+			code |= NATIVE | ((forth_cell_t)index[i] << NATIVE_INDEX_OFFSET);
+		else if (instruction(m[words[i]]) == NATIVE)
+			code |= RUN;
+		else
+			continue;
+		m[words[i]] = code;
+		mark_dirty(o, words[i], 1);
+	}
+	r = 0;
+fail:
+	free(reach);
+	free(label);
+	free(words);
+	free(ends);
+	free(index);
+	free(work);
+	return r;
+}
+
+/**
+## Tree shaking
+
+**forth_strip_core** removes the words a program does not use from the
+dictionary. Starting from one or more entry words it works out which words
+can be reached, moves them down so they are next to each other, and fixes
+up the references to them and the chain of words. The core can then be
+saved as normal.
+
+A word is kept if it is an entry word, if it is the word started with
+**start!**, if it names an instruction (these have no body and are kept so
+the stripped core can still be used interactively) or if a kept word refers
+to it. Any cell of a kept word holding an address inside another word is
+taken as a reference to it, which keeps tables of execution tokens and the
+words made with **does>** along with the words they use, at the cost of
+sometimes keeping a word because a number happens to look like an address
+within it. The threaded code of words is followed as it is in "Ahead of
+time compilation", which finds jumps to other words made by "Tail calls"
+and the code run by words made with **does>**.
+
+Only cells that are certain to be addresses are changed when words move:
+
+* calls in the threaded code of a word.
+* literals holding an execution token, or an address within the same word,
+such as the data field pushed by a word made with **create**, or the data
+field of a word made with **create** that has been inlined.
+* literals holding the address of a string compiled into the word, these
+follow the branch that jumps over the string.
+* branches to other words.
+
+When used from within the virtual machine the words on the return stack
+are kept, and the return addresses moved with them. Anything else is left
+alone, so addresses stored in variables or constants
+still refer to where words were before the core was stripped. Words that
+have been compiled to C or to machine code are run by the virtual machine
+once they have moved, as their threaded code is no longer where it was.
+**/
+
+/**
+@brief Find which word an address is in, given the sorted list of where
+words start and end
+@return index of the word, or **count** if the address is not in one
+**/
+static size_t strip_word_of(const forth_cell_t *starts, const forth_cell_t *ends, 
+		size_t count, forth_cell_t a)
+{
+	size_t low = 0, high = count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (a < starts[mid])
+			high = mid;
+		else if (a >= ends[mid])
+			low = mid + 1;
+		else
+			return mid;
+	}
+	return count;
+}
+
+/**
+@brief Mark the threaded code that can be run from cell **entry** of a word
+in **code**, which has one byte per cell of the dictionary, unlike
+**native_reach** this carries on past any instruction other than **EXIT**
+and **BRANCH**, and stops at cells that do not refer to a word.
+@param o     Forth environment containing the word
+@param code  one byte per cell, 1 for code, 2 for code not yet followed
+@param entry first cell to run
+@param start first cell of the threaded code of the word
+@param end   cell after the last one that can belong to the word
+@return true if any new code was found
+**/
+static bool strip_reach(forth_t *o, uint8_t *code, forth_cell_t entry,
+		forth_cell_t start, forth_cell_t end)
+{
+	forth_cell_t a, w, t;
+	if (entry >= end || code[entry])
+		return false;
+	code[entry] = 2;
+	for (;;) {
+		for (a = start; a < end && code[a] != 2; a++)
+			;
+		if (a >= end)
+			return true;
+		while (a < end && code[a] != 1) {
+			code[a] = 1;
+			w = native_instruction(o, a);
+			if (w == BRANCH || w == QBRANCH) {
+				t = native_target(o, a);
+				if (t >= start && t < end && !code[t])
+					code[t] = 2;
+			}
+			if (w == EXIT || w == BRANCH || w == LAST_INSTRUCTION)
+				break;
+			a += w == PUSH || w == QBRANCH ? 2 : 1;
+		}
+	}
+}
+
+/**
+@brief Work out where an address will be once the words have moved,
+addresses that are not inside a word being kept stay the same
+**/
+static forth_cell_t strip_move(const forth_cell_t *starts, const forth_cell_t *ends,
+		const forth_cell_t *to, const uint8_t *keep, size_t count, forth_cell_t a)
+{
+	size_t i = strip_word_of(starts, ends, count, a);
+	return i < count && keep[i] ? a - starts[i] + to[i] : a;
+}
+
+/**
+@brief Remove the words the entry words do not need, see "Tree shaking"
+@param o           Forth environment containing the words
+@param entries     execution tokens of the entry words
+@param entry_count number of entry words
+@param I           if not NULL, the instruction pointer of the virtual
+                   machine, which is running the words on the return stack
+@return zero on success, negative on failure
+**/
+static int strip_core(forth_t *o, const forth_cell_t *entries, size_t entry_count, 
+		forth_cell_t *I)
+{
+	assert(o && (entries || !entry_count));
+	forth_cell_t *m = o->m, *words = NULL, *starts = NULL, *ends = NULL, *to = NULL, *copy = NULL;
+	forth_cell_t pwd, a, v, t, w, next, last = 0, dic = m[DIC];
+	size_t count = 0, i, j, prev;
+	uint8_t *keep = NULL, *code = NULL;
+	bool changed = true;
+	int r = -1;
+	for (pwd = m[PWD]; pwd > DICTIONARY_START && pwd < o->core_size; pwd = m[pwd])
+		count++;
+	if (!count)
+		return -1;
+	if (!(words = calloc(count, sizeof(*words)))
+	|| !(starts = calloc(count, sizeof(*starts)))
+	|| !(ends = calloc(count, sizeof(*ends)))
+	|| !(to = calloc(count, sizeof(*to)))
+	|| !(keep = calloc(count, 1))
+	|| !(code = calloc(dic, 1))
+	|| !(copy = malloc(dic * sizeof(*copy))))
+		goto fail;
+	for (i = count, pwd = m[PWD]; i; pwd = m[pwd])
+		words[--i] = pwd + 1;
+	for (i = 0; i < count; i++)
+		starts[i] = words[i] - 1 - WORD_LENGTH(m[words[i]]);
+	for (i = 0; i < count; i++) {
+		ends[i] = i + 1 < count ? starts[i + 1] : dic;
+		keep[i] = ends[i] == words[i] + 1; /* instructions have no body */
+	}
+	for (j = 0; j < entry_count; j++) {
+		if ((i = strip_word_of(starts, ends, count, entries[j])) == count || words[i] != entries[j])
+			goto fail;
+		keep[i] = 1;
+	}
+	if ((i = strip_word_of(starts, ends, count, m[INSTRUCTION])) < count)
+		keep[i] = 1;
+	/* the words being run when called from within the virtual machine */
+	for (a = o->core_size - m[STACK_SIZE] + 1; I && a <= m[RSTK]; a++)
+		if ((i = strip_word_of(starts, ends, count, m[a])) < count)
+			keep[i] = 1;
+	if (I && (i = strip_word_of(starts, ends, count, *I)) < count)
+		keep[i] = 1;
+
+	/* keep going until no more words or code are found */
+	while (changed) {
+		changed = false;
+		for (i = 0; i < count; i++) {
+			if (!keep[i])
+				continue;
+			w = instruction(m[words[i]]);
+			if (w == RUN || w == NATIVE)
+				changed |= strip_reach(o, code, words[i] + 1, words[i] + 1, ends[i]);
+			for (a = words[i] + 1; a < ends[i]; a++) {
+				v = m[a];
+				if (code[a] == 1) {
+					w = native_instruction(o, a);
+					if (w == BRANCH || w == QBRANCH)
+						v = native_target(o, a);
+					j = strip_word_of(starts, ends, count, v);
+					/* code part way through a word, as made by does> */
+					if (j < count && v > words[j] && (w == RUN || w == NATIVE) && keep[j])
+						changed |= strip_reach(o, code, v + 1, words[j] + 1, ends[j]);
+				}
+				if ((j = strip_word_of(starts, ends, count, v)) < count && !keep[j]) {
+					keep[j] = 1;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	/* work out where each word is going and fix up the references to it */
+	for (i = 0, next = starts[0]; i < count; i++)
+		if (keep[i]) {
+			to[i] = next;
+			next += ends[i] - starts[i];
+		}
+#define STRIP_MOVE(A) strip_move(starts, ends, to, keep, count, (A))
+	memcpy(copy, m, dic * sizeof(*copy));
+	for (i = 0, prev = count; i < count; i++) {
+		if (!keep[i])
+			continue;
+		copy[words[i] - 1] = prev < count ? to[prev] + words[prev] - 1 - starts[prev] : 0;
+		last = to[i] + words[i] - 1 - starts[i];
+		prev = i;
+		for (a = words[i] + 1; a < ends[i]; a++) {
+			if (code[a] != 1)
+				continue;
+			w = native_instruction(o, a);
+			copy[a] = STRIP_MOVE(m[a]);
+			if (w == PUSH && a + 1 < ends[i]) {
+				v = m[a + 1];
+				t = v / sizeof(forth_cell_t);
+				if (t >= words[i] + 3 && t < ends[i] && code[t - 2] == 1 
+						&& native_instruction(o, t - 2) == BRANCH)
+					copy[a + 1] = STRIP_MOVE(t) * sizeof(forth_cell_t) + v % sizeof(forth_cell_t);
+				else if ((j = strip_word_of(starts, ends, count, v)) < count 
+					&& (j == i || words[j] == v 
+					|| (words[j] + 2 < ends[j] && native_instruction(o, words[j] + 1) == PUSH 
+					&& m[words[j] + 2] == v)))
+					copy[a + 1] = STRIP_MOVE(v);
+			} else if ((w == BRANCH || w == QBRANCH) && a + 1 < ends[i]) {
+				t = native_target(o, a);
+				if (strip_word_of(starts, ends, count, t) != i)
+					copy[a + 1] = STRIP_MOVE(t) - STRIP_MOVE(a + 1);
+			}
+		}
+	}
+	m[INSTRUCTION] = STRIP_MOVE(m[INSTRUCTION]);
+	for (a = o->core_size - m[STACK_SIZE] + 1; I && a <= m[RSTK]; a++)
+		m[a] = STRIP_MOVE(m[a]);
+	if (I)
+		*I = STRIP_MOVE(*I);
+#undef STRIP_MOVE
+	for (i = 0; i < count; i++)
+		if (keep[i])
+			memcpy(m + to[i], copy + starts[i], (ends[i] - starts[i]) * sizeof(*m));
+	memset(m + next, 0, (dic - next) * sizeof(*m));
+	m[DIC] = next;
+	m[PWD] = last;
+	mark_dirty(o, starts[0], dic - starts[0]);
+	effects_forget(o, 0);
+	r = 0;
+fail:
+	free(words);
+	free(starts);
+	free(ends);
+	free(to);
+	free(keep);
+	free(code);
+	free(copy);
+	return r;
+}
+
+int forth_strip_core(forth_t *o, const forth_xt_t *entries, size_t count)
+{
+	return strip_core(o, entries, count, NULL);
+}
+
+/**
+## Inlining
+
+When a word is compiled into another it is normally compiled as a call,
+costing a **RUN** and an **EXIT** each time it is used, which is often more
+than the work tiny words such as **1+** or **nip** do. Instead the threaded
+code of words marked with **inline** and below **INLINE_THRESHOLD** cells
+long is copied into the word being compiled, if it only contains
+instructions that do not care where they are in memory. Branches are
+relative to their position, so they do not need relocating, as long as they stay within the copied code, the final
+**exit** is not copied and branching to it carries on after the copy. Words
+that call other words are never inlined, nor are words that move things on
+and off the return stack unless they do it in a balanced way, without any
+branches. Words compiled after a word has been redefined refer to the new
+definition, words compiled before to the old one, as they would if the word
+was called.
+
+Words have to be marked as they are defined, as a copy does not change
+when the word it was made from is, so a word whose threaded code is
+written to after it has been defined, such as those made with **defer** or
+**doer**, or one a program patches with **!**, must not be marked.
+**/
+
+#define INLINE_THRESHOLD (4u) /**< longest word inlined, in cells */
+
+/**
+@brief Check whether a word can be inlined, see "Inlining"
+@param o Forth environment containing the word
+@param xt CODE field of the word
+@param[out] length number of cells to copy, not including the final exit
+@return true if the word can be inlined
+**/
+static bool inlinable(forth_t *o, forth_cell_t xt, forth_cell_t *length)
+{
+	forth_cell_t *m = o->m, a, w, t, low = xt + 1, high = xt + 1, depth = 0;
+	bool branches = false, returns = false;
+	if (instruction(m[xt]) != RUN || !(m[xt] & INLINE_BIT))
+		return false;
+	for (a = xt + 1; a <= xt + 1 + INLINE_THRESHOLD && a < o->core_size; a++) {
+		switch ((w = native_instruction(o, a))) {
+		case EXIT:
+			if (depth || (branches && returns) || low <= xt || high > a)
+				return false;
+			*length = a - xt - 1;
+			return true;
+		case PUSH:
+			a++;
+			break;
+		case CONST:
+			break;
+		case BRANCH:
+		case QBRANCH:
+			t = native_target(o, a++);
+			low = t < low ? t : low;
+			high = t > high ? t : high;
+			branches = true;
+			break;
+		case TOR:
+			depth++;
+			returns = true;
+			break;
+		case FROMR:
+			if (!depth--) /* something is using the return address */
+				return false;
+			break;
+		default:
+			if (!native_code(w))
+				return false;
+		}
+	}
+	return false;
+}
+
+/**
+## Tail calls
+
+A call to another word just before the **exit** at the end of a word is a
+tail call, once the word being called returns the word calling it has
+nothing left to do but return itself. **;** finishes a definition with
+**TAILCALL**, which turns a tail call into a branch to the body of the
+word being called, so that it returns straight to the caller of the word
+that would have called it. This saves a **RUN** and an **EXIT**, and more
+importantly a word that calls itself at its end, with **recurse** or
+otherwise, no longer uses the return stack to do so, so it can recurse as
+deeply as it likes.
+
+A word called this way sees a different return address, that of the word
+before it, so words such as **rdrop** or **?exit** that work on the return
+address of the word that called them would behave differently. Only words
+marked with **TAIL_CALL_BIT** are jumped to, which **TAILCALL** sets on
+the word it finishes if every part of it that can run is a literal, a
+branch, a primitive that does not use the return stack (so not **TAIL**,
+nor **READ** or **EVALUATOR** which run other words), a call to itself
+or to another word with the bit set. Moving values to and from the return
+stack is allowed, as long as the word does not branch and puts back what it
+took.
+
+A jump, like a copy made by "Inlining", goes to wherever the word being
+called was when the call was compiled, and a program can patch the call
+afterwards to make it call some other word. Once it is a jump it is no
+longer a call that can be patched in the same way, so other than a word
+calling itself only words marked with **inline** are jumped to, the mark
+saying that the word is not expected to change after it is compiled.
+
+The branch is two cells long, so the final **exit** is moved along by one
+cell, along with any branches to it. It is never run, but it shows where
+the word ends to words like **see**.
+**/
+
+/**
+@brief Find a word that runs an instruction, so it can be compiled
+@param o Forth environment to look in
+@param w instruction to look for
+@return CODE field of the word, or zero if there is none
+**/
+static forth_cell_t primitive_xt(forth_t *o, forth_cell_t w)
+{
+	forth_cell_t *m = o->m, pwd;
+	for (pwd = m[PWD]; pwd > DICTIONARY_START && pwd < o->core_size; pwd = m[pwd])
+		if (instruction(m[pwd + 1]) == w)
+			return pwd + 1;
+	return 0;
+}
+
+/**
+@brief Mark the word being finished by **;** as safe to jump to, and turn
+the call at its end into a jump if it can be, see "Tail calls".
+@param o Forth environment containing the word
+**/
+static void tail_call(forth_t *o)
+{
+	forth_cell_t *m = o->m, xt = m[PWD] + 1, start = xt + 1, end = m[DIC];
+	forth_cell_t a, c, w, t, depth = 0;
+	uint8_t *reach = NULL, *label = NULL;
+	bool safe = true, branches = false, returns = false;
+	/* only a hidden word, defined with ':', is being finished by ';' */
+	if (start + 2 > end || end >= o->core_size || !WORD_HIDDEN(m[xt]) 
+	|| instruction(m[xt]) != RUN || native_instruction(o, end - 1) != EXIT)
+		return;
+	if (!(reach = calloc(end - start, 1)) || !(label = calloc(end - start, 1)))
+		goto end;
+	native_reach(o, start, end, reach, label);
+	for (a = start; a < end && safe; a++) {
+		if (reach[a - start] != 1)
+			continue;
+		c = m[a];
+		switch ((w = native_instruction(o, a))) {
+		case PUSH:
+		case CONST:
+		case EXIT:
+			break;
+		case BRANCH:
+		case QBRANCH:
+			branches = true;
+			break;
+		case TOR:
+			depth++;
+			returns = true;
+			break;
+		case FROMR:
+			safe = depth-- > 0;
+			returns = true;
+			break;
+		case RUN:
+		case NATIVE:
+			safe = c == xt || (m[c] & TAIL_CALL_BIT);
+			break;
+		case TAIL:
+		case READ:
+		case EVALUATOR:
+		case LAST_INSTRUCTION:
+			safe = false;
+			break;
+		default: /* other primitives do not touch the return stack */
+			break;
+		}
+	}
+	safe = safe && !depth && !(branches && returns);
+	if (safe) {
+		mark_dirty(o, xt, 1);
+		m[xt] |= TAIL_CALL_BIT;
+	}
+	a = end - 2;
+	c = m[a];
+	if (reach[a - start] != 1 || native_instruction(o, a) != RUN
+	|| !(m[c] & TAIL_CALL_BIT) || (c != xt && !(m[c] & INLINE_BIT))
+	|| o->m + end >= o->vstart 
+	|| !(t = primitive_xt(o, BRANCH)))
+		goto end;
+	for (w = start; w < a; w++) /* anything going to the exit follows it */
+		if (reach[w - start] == 1 && (native_instruction(o, w) == BRANCH 
+		|| native_instruction(o, w) == QBRANCH) && native_target(o, w) == end - 1) {
+			mark_dirty(o, w + 1, 1);
+			m[w + 1]++;
+		}
+	mark_dirty(o, a, 3);
+	m[end] = m[end - 1];
+	m[a] = t;
+	m[a + 1] = c - a;
+	m[DIC]++;
+end:
+	free(reach);
+	free(label);
+}
+
+/**
+## Stack effects
+
+In builds with **NDEBUG** undefined the virtual machine checks the variable
+stack has enough items on it before each instruction, using
+**stack_bounds**, which costs a little each time an instruction is run.
+Most words always take the same number of items off the stack and put the
+same number back, so instead this can be worked out once, the first time a
+word is run, and checked as the word is entered. Within the word the checks
+on each instruction are then skipped, until it calls a word or returns.
+This check is made in builds with **NDEBUG** defined as well, so words that
+would underflow the stack are caught before they start.
+
+The stack effect of a word is worked out from **XMACRO_STACK_EFFECT**,
+**stack_bounds**, and the effects of the words it calls, by following
+all of the paths through it. It is worked out for the word if:
+
+* it is in the dictionary, and was defined with ':'.
+* every instruction that can run has a fixed effect on the stack, and every
+word it calls has had its effect worked out.
+* every path to a cell leaves the same number of items on the stack, so
+loops cannot grow or shrink the stack each time around them, and every
+path to an **exit** leaves the same number.
+* it moves items to and from the return stack only if it does not branch,
+and it puts back what it takes, as a word that alters its return address
+could return somewhere that is not expecting its effect.
+
+Otherwise the word is run as before. Words calling themselves directly do
+not have their effect worked out, although those recursing as a tail call
+do, as that is a loop. The effects are not part of the core, they are
+kept in a table alongside it, indexed by the **CODE** field of each word,
+and the entries are forgotten when the dictionary is written to where
+that word was, for example after **forget** is used. Which cells each
+effect was worked out from is kept in a bitmap, **analysed**, and writing
+to any of them, with **!** or otherwise, forgets them all, as the words
+calling a word that has been changed may have a different effect too.
+**/
+
+#define EFFECT_MAXIMUM_DEPTH (64u) /**< deepest nesting of words worked out */
+
+/**
+@brief The effect each instruction has on the number of items on the
+variable stack, for those where it is always the same.
+**/
+#define XMACRO_STACK_EFFECT\
+ X(PUSH, 1) X(CONST, 1) X(LOAD, 0) X(STORE, -2) X(CLOAD, 0) X(CSTORE, -2)\
+ X(SUB, -1) X(ADD, -1) X(AND, -1) X(OR, -1) X(XOR, -1) X(INV, 0)\
+ X(SHL, -1) X(SHR, -1) X(MUL, -1) X(DIV, -1) X(ULESS, -1) X(UMORE, -1)\
+ X(EXIT, 0) X(KEY, 1) X(EMIT, 0) X(FROMR, 1) X(TOR, -1) X(BRANCH, 0)\
+ X(QBRANCH, -1) X(PNUM, 0) X(COMMA, -1) X(EQUAL, -1) X(SWAP, 0) X(DUP, 1)\
+ X(DROP, -1) X(OVER, 1) X(FIND, 1) X(DEPTH, 1) X(SPLOAD, 1) X(CLOCK, 1)\
+ X(FREADLINE, 0) X(FWRITELINE, -2) X(ACCEPTER, -2)
+
+/**
+@brief How far the stack effect of a word has been worked out
+**/
+enum effect_state {
+	EFFECT_UNKNOWN,  /**< it has not been looked at yet */
+	EFFECT_PENDING,  /**< it is being worked out */
+	EFFECT_UNPROVEN, /**< it could not be worked out */
+	EFFECT_PROVEN    /**< the fields of **forth_effect** are valid */
+};
+
+/**
+@brief The stack effect of a word, relative to the depth of the variable
+stack when it is called
+**/
+struct forth_effect {
+	uint8_t state; /**< an **enum effect_state** */
+	uint8_t need;  /**< depth the stack needs to have */
+	uint8_t grow;  /**< most the stack grows by while the word runs */
+	int8_t effect; /**< change in depth once it has returned */
+};
+
+/**
+@brief The effect of an instruction on the depth of the stack
+@param w           instruction
+@param[out] effect change in the depth of the stack
+@return true if the effect is always the same, false otherwise
+**/
+static bool instruction_effect(forth_cell_t w, long *effect)
+{
+	switch (w) {
+#define X(INSTRUCTION, EFFECT) case INSTRUCTION: *effect = (EFFECT); return true;
+	XMACRO_STACK_EFFECT
+#undef X
+	default: return false;
+	}
+}
+
+/**
+@brief Get the entry for a word in the table of stack effects, making
+room for it if needed
+@param o  Forth environment containing the word
+@param xt CODE field of the word
+@return the entry, or NULL if it could not be made
+**/
+static struct forth_effect *effect_entry(forth_t *o, forth_cell_t xt)
+{
+	struct forth_effect *table;
+	forth_cell_t size = o->effect_size;
+	if (xt < o->effect_count)
+		return &o->effects[xt];
+	if (xt >= o->core_size)
+		return NULL;
+	if (xt >= size) {
+		size = xt + 1 > size * 2 ? xt + 1 : size * 2;
+		size = size > o->core_size ? o->core_size : size;
+		if (!(table = realloc(o->effects, sizeof(*table) * size)))
+			return NULL;
+		o->effects = table;
+		o->effect_size = size;
+	}
+	memset(&o->effects[o->effect_count], 0, sizeof(*o->effects) * (xt + 1 - o->effect_count));
+	o->effect_count = xt + 1;
+	return &o->effects[xt];
+}
+
+static struct forth_effect stack_effect(forth_t *o, forth_cell_t xt, unsigned depth);
+
+/**
+@brief Work out the stack effect of a word, see "Stack effects"
+@param o     Forth environment containing the word
+@param xt    CODE field of the word
+@param depth how many words are being worked out
+@return the effect of the word, its state is **EFFECT_UNPROVEN** if it
+could not be worked out
+**/
+static struct forth_effect stack_analyse(forth_t *o, forth_cell_t xt, unsigned depth)
+{
+	forth_cell_t *m = o->m, pwd, start = xt + 1, end = m[DIC], a, c, t, w;
+	struct forth_effect r = { EFFECT_UNPROVEN, 0, 0, 0 }, e;
+	forth_cell_t *work = NULL, worked = 0, *next, successors[2];
+	long *d = NULL, x, effect, need = 0, grow = 0, exit = LONG_MIN, returns = 0;
+	bool branches = false, uses_returns = false;
+	size_t i, n;
+
+	for (pwd = m[PWD]; pwd > DICTIONARY_START && pwd + 1 != xt; pwd = m[pwd])
+		end = pwd - WORD_LENGTH(m[pwd + 1]);
+	w = instruction(m[xt]);
+	if (pwd <= DICTIONARY_START || (w != RUN && w != NATIVE) || start >= end
+	|| depth >= EFFECT_MAXIMUM_DEPTH)
+		return r;
+	if (!(d = malloc(sizeof(*d) * (end - start))) 
+	|| !(work = malloc(sizeof(*work) * (end - start))))
+		goto fail;
+	for (a = start; a < end; a++)
+		d[a - start] = LONG_MIN;
+	d[0] = 0;
+	work[worked++] = start;
+	while (worked) { /* every cell is only added to the work list once */
+		a = work[--worked];
+		x = d[a - start];
+		c = m[a];
+		w = native_instruction(o, a);
+		n = 0;
+		next = successors;
+		switch (w) {
+		case RUN:
+		case NATIVE:
+			e = stack_effect(o, c, depth + 1);
+			if (e.state != EFFECT_PROVEN)
+				goto fail;
+			need = need > e.need - x ? need : e.need - x;
+			grow = grow > x + e.grow ? grow : x + e.grow;
+			x += e.effect;
+			successors[n++] = a + 1;
+			break;
+		case EXIT:
+			if ((exit != LONG_MIN && exit != x) || returns)
+				goto fail;
+			exit = x;
+			break;
+		case BRANCH:
+		case QBRANCH:
+			branches = true;
+			need = need > (long)stack_bounds[w] - x ? need : (long)stack_bounds[w] - x;
+			x -= w == QBRANCH;
+			t = native_target(o, a);
+			if (w == QBRANCH)
+				successors[n++] = a + 2;
+			if (t >= start && t < end) {
+				successors[n++] = t;
+				break;
+			}
+			/* a tail call to another word, see "Tail calls" */
+			if (t <= DICTIONARY_START)
+				goto fail;
+			e = stack_effect(o, t - 1, depth + 1);
+			if (e.state != EFFECT_PROVEN
+			|| (exit != LONG_MIN && exit != x + e.effect))
+				goto fail;
+			need = need > e.need - x ? need : e.need - x;
+			grow = grow > x + e.grow ? grow : x + e.grow;
+			exit = x + e.effect;
+			break;
+		default:
+			if (!instruction_effect(w, &effect))
+				goto fail;
+			need = need > (long)stack_bounds[w] - x ? need : (long)stack_bounds[w] - x;
+			if (w == TOR || w == FROMR) {
+				uses_returns = true;
+				returns += w == TOR ? 1 : -1;
+				if (returns < 0) /* it is taking its return address */
+					goto fail;
+			}
+			x += effect;
+			grow = grow > x ? grow : x;
+			successors[n++] = a + (w == PUSH ? 2 : 1);
+		}
+		if (branches && uses_returns)
+			goto fail;
+		for (i = 0; i < n; i++) {
+			if (next[i] >= end)
+				goto fail;
+			if (d[next[i] - start] == LONG_MIN) {
+				d[next[i] - start] = x;
+				work[worked++] = next[i];
+			} else if (d[next[i] - start] != x) {
+				goto fail;
+			}
+		}
+	}
+	if (exit == LONG_MIN || need > UINT8_MAX || grow > UINT8_MAX 
+	|| exit < INT8_MIN || exit > INT8_MAX)
+		goto fail;
+	if (!o->analysed && !(o->analysed = calloc((o->core_size + CHAR_BIT - 1) / CHAR_BIT, 1)))
+		goto fail;
+	for (a = xt; a < end; a++) { /* writing to these changes the effect */
+		if (a != xt && d[a - start] == LONG_MIN)
+			continue;
+		w = a == xt ? 0 : native_instruction(o, a);
+		for (i = 0; i < (w == PUSH || w == BRANCH || w == QBRANCH ? 2u : 1u); i++)
+			o->analysed[(a + i) / CHAR_BIT] |= 1u << ((a + i) % CHAR_BIT);
+	}
+	r.state = EFFECT_PROVEN;
+	r.need = need;
+	r.grow = grow;
+	r.effect = exit;
+fail:
+	free(d);
+	free(work);
+	return r;
+}
+
+/**
+@brief Look up the stack effect of a word, working it out if it has not
+been, see "Stack effects"
+@param o     Forth environment containing the word
+@param xt    CODE field of the word
+@param depth how many words are being worked out
+@return the effect of the word, only valid if its state is **EFFECT_PROVEN**
+**/
+static struct forth_effect stack_effect(forth_t *o, forth_cell_t xt, unsigned depth)
+{
+	struct forth_effect r = { EFFECT_UNPROVEN, 0, 0, 0 }, *e;
+	if (xt < o->effect_count && o->effects[xt].state != EFFECT_UNKNOWN)
+		return o->effects[xt];
+	if (!(e = effect_entry(o, xt)))
+		return r;
+	e->state = EFFECT_PENDING;
+	r = stack_analyse(o, xt, depth);
+	if ((e = effect_entry(o, xt))) /* the table may have moved */
+		*e = r;
+	return r;
+}
+
+/**
+@brief Check the stack before a word is run, see "Stack effects"
+@param o        Forth environment containing the word
+@param on_error where to jump to if the stack would underflow or overflow
+@param xt       CODE field of the word
+@param S        variable stack pointer
+@return true if the word cannot underflow the stack, so the checks on each
+instruction within it can be skipped
+**/
+static bool stack_check(forth_t *o, jmp_buf *on_error, forth_cell_t xt, forth_cell_t *S)
+{
+	struct forth_effect e = stack_effect(o, xt, 0);
+	if (e.state != EFFECT_PROVEN)
+		return false;
+	if ((uintptr_t)(S - o->vstart) < e.need) {
+		error("stack underflow, word %"PRIdCell" needs %u (line %zu)", xt, (unsigned)e.need, o->line);
+		longjmp(*on_error, RECOVERABLE);
+	} else if (S + e.grow > o->vend) {
+		error("stack overflow, word %"PRIdCell" grows by %u (line %zu)", xt, (unsigned)e.grow, o->line);
+		longjmp(*on_error, RECOVERABLE);
+	}
+	return true;
+}
+
+/**
+## Subroutine threading
+
+As an alternative to interpreting threaded code, a word can be turned into
+a list of machine code calls to functions implementing each primitive, this
+is known as subroutine threading. Calls to other words become machine code
+calls and **exit** becomes a return, so the processor can predict where each
+word returns to, which it cannot do for the indirect jump that the **switch**
+statement in the virtual machine compiles to.
+
+This is turned on for each Forth environment with 
+**forth_set_subroutine_threading**, after which a word is compiled the first
+time it is run. The threaded code is kept, so it can still be decompiled with
+**see**, and the virtual machine is used instead when instructions are being
+traced. Like the functions written by **forth_generate_native**, which this
+mirrors, the machine code keeps the return stack just as the virtual machine
+would, checks the cells it was compiled from have not changed and returns to
+the virtual machine whenever something it does not handle comes up.
+
+The index of the machine code for a word is stored in the bits of its CODE
+field above those used by the **RUN** instruction, as for **NATIVE** words.
+**/
+
+/**
+@brief The state passed to the machine code, and on to the primitives
+**/
+struct subroutine_state {
+	forth_t *o;         /**< Forth environment being run */
+	jmp_buf *on_error;  /**< where to go if a primitive fails */
+	forth_cell_t *S;    /**< variable stack pointer */
+	forth_cell_t f;     /**< top of the variable stack */
+	forth_cell_t I;     /**< where the virtual machine should carry on */
+};
+
+/**
+@brief An entry in the table of compiled words for a Forth environment
+**/
+struct forth_subroutine {
+	forth_cell_t xt; /**< CODE field of the compiled word */
+	uint8_t *code;   /**< entry point, or NULL if it could not be compiled */
+};
+
+#ifdef USE_SUBROUTINE_THREADING
+
+/**
+The primitives called by the machine code are made from the same list as
+the code written out by **forth_generate_native**.
+**/
+#define X(INSTRUCTION, ...)\
+static void subroutine_ ## INSTRUCTION(struct subroutine_state *st)\
+{\
+	forth_t *o = st->o;\
+	jmp_buf *on_error = st->on_error;\
+	forth_cell_t *m = o->m, *S = st->S, f = st->f, w = 0;\
+	__VA_ARGS__\
+	st->S = S;\
+	st->f = f;\
+	(void)o; (void)m; (void)w; (void)on_error;\
+}
+XMACRO_NATIVE_CODE
+#undef X
+
+/**@brief Primitives that can be called directly, indexed by instruction */
+static void (*const subroutine_primitives[LAST_INSTRUCTION])(struct subroutine_state *) = {
+#define X(INSTRUCTION, ...) [INSTRUCTION] = subroutine_ ## INSTRUCTION,
+	XMACRO_NATIVE_CODE
+#undef X
+};
+
+/**@brief Push the cell at **a**, for literals and constants */
+static void subroutine_literal(struct subroutine_state *st, forth_cell_t a)
+{
+	*++st->S = st->f;
+	st->f = st->o->m[a];
+}
+
+/**@brief Push the address a called word returns to onto the return stack */
+static void subroutine_enter(struct subroutine_state *st, forth_cell_t next)
+{
+	forth_t *o = st->o;
+	jmp_buf *on_error = st->on_error;
+	forth_cell_t *m = o->m;
+	m[nck(++m[RSTK])] = next;
+	(void)on_error;
+}
+
+/**@brief Pop the address a word returns to off of the return stack */
+static void subroutine_exit(struct subroutine_state *st)
+{
+	forth_t *o = st->o;
+	jmp_buf *on_error = st->on_error;
+	forth_cell_t *m = o->m;
+	st->I = m[nck(m[RSTK]--)];
+	(void)on_error;
+}
+
+/**@brief Pop the top of the stack, returning it to test for **?branch** */
+static forth_cell_t subroutine_qbranch(struct subroutine_state *st)
+{
+	forth_cell_t w = st->f;
+	st->f = *st->S--;
+	return w;
+}
+
+/**
+The machine code is made up of a few sequences of instructions, the
+register **rbx** holds a pointer to the **subroutine_state** throughout.
+Cells are compared and stored using 32-bit instructions if cells are
+32-bits wide, which needs the REX.W prefix leaving off.
+**/
+#define EMIT(...) subroutine_emit(b, n, (const uint8_t[]){ __VA_ARGS__ }, \
+		sizeof((const uint8_t[]){ __VA_ARGS__ }))
+#define REX_W (sizeof(forth_cell_t) == 8 ? 0x48 : 0x90) /**< 0x90 is a nop */
+
+static void subroutine_emit(uint8_t *b, size_t *n, const uint8_t *bytes, size_t length)
+{
+	memcpy(b + *n, bytes, length);
+	*n += length;
+}
+
+static void subroutine_emit_value(uint8_t *b, size_t *n, uint64_t value, size_t length)
+{
+	for (size_t i = 0; i < length; i++, value >>= 8)
+		b[(*n)++] = value & 0xff;
+}
+
+/**@brief Set where the virtual machine carries on and return from the word */
+static void subroutine_leave(uint8_t *b, size_t *n, forth_cell_t I)
+{
+	EMIT(REX_W, 0xb8); /* mov rax, I */
+	subroutine_emit_value(b, n, I, sizeof(forth_cell_t));
+	EMIT(REX_W, 0x89, 0x43, offsetof(struct subroutine_state, I)); /* mov [rbx+I], rax */
+	EMIT(0x48, 0x83, 0xc4, 0x08, 0xc3); /* add rsp, 8; ret */
+}
+
+/**@brief Call a primitive, any second argument must already be in rsi */
+static void subroutine_call(uint8_t *b, size_t *n, uintptr_t function)
+{
+	EMIT(0x48, 0x89, 0xdf, 0x48, 0xb8); /* mov rdi, rbx; mov rax, function */
+	subroutine_emit_value(b, n, function, 8);
+	EMIT(0xff, 0xd0); /* call rax */
+}
+
+/**@brief Leave with **I** set to **a** unless cell **a** still holds **c** */
+static void subroutine_guard(uint8_t *b, size_t *n, forth_t *o, forth_cell_t a, 
+		forth_cell_t c, forth_cell_t I)
+{
+	size_t skip;
+	EMIT(0x48, 0xb8); /* mov rax, &m[a] */
+	subroutine_emit_value(b, n, (uintptr_t)&o->m[a], 8);
+	EMIT(REX_W, 0xb9); /* mov rcx, c */
+	subroutine_emit_value(b, n, c, sizeof(forth_cell_t));
+	EMIT(REX_W, 0x39, 0x08, 0x74, 0x00); /* cmp [rax], rcx; je skip */
+	skip = *n;
+	subroutine_leave(b, n, I);
+	b[skip - 1] = *n - skip;
+}
+
+/**@brief Jump to cell **t** of the word being compiled, patched later */
+static void subroutine_jump(uint8_t *b, size_t *n, size_t *fixups, size_t *fixed, 
+		forth_cell_t t, forth_cell_t start)
+{
+	subroutine_emit_value(b, n, 0, 4);
+	fixups[(*fixed)++] = *n - 4;
+	fixups[(*fixed)++] = t - start;
+}
+
+/**
+@brief Look up the entry in the table of compiled words for a word
+@param o  Forth environment containing the word
+@param xt CODE field of the word
+@return entry for the word, or NULL if no attempt to compile it has been made
+**/
+static struct forth_subroutine *subroutine_lookup(forth_t *o, forth_cell_t xt)
+{
+	forth_cell_t n = o->m[xt] >> NATIVE_INDEX_OFFSET;
+	if (n < o->subroutine_count && o->subroutines[n].xt == xt)
+		return &o->subroutines[n];
+	return NULL;
+}
+
+static uint8_t *subroutine_compile(forth_t *o, forth_cell_t xt, unsigned depth);
+
+/**
+@brief Find the machine code for a word, compiling it if it has not been
+@param o     Forth environment containing the word
+@param xt    CODE field of the word
+@param depth how many calls to other words are being compiled
+@return entry point of the machine code, or NULL if it cannot be compiled
+**/
+static uint8_t *subroutine_find(forth_t *o, forth_cell_t xt, unsigned depth)
+{
+	struct forth_subroutine *s = subroutine_lookup(o, xt);
+	return s ? s->code : subroutine_compile(o, xt, depth);
+}
+
+/**
+@brief Compile a word defined with ':' into machine code, see 
+"Subroutine threading". The word is entered into the table of compiled
+words even if it cannot be compiled, so no further attempt is made.
+@param o     Forth environment containing the word
+@param xt    CODE field of the word
+@param depth how many calls to other words are being compiled
+@return entry point of the machine code, or NULL if it cannot be compiled
+**/
+static uint8_t *subroutine_compile(forth_t *o, forth_cell_t xt, unsigned depth)
+{
+	forth_cell_t *m = o->m, pwd, start = xt + 1, end = m[DIC], a, c, w, t, next, index;
+	uint8_t *reach = NULL, *label = NULL, *b = NULL, *base, *callee;
+	size_t *offsets = NULL, *fixups = NULL, fixed = 0, length = 0, *n = &length, i, body;
+	struct forth_subroutine *table, *s;
+
+	/* only words in the dictionary are compiled, as their end is known */
+	for (pwd = m[PWD]; pwd > DICTIONARY_START && pwd + 1 != xt; pwd = m[pwd])
+		end = pwd - WORD_LENGTH(m[pwd + 1]);
+	if (pwd <= DICTIONARY_START || instruction(m[xt]) != RUN || start >= end)
+		return NULL;
+	if (!(table = realloc(o->subroutines, sizeof(*table) * (o->subroutine_count + 1))))
+		return NULL;
+	o->subroutines = table;
+	index = o->subroutine_count++;
+	table[index].xt = xt;
+	table[index].code = NULL;
+	m[xt] = (m[xt] & ((1u << NATIVE_INDEX_OFFSET) - 1)) | (index << NATIVE_INDEX_OFFSET);
+	mark_dirty(o, xt, 1);
+
+	if (!(reach = calloc(end - start, 1)) || !(label = calloc(end - start, 1))
+	|| !(offsets = calloc(end - start, sizeof(*offsets)))
+	|| !(fixups = calloc((end - start) * 2, sizeof(*fixups))) 
+	|| !(b = malloc((end - start) * 128 + 64)))
+		goto fail;
+	native_reach(o, start, end, reach, label);
+
+	/* the words this word calls are compiled first, as compiling
+	 * them adds to the arena this word goes into */
+	for (a = start; a < end && depth < SUBROUTINE_MAXIMUM_DEPTH; a++)
+		if (reach[a - start] == 1 && native_instruction(o, a) == RUN && m[a] != xt)
+			subroutine_find(o, m[a], depth + 1);
+
+	if (!o->arena) {
+		o->arena = mmap(NULL, SUBROUTINE_ARENA_SIZE, PROT_READ | PROT_EXEC, 
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (o->arena == MAP_FAILED) {
+			o->arena = NULL;
+			goto fail;
+		}
+	}
+	if (o->arena_used + (end - start) * 128 + 64 > SUBROUTINE_ARENA_SIZE)
+		goto fail;
+	base = o->arena + o->arena_used;
+
+	/* entry point: push rbx; mov rbx, rdi; call body; pop rbx; ret */
+	EMIT(0x53, 0x48, 0x89, 0xfb, 0xe8, 0x02, 0x00, 0x00, 0x00, 0x5b, 0xc3);
+	body = *n;
+	EMIT(0x48, 0x83, 0xec, 0x08); /* sub rsp, 8: keeps the stack aligned */
+	for (a = start; a < end; a++) {
+		if (reach[a - start] != 1)
+			continue;
+		offsets[a - start] = *n;
+		c = m[a];
+		w = native_instruction(o, a);
+		next = a + (w == PUSH || w == QBRANCH ? 2 : 1);
+		subroutine_guard(b, n, o, a, c, a);
+		switch (w) {
+		case PUSH:
+		case CONST:
+			EMIT(0x48, 0xbe); /* mov rsi, address of value */
+			subroutine_emit_value(b, n, w == PUSH ? a + 1 : c + 1, 8);
+			subroutine_call(b, n, (uintptr_t)subroutine_literal);
+			break;
+		case RUN:
+			EMIT(0x48, 0xbe); /* mov rsi, next */
+			subroutine_emit_value(b, n, next, 8);
+			subroutine_call(b, n, (uintptr_t)subroutine_enter);
+			s = subroutine_lookup(o, c);
+			callee = c == xt ? base : s ? s->code : NULL;
+			if (!callee) {
+				subroutine_leave(b, n, c + 1);
+				break;
+			}
+			EMIT(0xe8); /* call the body of the word, after its entry point */
+			subroutine_emit_value(b, n, (callee + body) - (base + *n + 4), 4);
+			EMIT(REX_W, 0xb8); /* mov rax, next */
+			subroutine_emit_value(b, n, next, sizeof(forth_cell_t));
+			/* cmp [rbx+I], rax; je over; add rsp, 8; ret */
+			EMIT(REX_W, 0x39, 0x43, offsetof(struct subroutine_state, I), 
+				0x74, 0x05, 0x48, 0x83, 0xc4, 0x08, 0xc3);
+			break;
+		case EXIT:
+			subroutine_call(b, n, (uintptr_t)subroutine_exit);
+			EMIT(0x48, 0x83, 0xc4, 0x08, 0xc3); /* add rsp, 8; ret */
+			break;
+		case BRANCH:
+		case QBRANCH:
+			t = native_target(o, a);
+			subroutine_guard(b, n, o, a + 1, m[a + 1], a);
+			if (w == QBRANCH) {
+				subroutine_call(b, n, (uintptr_t)subroutine_qbranch);
+				EMIT(REX_W, 0x85, 0xc0); /* test rax, rax */
+			}
+			if (t >= start && t < end && reach[t - start]) {
+				if (w == QBRANCH)
+					EMIT(0x0f, 0x84); /* jz t */
+				else
+					EMIT(0xe9); /* jmp t */
+				subroutine_jump(b, n, fixups, &fixed, t, start);
+			} else if (w == QBRANCH) {
+				EMIT(0x75, 0x00); /* jnz over */
+				i = *n;
+				subroutine_leave(b, n, t);
+				b[i - 1] = *n - i;
+			} else {
+				subroutine_leave(b, n, t);
+			}
+			break;
+		default:
+			if (w < LAST_INSTRUCTION && subroutine_primitives[w])
+				subroutine_call(b, n, (uintptr_t)subroutine_primitives[w]);
+			else
+				subroutine_leave(b, n, a);
+		}
+		if (w == BRANCH || !native_falls_through(w))
+			continue;
+		for (t = a + 1; t < end && !reach[t - start]; t++)
+			;
+		if (next >= end) {
+			subroutine_leave(b, n, next);
+		} else if (t != next) {
+			EMIT(0xe9); /* jmp next */
+			subroutine_jump(b, n, fixups, &fixed, next, start);
+		}
+	}
+	for (i = 0; i < fixed; i += 2) {
+		int32_t rel = (int32_t)((long)offsets[fixups[i + 1]] - (long)(fixups[i] + 4));
+		memcpy(b + fixups[i], &rel, 4);
+	}
+
+	if (mprotect(o->arena, SUBROUTINE_ARENA_SIZE, PROT_READ | PROT_WRITE) < 0)
+		goto fail;
+	memcpy(base, b, *n);
+	if (mprotect(o->arena, SUBROUTINE_ARENA_SIZE, PROT_READ | PROT_EXEC) < 0)
+		goto fail;
+	o->arena_used += (*n + 15) & ~(size_t)15;
+	o->subroutines[index].code = base;
+fail:
+	free(reach);
+	free(label);
+	free(offsets);
+	free(fixups);
+	free(b);
+	return o->subroutines[index].code;
+}
+
+#undef EMIT
+#undef REX_W
+
+/**
+@brief Run a word as subroutine threaded code, called by the **RUN**
+instruction, which has already pushed the return address.
+@param st state of the virtual machine, **I** is the start of the word,
+and on return where the virtual machine should carry on
+**/
+static void subroutine_run(struct subroutine_state *st)
+{
+	uint8_t *code = subroutine_find(st->o, st->I - 1, 0);
+	if (code)
+		((void (*)(struct subroutine_state *))(uintptr_t)code)(st);
+}
+#endif
+
+int forth_set_subroutine_threading(forth_t *o, int on)
+{
+	assert(o);
+#ifdef USE_SUBROUTINE_THREADING
+	o->subroutine_threading = !!on;
+	return 0;
+#else
+	return on ? -1 : 0;
+#endif
+}
+
+/**
+## Input sources
+
+**evaluate**, **include-file** and **included** all end up in the
+**EVALUATOR** instruction, which reads Forth from another string or file
+before carrying on with the current input. Rather than running the virtual
+machine again from C for each one, which would need another C stack frame
+and **setjmp** for every level of nesting, the current input is pushed onto
+a stack kept in **struct forth** and the text interpreter is started again
+within the same run of the virtual machine. When the new input runs out it
+is popped off, and the virtual machine carries on after the call to
+**EVALUATOR** as if it had returned.
+
+Each entry also records the return stack pointer when it was pushed. If a
+**throw** unwinds the return stack past that point, the input it put aside
+is restored before anything else is read, so an exception caught outside
+of an **evaluate** carries on reading from the right place.
+**/
+
+/**
+@brief Put the current input aside before reading from another
+@param o        forth environment
+@param on_error where to go if there are too many nested input sources
+@param I        where the virtual machine carries on when the new input
+runs out
+**/
+static void source_push(forth_t *o, jmp_buf *on_error, forth_cell_t I)
+{
+	if (o->source_depth >= MAXIMUM_SOURCE_DEPTH) {
+		error("input sources nested more than %u deep", MAXIMUM_SOURCE_DEPTH);
+		longjmp(*on_error, RECOVERABLE);
+	}
+	struct forth_source *s = &o->sources[o->source_depth++];
+	s->sin       = o->m[SIN];
+	s->sidx      = o->m[SIDX];
+	s->slen      = o->m[SLEN];
+	s->fin       = o->m[FIN];
+	s->source_id = o->m[SOURCE_ID];
+	s->unget     = o->unget;
+	s->unget_set = o->unget_set;
+	s->rstk      = o->m[RSTK];
+	s->I         = I;
+	s->handler   = o->m[THROW_HANDLER];
+	s->module    = o->module;
+	o->module    = NULL;
+}
+
+/**
+@brief Go back to reading an input that was put aside, discarding it and
+any that were put aside after it
+@param o     forth environment
+@param depth entry in **o->sources** to go back to
+**/
+static void source_restore(forth_t *o, forth_cell_t depth)
 {
-	assert(o);
-       	assert(o->S < o->m + o->core_size);
-	*++(o->S) = o->m[TOP];
-	o->m[TOP] = f;
+	assert(depth < o->source_depth);
+	struct forth_source *s = &o->sources[depth];
+	for (forth_cell_t i = depth; i < o->source_depth; i++) {
+		module_free(o->sources[i].module);
+		o->sources[i].module = NULL;
+	}
+	o->m[SIN]       = s->sin;
+	o->m[SIDX]      = s->sidx;
+	o->m[SLEN]      = s->slen;
+	o->m[FIN]       = s->fin;
+	o->m[SOURCE_ID] = s->source_id;
+	o->unget        = s->unget;
+	o->unget_set    = s->unget_set;
+	o->source_depth = depth;
 }
 
-forth_cell_t forth_pop(forth_t *o)
+/**
+@brief The current input has run out, go back to the one before it, saving
+the changes made to the cache if it was a module being recorded
+@param  o forth environment, with at least one input put aside
+@return where the virtual machine carries on
+**/
+static forth_cell_t source_pop(forth_t *o)
 {
-	assert(o);
-	assert(o->S > o->m);
-	forth_cell_t f = o->m[TOP];
-	o->m[TOP] = *(o->S)--;
-	return f;
+	struct forth_source *s = &o->sources[o->source_depth - 1];
+	if (s->module)
+		module_save(o, s->module);
+	o->m[RSTK] = s->rstk;
+	o->m[THROW_HANDLER] = s->handler;
+	source_restore(o, o->source_depth - 1);
+	return s->I;
 }
 
-forth_cell_t forth_stack_position(forth_t *o)
+/**
+@brief Restore inputs whose part of the return stack has been unwound by
+**throw**
+@param o    forth environment
+@param base number of inputs put aside before this run of the virtual
+machine, which are not touched
+**/
+static void source_unwind(forth_t *o, forth_cell_t base)
 {
-	assert(o);
-	return o->S - o->vstart;
+	while (o->source_depth > base && o->m[RSTK] <= o->sources[o->source_depth - 1].rstk)
+		source_restore(o, o->source_depth - 1);
 }
 
-void forth_signal(forth_t *o, int sig)
+/**
+Input given to **forth_feed** arrives a piece at a time, and a word, or a
+comment or string read by **ACCEPTER**, can be split between two pieces.
+Rather than reading half of it, the instructions that read input check
+first whether all of what they are going to read is there, and if it is
+not the virtual machine stops as if its budget had run out, with the
+instruction pointer moved back so the instruction runs again when there is
+more input. An instruction run by **READ**, such as **:**, would not be
+run again that way, so **READ** is run again instead, and the input is
+moved back to the start of the word it read.
+
+An instruction run by **execute** cannot be started again, it just sees
+the end of the input.
+@param o         Forth environment
+@param I         instruction pointer of the virtual machine
+@param pc        address after the CODE field of the running word
+@param word      skip white space and stop at the next, as **forth_get_word** does
+@param delimiter character that ends the read, if not reading a word
+@param count     most characters read
+@return true if the virtual machine has to wait for more input
+**/
+static bool feed_starved(forth_t *o, forth_cell_t I, forth_cell_t pc, 
+		bool word, forth_cell_t delimiter, forth_cell_t count)
 {
-	assert(o);
-	o->m[SIGNAL_HANDLER] = (forth_cell_t)((sig * -1) + BIAS_SIGNAL);
+	forth_cell_t *m = o->m;
+	if (m[SOURCE_ID] != (forth_cell_t)STRING_IN || o->source_depth != o->feed_depth)
+		return false;
+	const bool again = m[I - 1] == pc - 1;
+	if (!again && instruction(m[m[I - 1]]) != (forth_cell_t)READ)
+		return false;
+	const char *s = cell_to_host(o, m[SIN]);
+	forth_cell_t i = m[SIDX], n = 0;
+	for (bool unget = o->unget_set; n < count; unget = false) {
+		int ch = 0;
+		if (unget)
+			ch = o->unget;
+		else if (i < m[SLEN])
+			ch = s[i++];
+		else
+			goto starved;
+		if (ch == EOF || (word && !ch))
+			return false;
+		if (word && !n && isspace(ch))
+			continue;
+		if (word ? isspace(ch) : (forth_cell_t)ch == delimiter)
+			return false;
+		n++;
+	}
+	return false;
+starved:
+	if (!again) {
+		m[SIDX] = o->feed_mark;
+		o->unget = o->feed_unget;
+		o->unget_set = o->feed_unget_set;
+	}
+	return true;
 }
 
-char *forth_strdup(const char *s)
+/**
+## Statistics
+
+The counters kept for **forth_stats** are all single increments, on a call,
+on **allocate** and **free** (along with a look up in "Allocated memory"),
+and on every instruction in a local variable that is added to the total now
+and again, so they are always on. Checking
+the depth of the stacks on every instruction would cost too much, so it is
+only compared with the deepest they have been on a call, on a **>r**, when
+the interpreter reads a word and when a run stops. The return stack only
+grows on the first two, so its depth is exact, items put on the variable
+stack by a word and taken off again before it calls another word or returns
+to the interpreter are not counted.
+**/
+static inline void stack_highs(forth_t *o, const forth_cell_t *S)
 {
-	assert(s);
-	char *str;
-	if (!(str = malloc(strlen(s) + 1)))
-		return NULL;
-	strcpy(str, s);
-	return str;
+	const forth_cell_t v = S - o->vstart, r = o->m[RSTK] - (o->vend - o->m);
+	if (v > o->stack_max && v <= o->m[STACK_SIZE])
+		o->stack_max = v;
+	if (r > o->return_max && r <= o->m[STACK_SIZE])
+		o->return_max = r;
 }
 
-void forth_free_words(char **s, size_t length)
+int forth_stats(forth_t *o, struct forth_stats *s)
 {
-	for (size_t i = 0; i < length; i++)
-		free(s[i]);
-	free(s);
+	assert(o && s);
+	const forth_cell_t stack_size = o->m[STACK_SIZE];
+	memset(s, 0, sizeof(*s));
+	s->instructions = o->instructions;
+	s->calls = o->colon_calls;
+	s->stack_high = o->stack_max;
+	s->stack_size = stack_size;
+	s->return_high = o->return_max;
+	s->return_size = stack_size;
+	s->dictionary_used = o->m[DIC] * sizeof(forth_cell_t);
+	s->dictionary_size = (o->vstart - o->m) * sizeof(forth_cell_t);
+	s->allocations = o->allocations;
+	s->allocated = o->allocated;
+	for (forth_cell_t i = HANDLE_DYNAMIC; i < HANDLE_SLOTS; i++)
+		s->files += !!o->files[i];
+	s->run_time = (1000 * (uint64_t)o->run_time) / CLOCKS_PER_SEC;
+	return 0;
 }
 
-char **forth_words(forth_t *o, size_t *length)
+/**
+@brief Print the statistics from **forth_stats**, for the word **stats**
+@param o        Forth environment
+@param on_error error handler, as for **output**
+@param h        handle to write to
+**/
+static void print_stats(forth_t *o, jmp_buf *on_error, forth_cell_t h)
 {
-	assert(o);
-	assert(length);
-	forth_cell_t pwd = o->m[PWD];
-	forth_cell_t *m  = o->m;
-	size_t i;
-	char **n, **s = calloc(2, sizeof(*s));
-	if (!s)
-		return NULL;
-	for (i = 0 ;pwd > DICTIONARY_START; pwd = m[pwd], i++) {
-		forth_cell_t len = WORD_LENGTH(m[pwd + 1]);
-		s[i] = forth_strdup((char*)(&m[pwd-len]));
-		if (!s[i]) {
-			forth_free_words(s, i);
-			*length = 0;
-			return NULL;
-		}
-		n = realloc(s, sizeof(*s) * (i+2));
-		if (!n) {
-			forth_free_words(s, i);
-			*length = 0;
-			return NULL;
-		}
-		s = n;
-	}
-	*length = i;
-	return s;
+	struct forth_stats s;
+	char line[128];
+	forth_stats(o, &s);
+#define PRINT_STATS(...) output(o, on_error, h, line, snprintf(line, sizeof line, __VA_ARGS__))
+	PRINT_STATS("instructions\t%"PRIu64"\n", s.instructions);
+	PRINT_STATS("calls\t\t%"PRIu64"\n", s.calls);
+	PRINT_STATS("stack\t\t%"PRIdCell"/%"PRIdCell" cells\n", s.stack_high, s.stack_size);
+	PRINT_STATS("return stack\t%"PRIdCell"/%"PRIdCell" cells\n", s.return_high, s.return_size);
+	PRINT_STATS("dictionary\t%"PRIdCell"/%"PRIdCell" bytes\n", s.dictionary_used, s.dictionary_size);
+	PRINT_STATS("allocations\t%"PRIu64" (%"PRIu64" not freed)\n", s.allocations, s.allocated);
+	PRINT_STATS("files\t\t%"PRIdCell"\n", s.files);
+	PRINT_STATS("run time\t%"PRIu64" ms\n", s.run_time);
+#undef PRINT_STATS
 }
 
 /**
@@ -2107,16 +6077,43 @@ machine, everything else in this file is just fluff and support for this
 function. This is the Forth virtual machine, it implements a threaded
 code interpreter (see <https://en.wikipedia.org/wiki/Threaded_code>, and
 <https://www.complang.tuwien.ac.at/forth/threaded-code.html>).
+
+Execution starts at the cell **thread**, which normally contains the start
+up word that reads and executes input until there is none left, but can be
+any list of words ending in a zero cell. If **single** is true, as it is for
+**forth_execute**, then a recoverable error does not restart the thread but
+returns an error instead.
+
+If **budget** is not zero then at most that many calls and branches are
+made before the virtual machine stops and returns **FORTH_YIELDED**, the
+instruction pointer is kept in **o->resume**, and the stack and return
+stack are left as they are, so running the thread from there carries on
+as if nothing happened. Only calls and branches are counted as every loop
+has to go through one of them, which keeps the cost down to a decrement
+and a test on those instructions alone. That is done by passing it in as
+**resume**, execution then starts there instead of at **thread**, which is
+still where a recoverable error restarts the virtual machine. A run that
+is not going to be carried on is cancelled by **forth_run_reset**, which
+puts the return stack and the inputs back as they were when it started.
+
+Inputs put aside by **EVALUATOR** during this run are dropped if it stops
+because of an error, those put aside before it, by a C function that ran
+the virtual machine again for instance, belong to the run that called it.
 **/
-int forth_run(forth_t *o)
+static int forth_run_thread(forth_t *o, forth_cell_t thread, forth_cell_t resume, bool single, uint64_t budget)
 {
-	int errorval = 0, rval = 0;
+	int errorval = 0;
 	assert(o);
+	const bool resuming = o->resume && resume == o->resume;
+	const forth_cell_t base = resuming ? o->resume_base : o->source_depth; /* inputs that are not ours */
+	const forth_cell_t rstk = resuming ? o->resume_rstk : o->m[RSTK]; /* return stack when we started */
 	jmp_buf on_error;
 	if (forth_is_invalid(o)) {
 		fatal("refusing to run an invalid forth, %"PRIdCell, forth_is_invalid(o));
 		return -1;
 	}
+	if (resuming)
+		o->resume = 0;
 
 	/* The following code handles errors, if an error occurs, the
 	 * interpreter will jump back to here.
@@ -2136,14 +6133,24 @@ int forth_run(forth_t *o)
 			 * a register which can be set within the running
 			 * virtual machine. */
 			case RECOVERABLE:
+				o->error_count++;
+				if (single && o->m[ERROR_HANDLER] != ERROR_INVALIDATE) {
+					if (o->source_depth > base)
+						source_restore(o, base);
+					return -1;
+				}
 				switch (o->m[ERROR_HANDLER]) {
 				case ERROR_INVALIDATE: 
 					forth_invalidate(o);
 					/* fall-through */
 				case ERROR_HALT:       
+					if (o->source_depth > base)
+						source_restore(o, base);
 					return -forth_is_invalid(o);
-				case ERROR_RECOVER:    
-					o->m[RSTK] = o->core_size - o->m[STACK_SIZE];
+				case ERROR_RECOVER: /* carry on with the current input */
+					o->m[RSTK] = o->source_depth > base ?
+						o->sources[o->source_depth - 1].rstk + 1 :
+						o->core_size - o->m[STACK_SIZE];
 					break;
 				}
 			case OK: 
@@ -2154,16 +6161,17 @@ int forth_run(forth_t *o)
 	forth_cell_t *m = o->m,  /* convenience variable: virtual memory */
 		     pc,         /* virtual machines program counter */
 		     *S = o->S,  /* convenience variable: stack pointer */
-		     I = o->m[INSTRUCTION], /* instruction pointer */
+		     I = resuming && !errorval ? resume : thread, /* instruction pointer */
 		     f = o->m[TOP], /* top of stack */
-		     w,          /* working pointer */
-		     clk;        /* clock variable */
+		     w;          /* working pointer */
+	int rval = 0;        /* returned when the virtual machine stops */
+	bool checked = false; /* is the running word free of stack underflow? */
+	uint64_t executed = 0; /* instructions run, not yet added to o->instructions */
+	uint64_t fuel = budget ? budget : UINT64_MAX; /* calls and branches left */
 
 	assert(m);
 	assert(S);
 
-	clk = (1000 * clock()) / CLOCKS_PER_SEC;
-
 /**
 The following section will explain how the threaded virtual machine interpreter
 works. Threaded code is a simple concept and Forths typically compile
@@ -2264,8 +6272,10 @@ respectively.
 	for (;(pc = m[ck(I++)]);) { 
 	INNER:  
 		w = instruction(m[ck(pc++)]);
+		executed++;
 		if (w < LAST_INSTRUCTION) {
-			cd(stack_bounds[w]);
+			if (!checked)
+				cd(stack_bounds[w]);
 			TRACE(o, w, S, f);
 		}
 
@@ -2279,7 +6289,23 @@ instructions enumeration will not be used (such as **ADD** or
 
 		case PUSH:    *++S = f;     f = m[ck(I++)];          break;
 		case CONST:   *++S = f;     f = m[ck(pc)];           break;
-		case RUN:     m[ck(++m[RSTK])] = I; I = pc;          break;
+		case RUN:     m[ck(++m[RSTK])] = I; I = pc;
+			o->colon_calls++;
+			stack_highs(o, S);
+			checked = stack_check(o, &on_error, pc - 1, S);
+#ifdef USE_SUBROUTINE_THREADING
+			if (o->subroutine_threading && m[DEBUG] < FORTH_DEBUG_INSTRUCTION) {
+				struct subroutine_state st = { o, &on_error, S, f, I };
+				subroutine_run(&st);
+				S = st.S;
+				f = st.f;
+				I = st.I;
+				checked = false; /* it could have stopped anywhere */
+			}
+#endif
+			if (!--fuel)
+				goto yield;
+			break;
 /**
 **DEFINE** backs the Forth word **:**, which is an immediate word, it reads in a
 new word name, creates a header for that word and enters into compile mode,
@@ -2298,9 +6324,11 @@ The created header looks like this:
 The CODE field contains the RUN instruction.
 **/
 		case DEFINE:
+			if (o->feeding && feed_starved(o, I, pc, true, 0, MAXIMUM_WORD_LENGTH - 1))
+				goto hungry;
 			m[STATE] = 1; /* compile mode */
 			if (forth_get_word(o, o->s, MAXIMUM_WORD_LENGTH) < 0)
-				goto end;
+				goto eof;
 			compile(o, RUN, (char*)o->s, true, false);
 			break;
 /**
@@ -2318,6 +6346,7 @@ immediate):
 		case IMMEDIATE:
 			w = m[PWD] + 1;
 			m[w] &= ~COMPILING_BIT;
+			mark_dirty(o, w, 1);
 			break;
 		case READ:
 /**
@@ -2348,12 +6377,44 @@ there is a driver for the interpreter which must be made and initialized
 in **forth_init**, a simple word that calls **READ** in a loop (actually tail
 recursively).
 
+When the input runs out the virtual machine stops, unless the input was
+being read for **EVALUATOR**, in which case the input it put aside is read
+from again and it returns zero. **DEFINE** and **FIND** also end up here
+if there is no word to read.
 **/
-			if (forth_get_word(o, o->s, MAXIMUM_WORD_LENGTH) < 0)
-				goto end;
+			source_unwind(o, base);
+			o->instructions += executed; /* an error would lose them */
+			executed = 0;
+			stack_highs(o, S);
+			if (o->feeding) {
+				if (feed_starved(o, I, pc, true, 0, MAXIMUM_WORD_LENGTH - 1))
+					goto hungry;
+				o->feed_mark = m[SIDX];
+				o->feed_unget = o->unget;
+				o->feed_unget_set = o->unget_set;
+			}
+			if (forth_get_word(o, o->s, MAXIMUM_WORD_LENGTH) < 0) {
+eof:
+				if (o->source_depth <= base)
+					goto end;
+				I = source_pop(o);
+				o->S = S; /* errors go back to this stack */
+				o->m[TOP] = f;
+				*++S = f;
+				f = 0;
+				checked = false;
+				break;
+			}
 			if ((w = forth_find(o, (char*)o->s)) > 1) {
 				pc = w;
 				if (m[STATE] && (m[ck(pc)] & COMPILING_BIT)) {
+					if (inlinable(o, pc, &w)) { /* copy word in */
+						mark_dirty(o, m[DIC], w);
+						for (pc++; w--; pc++)
+							m[dic(m[DIC]++)] = m[ck(pc)];
+						break;
+					}
+					mark_dirty(o, m[DIC], 1);
 					m[dic(m[DIC]++)] = pc; /* compile word */
 					break;
 				}
@@ -2364,6 +6425,7 @@ recursively).
 			}
 
 			if (m[STATE]) { /* must be a number then */
+				mark_dirty(o, m[DIC], 2);
 				m[dic(m[DIC]++)] = 2; /*fake word push at m[2] */
 				m[dic(m[DIC]++)] = w;
 			} else { /* push word */
@@ -2382,9 +6444,9 @@ some of the can be used is a different matter, the COMMA and TAIL word will
 require some explaining, but ADD, SUB and DIV will not.
 **/
 		case LOAD:    f = m[ck(f)];                   break;
-		case STORE:   m[ck(f)] = *S--; f = *S--;      break;
+		case STORE:   m[ck(f)] = *S--; checked &= !mark_dirty(o, f, 1); f = *S--; break;
 		case CLOAD:   f = *(((uint8_t*)m) + ckchar(f)); break;
-		case CSTORE:  ((uint8_t*)m)[ckchar(f)] = *S--; f = *S--; break;
+		case CSTORE:  ((uint8_t*)m)[ckchar(f)] = *S--; checked &= !mark_dirty_chars(o, f, 1); f = *S--; break;
 		case SUB:     f = *S-- - f;                   break;
 		case ADD:     f = *S-- + f;                   break;
 		case AND:     f = *S-- & f;                   break;
@@ -2404,15 +6466,30 @@ require some explaining, but ADD, SUB and DIV will not.
 			break;
 		case ULESS:   f = *S-- < f;                     break;
 		case UMORE:   f = *S-- > f;                     break;
-		case EXIT:    I = m[ck(m[RSTK]--)];             break;
-		case KEY:     *++S = f; f = forth_get_char(o);  break;
-		case EMIT:    f = fputc(f, (FILE*)o->m[FOUT]);  break;
+		case EXIT:    I = m[ck(m[RSTK]--)]; checked = false; break;
+		case KEY:     
+			if (o->feeding && feed_starved(o, I, pc, false, (forth_cell_t)EOF, 1))
+				goto hungry;
+			*++S = f; 
+			f = forth_get_char(o);  
+			break;
+		case EMIT:    
+			{
+				char c = f;
+				f = output(o, &on_error, o->m[FOUT], &c, 1) ? (unsigned char)c : EOF;
+				break;
+			}
 		case FROMR:   *++S = f; f = m[ck(m[RSTK]--)];   break;
-		case TOR:     m[ck(++m[RSTK])] = f; f = *S--;   break;
-		case BRANCH:  I += m[ck(I)];                    break;
-		case QBRANCH: I += f == 0 ? m[I] : 1; f = *S--; break;
-		case PNUM:    f = print_cell(o, (FILE*)(o->m[FOUT]), f); break;
-		case COMMA:   m[dic(m[DIC]++)] = f; f = *S--;   break;
+		case TOR:     m[ck(++m[RSTK])] = f; f = *S--; stack_highs(o, S); break;
+		case BRANCH:  I += m[ck(I)];                    if (!--fuel) goto yield; break;
+		case QBRANCH: I += f == 0 ? m[I] : 1; f = *S--; if (!--fuel) goto yield; break;
+		case PNUM:    f = print_cell(o, &on_error, o->m[FOUT], f); break;
+		case COMMA:   
+			mark_dirty(o, m[DIC], 1); 
+			effects_forget(o, m[DIC]);
+			m[dic(m[DIC]++)] = f; 
+			f = *S--; 
+			break;
 		case EQUAL:   f = *S-- == f;                    break;
 		case SWAP:    w = f;  f = *S--;   *++S = w;     break;
 		case DUP:     *++S = f;                         break;
@@ -2443,19 +6520,39 @@ Instead we must wrap the definition up in another definition:
 And the definition **gcd** can be used. There is a definition of **tail** within
 *forth.fth* that does not have this limitation, in fact the built in definition
 is hidden in favor of the new one.
+
+**TAILCALL** is used by **;** to turn calls at the end of a word into jumps
+where it is safe to do so, see "Tail calls".
 **/
 		case TAIL:
 			m[RSTK]--;
 			break;
+		case TAILCALL:
+			tail_call(o);
+			break;
+		case EFFECT:
+		{
+			struct forth_effect e = stack_effect(o, f, 0);
+			if (e.state == EFFECT_PROVEN) {
+				*++S = e.need;
+				*++S = (forth_cell_t)e.effect;
+				f = -1;
+			} else {
+				f = 0;
+			}
+			break;
+		}
 /** 
 FIND is a natural factor of READ, we add it to the Forth interpreter as
 it already exits, it looks up a Forth word in the dictionary and returns a
 pointer to that word if it found.
 **/
 		case FIND:
+			if (o->feeding && feed_starved(o, I, pc, true, 0, MAXIMUM_WORD_LENGTH - 1))
+				goto hungry;
 			*++S = f;
 			if (forth_get_word(o, o->s, MAXIMUM_WORD_LENGTH) < 0)
-				goto end;
+				goto eof;
 			f = forth_find(o, (char*)o->s);
 			f = f < DICTIONARY_START ? 0 : f;
 			break;
@@ -2492,71 +6589,93 @@ of the stack.
 /**
 CLOCK allows for a primitive and wasteful (depending on how the C
 library implements "clock") timing mechanism, it has the advantage of being
-portable:
+portable. The value is in milliseconds of processor time, only the
+difference between two values is meaningful, so there is no need to call
+"clock" each time the virtual machine is entered:
 **/
 		case CLOCK:
 			*++S = f;
-			f = ((1000 * clock()) - clk) / CLOCKS_PER_SEC;
+			f = (1000 * clock()) / CLOCKS_PER_SEC;
 			break;
 /**
 EVALUATOR is another complex word which needs to be implemented in
-the virtual machine. It saves and restores state which we do
-not usually need to do when the interpreter is not running (the usual case
-for **forth_eval** when called from C). It can read either from a string
-or from a file.
+the virtual machine. It reads either from a string or from a file, the
+current input is put aside (see "Input sources") and the text interpreter
+is started again on the new input, with a fake call on the return stack as
+it would have if it were called from **forth_run**. When the new input runs
+out **READ** carries on after this instruction with a zero on the stack, or
+with the value given to **bye**.
 **/
 		case EVALUATOR:
 		{ 
-			/* save current input */
-			forth_cell_t sin    = o->m[SIN],  sidx = o->m[SIDX],
-				slen   = o->m[SLEN], fin  = o->m[FIN],
-				source = o->m[SOURCE_ID], r = m[RSTK];
-			char *s = NULL;
 			FILE *file = NULL;
-			forth_cell_t length;
-			int file_in = 0;
-			file_in = f; /*get file/string in bool*/
+			char *s = NULL;
+			forth_cell_t length = 0;
+			int file_in = f; /*get file/string in bool*/
 			f = *S--;
 			if (file_in) {
-				file = (FILE*)(*S--);
+				file = forth_get_file(o, &on_error, *S--);
 				f = *S--;
 			} else {
 				s = ((char*)o->m + *S--);
 				length = f;
 				f = *S--;
 			}
-			/* save the stack variables */
-			o->S = S;
+			source_unwind(o, base);
+			if (file_in && !o->module)
+				module_taint(o);
+			source_push(o, &on_error, I);
+			o->S = S; /* errors go back to this stack */
 			o->m[TOP] = f;
-			/* push a fake call to forth_eval */
-			m[RSTK]++;
-			if (file_in) {
-				forth_set_file_input(o, file);
-				w = forth_run(o);
-			} else {
-				w = forth_eval_block(o, s, length);
-			}
-			/* restore stack variables */
-			m[RSTK] = r;
-			S = o->S;
-			*++S = o->m[TOP];
-			f = w;
-			/* restore input stream */
-			o->m[SIN]  = sin;
-			o->m[SIDX] = sidx;
-			o->m[SLEN] = slen;
-			o->m[FIN]  = fin;
-			o->m[SOURCE_ID] = source;
-			if (forth_is_invalid(o))
-				return -1;
+			if (file_in)
+				input_file(o, file);
+			else
+				input_block(o, s, length);
+			m[ck(++m[RSTK])] = I; /* push a fake call to forth_run */
+			I = m[INSTRUCTION];
+			checked = false;
 			break;
 		}
-		case PSTK:    print_stack(o, (FILE*)(o->m[STDOUT]), S, f);
-			      fputc('\n', (FILE*)(o->m[STDOUT]));
+		case PSTK:    print_stack(o, &on_error, o->m[FOUT], S, f);
+			      output(o, &on_error, o->m[FOUT], "\n", 1);
 			      break;
 		case RESTART: longjmp(on_error, f);                   break;
 
 /**
+CCALL is the code field instruction of words made with 
+**forth_define_cfunction**, the cell after the code field selects the 
+function. There is no status cell and the C function never sees the 
+Forth stack, its arguments are taken from the stack here and passed in
+registers (for the usual calling conventions) and its result put back.
+**/
+		case CCALL:
+		{
+			struct forth_cfunction *c = NULL;
+			forth_cell_t r = 0;
+			if (m[ck(pc)] >= o->cfunction_count || !o->cfunctions[m[pc]].function.f0) {
+				error("no foreign function %"PRIdCell, m[pc]);
+				longjmp(on_error, RECOVERABLE);
+			}
+			c = &o->cfunctions[m[pc]];
+			cd(c->arity);
+			switch (c->arity) {
+			case 0: r = c->function.f0();                       break;
+			case 1: r = c->function.f1(f);                      break;
+			case 2: r = c->function.f2(S[0], f);                break;
+			case 3: r = c->function.f3(S[-1], S[0], f);         break;
+			case 4: r = c->function.f4(S[-2], S[-1], S[0], f);  break;
+			}
+			if (c->arity) {
+				S -= c->arity;
+				f = S[1];
+			}
+			if (c->results) {
+				*++S = f;
+				f = r;
+			}
+			break;
+		}
+/**
 CALL allows arbitrary C functions to be passed in and used within
 the interpreter, allowing it to be extended. The functions have to be
 passed in during initialization and then they become available to be
@@ -2611,28 +6730,41 @@ instruction, and would be a useful abstraction.
 
 		case SYSTEM:  f = system(forth_get_string(o, &on_error, &S, f)); break;
 		case FCLOSE:  
-			      errno = 0;
-			      f = fclose((FILE*)f) ? ferrno() : 0;       
-			      break;
+			{
+				FILE *file = forth_get_file(o, &on_error, f);
+				errno = 0;
+				/* the fixed slots hold the standard streams and files
+				 * given to us through the C API, which are not ours to
+				 * close, see "enum handles" */
+				if ((f & HANDLE_MASK) < HANDLE_DYNAMIC) {
+					errno = EBADF;
+					w = EOF;
+				} else {
+					w = fclose(file);
+					handle_close(o, f);
+				}
+				f = w ? ferrno() : 0;
+				break;
+			}
 		case FDELETE: 
 			      errno = 0;
 			      f = remove(forth_get_string(o, &on_error, &S, f)) ? ferrno() : 0; 
 			      break;
 		case FFLUSH:  
 			      errno = 0; 
-			      f = fflush((FILE*)f) ? ferrno() : 0;       
+			      f = fflush(forth_get_file(o, &on_error, f)) ? ferrno() : 0;       
 			      break;
 		case FSEEK:   
 			{
 				errno = 0;
-				int r = fseek((FILE*)(*S--), f, SEEK_SET);
+				int r = fseek(forth_get_file(o, &on_error, *S--), f, SEEK_SET);
 				f = r == -1 ? errno ? ferrno() : -1 : 0;
 				break;
 			}
 		case FPOS:    
 			{
 				errno = 0;
-				int r = ftell((FILE*)f);
+				int r = ftell(forth_get_file(o, &on_error, f));
 				*++S = r;
 				f = r == -1 ? errno ? ferrno() : -1 : 0;
 				break;
@@ -2642,16 +6774,23 @@ instruction, and would be a useful abstraction.
 				const char *fam = forth_get_fam(&on_error, f);
 				f = *S--;
 				char *file = forth_get_string(o, &on_error, &S, f);
+				FILE *n = NULL;
 				errno = 0;
-				*++S = (forth_cell_t)fopen(file, fam);
+				n = fopen(file, fam);
+				*++S = handle_open(o, n);
 				f = ferrno();
+				if (n && !*S) {
+					fclose(n);
+					f = -1;
+				}
 			}
 			break;
 		case FREAD:
 			{
-				FILE *file = (FILE*)f;
+				FILE *file = forth_get_file(o, &on_error, f);
 				forth_cell_t count = *S--;
 				forth_cell_t offset = *S--;
+				mark_dirty_chars(o, offset, count);
 				*++S = fread(((char*)m)+offset, 1, count, file);
 				f = ferror(file);
 				clearerr(file);
@@ -2659,14 +6798,84 @@ instruction, and would be a useful abstraction.
 			break;
 		case FWRITE:
 			{
-				FILE *file = (FILE*)f;
 				forth_cell_t count = *S--;
 				forth_cell_t offset = *S--;
+				if (f == HANDLE_BUFFER_OUT && o->buffer) {
+					*++S = output(o, &on_error, f, ((char*)m)+offset, count);
+					f = *S != count;
+					break;
+				}
+				FILE *file = forth_get_file(o, &on_error, f);
 				*++S = fwrite(((char*)m)+offset, 1, count, file);
 				f = ferror(file);
 				clearerr(file);
 			}
 			break;
+/**
+**FREADLINE** and **FWRITELINE** read and write a line at a time, scanning
+for the end of the line within the buffer of the C library instead of
+reading a character at a time with **read-file**. **read-line** leaves the
+number of characters read, not including the new line, a flag which is
+false only if the end of the file was reached before anything was read,
+and an I/O result. If the line is longer than the buffer the rest of it
+is left to be read next time.
+**/
+		case FREADLINE:
+			{
+				FILE *file = forth_get_file(o, &on_error, f);
+				forth_cell_t count = *S--;
+				forth_cell_t offset = *S--, i;
+				char *line = ((char*)m)+offset;
+				int ch = 0;
+				for (i = 0; i < count && (ch = getc(file)) != EOF && ch != '\n'; i++)
+					line[i] = ch;
+				mark_dirty_chars(o, offset, i);
+				*++S = i;
+				*++S = i || ch != EOF;
+				f = ferror(file);
+				clearerr(file);
+			}
+			break;
+		case FWRITELINE:
+			{
+				forth_cell_t count = *S--;
+				forth_cell_t offset = *S--;
+				if (f == HANDLE_BUFFER_OUT && o->buffer) {
+					f = output(o, &on_error, f, ((char*)m)+offset, count) != count;
+					f = !output(o, &on_error, HANDLE_BUFFER_OUT, "\n", 1) || f;
+					break;
+				}
+				FILE *file = forth_get_file(o, &on_error, f);
+				f = fwrite(((char*)m)+offset, 1, count, file) != count;
+				f = (fputc('\n', file) == EOF) || f || ferror(file);
+				clearerr(file);
+			}
+			break;
+/**
+**ACCEPTER** reads input into a buffer until a delimiter, or the end of
+the input, is reached, for the words **accept** and **word**, leaving the
+number of characters read. The string is terminated with a NUL character,
+which has to fit in the buffer, if it does not -1 is left instead.
+**/
+		case ACCEPTER:
+			{
+				if (o->feeding && feed_starved(o, I, pc, false, f, *S))
+					goto hungry;
+				forth_cell_t count = *S--;
+				forth_cell_t offset = *S--, i;
+				char *s = ((char*)m)+offset;
+				int ch;
+				for (i = 0; i < count; i++) {
+					if ((ch = forth_get_char(o)) == EOF || (forth_cell_t)ch == f)
+						break;
+					s[i] = ch;
+				}
+				if (i < count)
+					s[i] = 0;
+				mark_dirty_chars(o, offset, i + (i < count));
+				f = i < count ? i : (forth_cell_t)-1;
+			}
+			break;
 		case FRENAME:  
 			{
 				const char *f1 = forth_get_fam(&on_error, f);
@@ -2678,10 +6887,16 @@ instruction, and would be a useful abstraction.
 			break;
 		case TMPFILE:
 			{
+				FILE *n = NULL;
 				*++S = f;
 				errno = 0;
-				*++S = (forth_cell_t)tmpfile();
+				n = tmpfile();
+				*++S = handle_open(o, n);
 				f = errno ? ferrno() : 0;
+				if (n && !*S) {
+					fclose(n);
+					f = -1;
+				}
 			}
 			break;
 		case RAISE:
@@ -2713,56 +6928,215 @@ to interact with memory outside of the Forth core.
 **/
 		case MEMMOVE:
 			w = *S--;
-			memmove((char*)(*S--), (char*)w, f);
+			mark_dirty_pointer(o, cell_to_host(o, *S), f);
+			memmove(cell_to_host(o, *S--), cell_to_host(o, w), f);
 			f = *S--;
 			break;
 		case MEMCHR:
+		{
+			char *p = NULL, *r = NULL;
 			w = *S--;
-			f = (forth_cell_t)memchr((char*)(*S--), w, f);
+			p = cell_to_host(o, *S);
+			r = memchr(p, w, f);
+			f = r ? *S + (forth_cell_t)(r - p) : 0;
+			S--;
 			break;
+		}
 		case MEMSET:
 			w = *S--;
-			memset((char*)(*S--), w, f);
+			mark_dirty_pointer(o, cell_to_host(o, *S), f);
+			memset(cell_to_host(o, *S--), w, f);
 			f = *S--;
 			break;
 		case MEMCMP:
 			w = *S--;
-			f = memcmp((char*)(*S--), (char*)w, f);
+			f = memcmp(cell_to_host(o, *S--), cell_to_host(o, w), f);
 			break;
 		case ALLOCATE:
+		{
+			void *p = NULL;
 			errno = 0;
-			*++S = (forth_cell_t)calloc(f, 1);
+			p = calloc(f, 1);
+			*++S = host_to_cell(o, p, 0);
 			f = ferrno();
+			if (p && (!*S || !heap_add(o, p))) {
+				host_release(o, *S);
+				free(p);
+				*S = 0;
+				f = -1;
+			} else if (p) {
+				o->allocations++;
+			}
 			break;
+		}
 		case FREE:
 /**
 It is not likely that the C library will set the errno if it detects a
 problem, it will most likely either abort the program or silently
 corrupt the heap if something goes wrong, however the Forth standard
-requires that an error status is returned.
+requires that an error status is returned. Blocks that **ALLOCATE** did not
+hand out, or that have been freed already, are not in **heap** and are
+refused, see "Allocated memory".
 **/
 			errno = 0;
-			free((char*)f);
+			if (heap_remove(o, cell_to_host(o, f))) {
+				free(cell_to_host(o, f));
+				host_release(o, f);
+			} else if (cell_to_host(o, f)) {
+				errno = EINVAL;
+			}
 			f = ferrno();
 			break;
 		case RESIZE:
+		{
+			void *p = NULL, *q = cell_to_host(o, *S);
 			errno = 0;
-			w = (forth_cell_t)realloc((char*)(*S--), f);
-			*++S = w;
+			if (q && !heap_remove(o, q)) {
+				errno = EINVAL;
+			} else if ((p = realloc(q, f))) {
+				/* there is room, unless 'q' was NULL and it cannot grow */
+				if (!heap_add(o, p)) {
+					free(p);
+					*S = 0;
+					f = -1;
+					break;
+				}
+				host_release(o, *S);
+				*S = host_to_cell(o, p, 0);
+			} else {
+				if (q)
+					heap_add(o, q);
+				*S = 0;
+			}
 			f = ferrno();
 			break;
+		}
 		case GETENV:
 		{
 			char *s = getenv(forth_get_string(o, &on_error, &S, f));
 			f = s ? strlen(s) : 0;
-			*++S = (forth_cell_t)s;
+			*++S = host_to_cell(o, s, 0);
 			break;
 		}
-		case BYE:
+		case BYE: /* within EVALUATOR it only stops the current input */
+			if (o->source_depth > base) {
+				I = source_pop(o);
+				w = f;
+				f = *S--;
+				o->S = S; /* errors go back to this stack */
+				o->m[TOP] = f;
+				*++S = f;
+				f = w;
+				checked = false;
+				break;
+			}
 			rval = f;
 			f = *S--;
 			goto end;
 /**
+The block instructions take the address of a block control area, which is
+allotted in the dictionary by *forth.fth*, the buffers themselves live
+within that area so they can be accessed as normal Forth memory. See
+**block_get** and the functions surrounding it for more details.
+**/
+		case BLOCK:
+			w = *S--;
+			ck(f + BLOCK_HEADER);
+			ckchar((f + BLOCK_HEADER + (m[f + BLOCK_COUNT] * BLOCK_FIELDS)) 
+					* sizeof(forth_cell_t) + (m[f + BLOCK_COUNT] * BLOCK_SIZE) - 1);
+			*++S = block_get(o, m + f, w, &w);
+			f = w;
+			break;
+		case BUPDATE:
+			w = m[ck(f + BLOCK_LAST)];
+			if (w < m[f + BLOCK_COUNT]) {
+				block_meta(m + f, w)[BLOCK_DIRTY] = 1;
+				block_dirty(o, m + f);
+			}
+			f = *S--;
+			break;
+		case BSAVE:
+			f = block_save(o, m + ck(f + BLOCK_HEADER) - BLOCK_HEADER);
+			break;
+		case BEMPTY:
+			block_empty(o, m + ck(f + BLOCK_HEADER) - BLOCK_HEADER);
+			f = *S--;
+			break;
+		case BFILE:
+			w = f;
+			f = *S--;
+			f = block_set_file(o, m + ck(w + BLOCK_HEADER) - BLOCK_HEADER, 
+					forth_get_string(o, &on_error, &S, f));
+			break;
+		case LIBRARY:
+			f = forth_load_library(o, forth_get_string(o, &on_error, &S, f));
+			break;
+/**
+**NATIVE** behaves like **RUN**, except that if the word has been compiled
+to C (and this interpreter has been built with the result) the C function
+is called instead of the threaded code being interpreted. The C function
+returns the address at which interpretation should continue, which is
+normally the return address the word pops off the return stack when it
+exits. If the function is missing, or was generated from a different core,
+the threaded code, which is left in place, is run instead.
+**/
+		case NATIVE:
+		{
+			forth_cell_t n = m[pc - 1] >> NATIVE_INDEX_OFFSET;
+			m[ck(++m[RSTK])] = I;
+			checked = false;
+			if (n < forth_natives_count && forth_natives[n].xt == pc - 1) {
+				forth_cell_t *sp = S, top = f; /* do not take the address of S or f */
+				I = forth_natives[n].function(o, &on_error, &sp, &top);
+				S = sp;
+				f = top;
+			} else {
+				I = pc;
+			}
+			break;
+		}
+/**
+**STRIP** removes the words the entry words on the stack do not need, see
+"Tree shaking". The words on the return stack are being run, so they are
+kept as well, and the return addresses moved along with them.
+**/
+		case STRIP:
+			w = f;
+			if (w > (forth_cell_t)(S - o->vstart)) {
+				error("stack underflow, strip-core needs %"PRIdCell" entries", w);
+				longjmp(on_error, RECOVERABLE);
+			}
+			S -= w;
+			f = strip_core(o, S + 1, w, &I) ? (forth_cell_t)-1 : 0;
+			break;
+/**
+**MODULE** is called by **included** before it reads a file, see "Module
+cache", if it returns true the file does not have to be read.
+**/
+		case MODULE:
+			f = module_begin(o, forth_get_string(o, &on_error, &S, f)) ? (forth_cell_t)-1 : 0;
+			break;
+		case STATS:
+			o->S = S;
+			o->m[TOP] = f;
+			print_stats(o, &on_error, o->m[FOUT]);
+			break;
+		case GENERATE:
+		{
+			forth_cell_t xt = f;
+			FILE *out = NULL;
+			f = *S--;
+			errno = 0;
+			if (!(out = fopen(forth_get_string(o, &on_error, &S, f), "wb"))) {
+				f = ferrno();
+				break;
+			}
+			f = forth_generate_native(o, out, xt);
+			if (fclose(out) && !f)
+				f = ferrno();
+			break;
+		}
+/**
 This should never happen, and if it does it is an indication that virtual
 machine memory has been corrupted somehow.
 **/
@@ -2777,13 +7151,168 @@ interpreter so the C functions like "forth_pop" work correctly. If the
 **forth_t** object has been invalidated (because something went wrong),
 we do not have to jump to *end* as functions like **forth_pop** should not
 be called on the invalidated object any longer.
+
+When the budget runs out the instruction pointer has to be saved as well,
+everything else the virtual machine needs is already in its memory. Running
+out of input given to **forth_feed** is handled the same way, going back
+to the instruction that wanted it, see **feed_starved**.
 **/
+	goto end;
+hungry:
+	I--;
+	o->starved = true;
+yield:
+	o->resume = I;
+	o->resume_base = base;
+	o->resume_rstk = rstk;
+	rval = FORTH_YIELDED;
 end:	
+	o->instructions += executed;
+	stack_highs(o, S);
 	o->S = S;
 	o->m[TOP] = f;
 	return rval;
 }
 
+int forth_run_budget(forth_t *o, uint64_t budget)
+{
+	assert(o);
+	const clock_t start = clock();
+	int r = forth_run_thread(o, o->m[INSTRUCTION], o->resume, false, budget);
+	o->run_time += clock() - start;
+	return r;
+}
+
+void forth_run_reset(forth_t *o)
+{
+	assert(o);
+	if (!o->resume)
+		return;
+	if (o->source_depth > o->resume_base) {
+		o->m[THROW_HANDLER] = o->sources[o->resume_base].handler;
+		source_restore(o, o->resume_base);
+	}
+	o->m[RSTK] = o->resume_rstk;
+	o->resume = 0;
+	o->starved = false;
+	o->feed_length = 0;
+}
+
+int forth_run(forth_t *o)
+{
+	return forth_run_budget(o, 0);
+}
+
+/**
+**forth_execute** runs a single word given its execution token, as returned
+by **forth_lookup**, without going through the text interpreter. A thread
+consisting of the execution token followed by a zero cell, which stops the
+virtual machine, is placed in the otherwise unused cells at
+**EXECUTE_THREAD**, the **RUN** instruction then saves the address of the
+zero cell on the return stack as it would for any other call.
+**/
+forth_xt_t forth_lookup(forth_t *o, const char *name)
+{
+	assert(o && name);
+	return forth_find(o, name);
+}
+
+int forth_execute(forth_t *o, forth_xt_t xt)
+{
+	assert(o);
+	forth_cell_t rstk = o->m[RSTK];
+	int r;
+	if (xt < DICTIONARY_START || xt >= o->core_size)
+		return -1;
+	o->m[EXECUTE_THREAD]     = xt;
+	o->m[EXECUTE_THREAD + 1] = 0;
+	if ((r = forth_run_thread(o, EXECUTE_THREAD, 0, true, 0)) < 0)
+		o->m[RSTK] = rstk;
+	return r;
+}
+
+/**
+**forth_compile** turns a string into an anonymous word, as **:noname**
+would, so that a host running the same code many times only has to parse it
+and look up its words once, each call to **forth_invoke** after that just
+runs the word. The header is written here rather than by evaluating
+**:noname** and **;**, as **;** would reveal the last named word, and the
+word is finished off with **_exit** just as **(;)** would.
+
+Errors halt the interpreter while the string is compiled, so that the
+error count shows if any happened, in which case everything is undone. So
+is a string that defines a word, which would be left inside this one. The
+input being read is put back afterwards, so a word can be compiled in the
+middle of reading something else.
+
+The cell before the **-1** that marks a word as anonymous holds the end of
+the word, so **forth_release** can tell whether anything has been put in
+the dictionary after it, in which case its space cannot be reclaimed.
+**/
+forth_xt_t forth_compile(forth_t *o, const char *s, size_t length)
+{
+	assert(o && s);
+	forth_cell_t *m = o->m, here = m[DIC], xt = here + 2, pwd = m[PWD];
+	const forth_cell_t depth = forth_stack_position(o), errors = o->error_count;
+	const forth_cell_t limit = (o->vstart - m) - 1, handler = m[ERROR_HANDLER];
+	const forth_cell_t input[] = { m[SIN], m[SIDX], m[SLEN], m[FIN], m[SOURCE_ID] };
+	const forth_cell_t exit = forth_find(o, "_exit");
+	const int unget = o->unget;
+	const bool unget_set = o->unget_set;
+	int r = 0;
+	if (forth_is_invalid(o) || !exit || m[STATE] || o->resume || xt >= limit)
+		return 0;
+	mark_dirty(o, here, 3);
+	effects_forget(o, here);
+	m[m[DIC]++] = 0;   /* end of the word, filled in when it is finished */
+	m[m[DIC]++] = -1;  /* marks an anonymous word, see 'see' */
+	m[m[DIC]++] = RUN;
+	m[STATE] = 1;
+	m[ERROR_HANDLER] = ERROR_HALT;
+	r = forth_eval_block(o, s, length);
+	if (!forth_is_invalid(o)) {
+		m[ERROR_HANDLER] = handler;
+		m[SIN] = input[0], m[SIDX] = input[1], m[SLEN] = input[2];
+		m[FIN] = input[3], m[SOURCE_ID] = input[4];
+		o->unget = unget, o->unget_set = unget_set;
+	}
+	if (r < 0 || forth_is_invalid(o) || o->error_count != errors
+	|| !m[STATE] || forth_stack_position(o) != depth || m[DIC] >= limit
+	|| m[PWD] != pwd) { /* words cannot be defined within it */
+		while (!forth_is_invalid(o) && forth_stack_position(o) > depth)
+			forth_pop(o);
+		mark_dirty(o, PWD, 1);
+		m[PWD] = pwd;
+		m[DIC] = here;
+		m[STATE] = 0;
+		effects_forget(o, here);
+		return 0;
+	}
+	mark_dirty(o, m[DIC], 1);
+	m[m[DIC]++] = exit;
+	m[here] = m[DIC];
+	m[STATE] = 0;
+	return xt;
+}
+
+int forth_invoke(forth_t *o, forth_xt_t xt)
+{
+	return forth_execute(o, xt);
+}
+
+int forth_release(forth_t *o, forth_xt_t xt)
+{
+	assert(o);
+	forth_cell_t *m = o->m;
+	if (xt < DICTIONARY_START + 2 || xt > m[DIC] || m[xt - 1] != (forth_cell_t)-1)
+		return -1;
+	if (m[xt - 2] != m[DIC])
+		return -1; /* something is in the way */
+	m[DIC] = xt - 2;
+	effects_forget(o, m[DIC]);
+	return 0;
+}
+
 /**    
 ## An example main function called **main_forth**
 
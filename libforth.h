@@ -19,6 +19,7 @@ extern "C" {
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <limits.h>
 
 /**
 @brief This is the absolute minimum size the Forth virtual machine can be in
@@ -43,14 +44,32 @@ is incompatible with previous or later versions, which is a deficiency of the
 program. A way to migrate core files would be useful, but the task is
 too difficult.
 **/
-#define FORTH_CORE_VERSION  (0x04u)
+#define FORTH_CORE_VERSION  (0x05u)
 
 struct forth; /**< An opaque object that holds a running FORTH environment**/
 typedef struct forth forth_t; /**< Typedef of opaque object for general use */
-typedef uintptr_t forth_cell_t; /**< FORTH cell large enough for a pointer*/
 
+/**
+@brief Cells are normally large enough to hold a pointer, if USE_32BIT_CELLS
+is defined they are 32-bits wide instead, which makes the dictionary and
+stacks half the size on 64-bit machines. Host pointers, such as file handles
+and allocated memory, are then stored in cells as an index into a table held
+by the Forth object along with an offset, and the core can be no larger than
+**MAXIMUM_32BIT_CORE_SIZE** cells. Libraries built with and without this
+option produce incompatible cores, and it must be defined the same way when
+using this header as when building the library.
+**/
+#ifdef USE_32BIT_CELLS
+typedef uint32_t forth_cell_t; /**< FORTH cell, pointers are kept in a table */
+#define PRIdCell PRId32 /**< Decimal format specifier for a Forth cell */
+#define PRIxCell PRIx32 /**< Hex format specifier for a Forth word */
+#define MAXIMUM_32BIT_CORE_SIZE ((1ul << 24) / sizeof(forth_cell_t)) /**< in cells */
+#else
+typedef uintptr_t forth_cell_t; /**< FORTH cell large enough for a pointer*/
 #define PRIdCell PRIdPTR /**< Decimal format specifier for a Forth cell */
 #define PRIxCell PRIxPTR /**< Hex format specifier for a Forth word */
+#endif
+typedef forth_cell_t forth_xt_t; /**< Execution token of a Forth word */
 
 /**
 @brief The **IS_BIG_ENDIAN** macro looks complicated, however all it does is
@@ -91,6 +110,65 @@ struct forth_functions
 	} *functions; /**< list of possible functions for CALL */
 };
 
+/**
+@brief A foreign function that can be given a name in the dictionary with
+**forth_define_cfunction**. Unlike functions called with CALL these do not
+manipulate the Forth stack themselves, the virtual machine pops their
+arguments off the stack and passes them in as normal C arguments, the
+deepest stack item being the first argument, and pushes the result back
+if there is one. The member used must match the declared arity.
+**/
+typedef union {
+	forth_cell_t (*f0)(void); /**< function taking no arguments */
+	forth_cell_t (*f1)(forth_cell_t); /**< one argument */
+	forth_cell_t (*f2)(forth_cell_t, forth_cell_t); /**< two arguments */
+	forth_cell_t (*f3)(forth_cell_t, forth_cell_t, forth_cell_t); /**< three */
+	forth_cell_t (*f4)(forth_cell_t, forth_cell_t, forth_cell_t, forth_cell_t); /**< four */
+} forth_cfunction_t;
+
+#define FORTH_CFUNCTION_MAX_ARITY (4) /**< most arguments a forth_cfunction_t takes */
+
+/**
+@brief A growable buffer that output can be sent to instead of a file, see
+**forth_set_buffer_output**. It belongs to the caller, who may start it off
+empty, with all fields zero, or with memory from **malloc**, and who must
+**free** the data when finished with it. Setting **length** back to zero
+reuses the memory for the next lot of output.
+**/
+typedef struct forth_buffer {
+	char *data;    /**< output, followed by a NUL, may be NULL if empty */
+	size_t length; /**< number of characters of output */
+	size_t size;   /**< number of characters allocated */
+} forth_buffer_t;
+
+/**
+@brief A plugin is a shared object that exports a **struct forth_plugin**
+under the name **FORTH_PLUGIN_SYMBOL**, describing a list of foreign
+functions to be installed as words by **forth_load_library**. For example:
+
+	static const struct forth_plugin_word words[] = {
+		{ "add3", { .f3 = add3 }, 3, 1 },
+	};
+
+	const struct forth_plugin forth_plugin = { 
+		FORTH_PLUGIN_VERSION, sizeof(words)/sizeof(words[0]), words 
+	};
+**/
+struct forth_plugin {
+	unsigned version; /**< must be FORTH_PLUGIN_VERSION */
+	size_t count;     /**< number of words */
+	/**@brief a named foreign function, as in forth_define_cfunction */
+	const struct forth_plugin_word {
+		const char *name;           /**< name of the word */
+		forth_cfunction_t function; /**< function to call */
+		unsigned arity;   /**< number of arguments */
+		unsigned results; /**< number of results, zero or one */
+	} *words; /**< list of words to install */
+};
+
+#define FORTH_PLUGIN_SYMBOL  "forth_plugin" /**< name of exported plugin descriptor */
+#define FORTH_PLUGIN_VERSION (1u)           /**< version of struct forth_plugin */
+
 /**
 @brief The logging function is used to print error messages,
 warnings and notes within this program.
@@ -230,6 +308,67 @@ word name, the entire string will be searched for.
 **/
 forth_cell_t forth_find(forth_t *o, const char *s);
 
+/**
+@brief Look up a Forth word and return its execution token, which can be
+passed to forth_execute. The token remains valid for as long as the word is
+in the dictionary, including across saving and loading the core, so it
+only needs looking up once.
+
+@param  o    initialized forth environment
+@param  name name of the word to look up
+@return execution token, or zero if the word was not found
+**/
+forth_xt_t forth_lookup(forth_t *o, const char *name);
+
+/**
+@brief Execute a single Forth word given its execution token, the word
+takes its arguments from, and leaves its results on, the variable stack,
+which can be accessed with forth_push and forth_pop. This avoids the
+parsing and dictionary search that forth_eval does on every call.
+
+@param  o  initialized forth environment
+@param  xt execution token returned by forth_lookup
+@return int negative on error, in which case the depth of the variable
+stack is as it was before the call, zero (or the value passed to "bye")
+otherwise
+**/
+int forth_execute(forth_t *o, forth_xt_t xt);
+
+/**
+@brief Compile a string into an anonymous word, as if it had been typed in
+between **:noname** and **;**, so that it can be run many times with
+forth_invoke() without being parsed and looked up each time. The input the
+Forth environment is reading is not changed.
+@param o      initialized forth environment, not in the middle of
+compiling a word.
+@param s      source of the word.
+@param length length of **s**.
+@return the execution token of the word, or zero if it could not be
+compiled, in which case the dictionary is left as it was.
+**/
+forth_xt_t forth_compile(forth_t *o, const char *s, size_t length);
+
+/**
+@brief Run a word made by forth_compile(), this is the same as
+forth_execute().
+@param o  initialized forth environment.
+@param xt execution token returned by forth_compile().
+@return negative on error, otherwise zero or the value given to **bye**.
+**/
+int forth_invoke(forth_t *o, forth_xt_t xt);
+
+/**
+@brief Give back the space used by a word made by forth_compile(), which
+can only be done if nothing has been added to the dictionary since it was
+compiled, other than words that have also been released. Words made by
+forth_compile() can be released in the reverse order they were made in.
+The word must not be used afterwards.
+@param o  initialized forth environment.
+@param xt execution token returned by forth_compile().
+@return zero if the space was reclaimed, negative if it could not be.
+**/
+int forth_release(forth_t *o, forth_xt_t xt);
+
 /**
 @brief Convert a string, representing a numeric value, into a forth cell.
 @param  base base to convert string from, valid values are 0, and 2-26
@@ -263,6 +402,43 @@ forth_cell_t forth_pop(forth_t *o);
 **/
 forth_cell_t forth_stack_position(forth_t *o);
 
+/**
+@brief  push an array of values onto the variable stack, the first
+element is pushed first, so the last element ends up on the top.
+
+@param  o initialized forth environment
+@param  v values to push
+@param  n number of values to push
+@return int zero on success, negative if there is not enough room on
+the stack, in which case nothing is pushed
+**/
+int forth_push_n(forth_t *o, const forth_cell_t *v, size_t n);
+
+/**
+@brief  pop values from the variable stack into an array, this is the
+reverse of forth_push_n, the top of the stack is stored in the last
+element.
+
+@param  o      initialized forth environment
+@param[out] v  array to store popped values in
+@param  n      number of values to pop
+@return int zero on success, negative if there are fewer than 'n'
+items on the stack, in which case nothing is popped
+**/
+int forth_pop_n(forth_t *o, forth_cell_t *v, size_t n);
+
+/**
+@brief  get read only access to the variable stack whilst the interpreter
+is not running, the returned pointer is only valid until the stack is next
+modified.
+
+@param  o          initialized forth environment
+@param[out] depth  number of items on the stack
+@return pointer to the bottom of the stack, the top of the stack is at
+index 'depth - 1', or NULL if the stack is completely full
+**/
+const forth_cell_t *forth_stack_view(forth_t *o, forth_cell_t *depth);
+
 /**
 @brief Alert a Forth environment to a signal, this function should be
 called from a signal handler to let the Forth environment know a signal
@@ -323,6 +499,64 @@ values mean more verbose output.
 **/
 void forth_set_debug_level(forth_t *o, enum forth_debug_level level);
 
+/**
+@brief Run the words defined with ':' as subroutine threaded code, that
+is, compiled to lists of calls to primitives in machine code, instead of
+interpreting their threaded code. A word is compiled the first time it is
+run after this is turned on. This is only available on x86-64 Unix
+systems, if libforth was compiled with USE_SUBROUTINE_THREADING defined.
+@param o  initialized forth environment.
+@param on turn subroutine threading on or off.
+@return zero on success, negative if it is not available.
+**/
+int forth_set_subroutine_threading(forth_t *o, int on);
+
+/**
+@brief Turn the module cache on or off. When it is on, the changes to the
+dictionary that including a file with **included** (or **include**) makes
+are saved next to the file, with ".cache" added to its name. The next time
+the same file is included into a dictionary in the same state they are
+copied in directly, instead of reading and compiling the file again. Only
+files that define words should be cached, as nothing else a file does
+when it is included is saved.
+@param o  initialized forth environment.
+@param on turn the module cache on or off.
+@return zero on success, negative on failure.
+**/
+int forth_set_module_cache(forth_t *o, int on);
+
+/**
+@brief How much of its resources a Forth environment has used, filled in
+by **forth_stats**, to help in choosing the size of the core and stacks.
+**/
+struct forth_stats {
+	uint64_t instructions;        /**< instructions run by the virtual machine */
+	uint64_t calls;               /**< calls to words defined in Forth */
+	forth_cell_t stack_high;      /**< most cells the variable stack has held */
+	forth_cell_t stack_size;      /**< cells the variable stack can hold */
+	forth_cell_t return_high;     /**< most cells the return stack has held */
+	forth_cell_t return_size;     /**< cells the return stack can hold */
+	forth_cell_t dictionary_used; /**< bytes taken up by the dictionary */
+	forth_cell_t dictionary_size; /**< bytes it can grow to, up to 'stack-start' */
+	uint64_t allocations;         /**< blocks of memory given out by 'allocate' */
+	uint64_t allocated;           /**< how many of those are yet to be freed */
+	forth_cell_t files;           /**< files opened with 'open-file' still open */
+	uint64_t run_time;            /**< milliseconds of processor time in forth_run */
+};
+
+/**
+@brief Get statistics about how much of its resources a Forth environment
+has used since it was made, or loaded from a core. Instructions run by
+words that have been compiled to machine code are not counted, and the
+depth of the variable stack is measured when a word is called and when the
+interpreter reads a word, not after every instruction. These are also
+printed by the word **stats**.
+@param o initialized forth environment.
+@param s filled in with the statistics.
+@return zero on success, negative on failure.
+**/
+int forth_stats(forth_t *o, struct forth_stats *s);
+
 /** 
 @brief   Execute an initialized forth environment, this will read
 from input until there is no more or an error occurs. If
@@ -336,6 +570,42 @@ errors.
 **/
 int forth_run(forth_t *o); 
 
+/**@brief returned by forth_run_budget() when the budget ran out before the
+input did, negative values are errors and zero, or the value given to
+**bye**, is returned when it finishes. */
+#define FORTH_YIELDED (INT_MAX)
+
+/**
+@brief   This function behaves like forth_run() but stops after making
+**budget** calls and branches, returning FORTH_YIELDED. All of the state of
+the virtual machine is kept so that the next call to forth_run_budget(),
+or forth_run(), carries on exactly where it stopped, which allows a host
+to share its time between many Forth environments or to stop runaway
+programs, which forth_run_reset() then cancels. Words compiled to machine
+code count as a single call.
+
+@param   o      An initialized forth environment.
+@param   budget Most calls and branches to make, zero means no limit.
+@return  int    FORTH_YIELDED if the budget ran out, otherwise as for
+forth_run().
+**/
+int forth_run_budget(forth_t *o, uint64_t budget);
+
+/**
+@brief   Cancel a run stopped by forth_run_budget(), or by forth_feed()
+waiting for more input, so that it is not carried on. The return stack
+and any input put aside by **evaluate** or **include** during the run are
+put back to how they were before it started, reading carries on from
+where the run got to in its input, and the variable stack and anything the
+run defined are left as they are. Setting new input with forth_set_file_input(),
+forth_set_block_input() or forth_set_string_input(), or with the functions
+that call them such as forth_eval(), does this first. It does nothing if
+there is no stopped run.
+
+@param   o      An initialized forth environment. Asserted.
+**/
+void forth_run_reset(forth_t *o);
+
 /** 
 @brief   This function behaves like forth_run() but instead will
 read from a string until there is no more. It will like-
@@ -364,6 +634,24 @@ read from does not have to be NUL terminated.
 
 int forth_eval_block(forth_t *o, const char *s, size_t length);
 
+/**
+@brief Evaluate input that arrives a piece at a time, such as from a
+network connection, without having to join it all together first. Each
+piece is run as far as it can be, anything that is split between pieces,
+such as a word, or a comment or string being read, waits for the rest of
+it to be fed in. Only the unread part of a piece is kept.
+
+@param  o      An initialized forth environment. Caller frees.
+@param  s      The next piece of input, it does not have to be NUL
+terminated or kept after this call returns. Asserted unless 'length' is
+zero.
+@param  length Size of the piece.
+@param  last   Non zero if this is the last piece, otherwise running out of
+input waits for the next piece instead of ending.
+@return int This is an error code, less than one is an error. 
+**/
+int forth_feed(forth_t *o, const char *s, size_t length, int last);
+
 /** 
 @brief  Dump a raw forth object to disk, for debugging purposes, this
 cannot be loaded with "forth_load_core_file".
@@ -380,7 +668,9 @@ loaded again with forth_load_core_file. The file passed in should
 be have been opened up in binary mode ("wb"). These files
 are not portable, files generated on machines with different
 machine word sizes or endianess will not work with each
-other.
+other. Only the dictionary and the live parts of the stacks
+are written out, so the size of the file depends on how much
+of the core is in use and not on how large the core is.
 
 @warning Note that this function will not save out the contents
 or in anyway remember the forth_functions structure passed
@@ -395,6 +685,57 @@ passed NULL.
 **/
 int forth_save_core_file(forth_t *o, FILE *dump);
 
+/**
+@brief Options that control how a core file is written out by
+forth_save_core_file_options, they can be or'ed together.
+**/
+enum forth_core_options
+{
+	FORTH_CORE_COMPRESS = 1u << 0, /**< run length encode the core */
+	FORTH_CORE_SPARSE   = 1u << 1, /**< only save the parts of the core in use */
+};
+
+/**
+@brief This is the same as forth_save_core_file, however options can be
+passed in to change how the core is stored. Compressed cores are much
+smaller, as the space between the dictionary and the stacks is mostly
+zeros, and sparse cores skip that space entirely, both kinds can be loaded
+by forth_load_core_file and forth_load_core_memory as normal.
+
+@param   o       The FORTH environment to dump. Caller frees. Asserted.
+@param   dump    Core dump file handle ("wb"). Caller closes. Asserted.
+@param   options Or'ed together values from enum forth_core_options
+@return  int     An error code, negative on error. 
+**/
+int forth_save_core_file_options(forth_t *o, FILE *dump, unsigned options);
+
+/**
+@brief Write out a delta checkpoint, containing only the memory that has
+changed since the last call to this function or to forth_save_core_file
+or forth_save_core_file_options. Making frequent checkpoints of a large
+core is much cheaper this way, a delta cannot be loaded by itself but must
+be applied with forth_apply_delta to the core and the deltas it follows.
+
+@param   o     The FORTH environment to checkpoint. Asserted.
+@param   delta File to write the checkpoint to ("wb"). Caller closes. Asserted.
+@return  int   An error code, negative on error.
+**/
+int forth_checkpoint_delta(forth_t *o, FILE *delta);
+
+/**
+@brief Apply a delta checkpoint made by forth_checkpoint_delta to a Forth
+object, which should be loaded from the core the deltas were made after,
+with each delta applied in order. The result can be saved as a full core
+again, compacting the core and its deltas. As with forth_load_core_file
+the input and output of the object are reset to standard in and out.
+
+@param   o     The FORTH environment to apply the delta to. Asserted.
+@param   delta File containing the delta checkpoint ("rb"). Caller closes. Asserted.
+@return  int   An error code, negative on error, in which case the object
+may have been partially updated.
+**/
+int forth_apply_delta(forth_t *o, FILE *delta);
+
 /** 
 @brief  Load a Forth file from disk, returning a forth object that
 can be passed to forth_run. The loaded core file will have it's
@@ -410,8 +751,8 @@ forth_t *forth_load_core_file(FILE *dump);
 
 /**
 @brief Load a core file from memory, much like forth_load_core_file. The
-size parameter must be greater or equal to the MINIMUM_CORE_SIZE, this
-is asserted. 
+memory must contain the entire core file, including its header, it may be
+compressed or sparse.
 
 @param m    memory containing a Forth core file
 @param size size of core file in memory in bytes
@@ -421,7 +762,8 @@ forth_t *forth_load_core_memory(char *m, size_t size);
 
 /**
 @brief Save a Forth object to memory, this function will allocate
-enough memory to store the core file. 
+enough memory to store the core file. Like forth_save_core_file,
+only the parts of the core in use are saved.
 
 @param o    forth object to save to memory, Asserted.
 @param[out] size of returned object, in bytes
@@ -441,8 +783,110 @@ name
 **/
 int forth_define_constant(forth_t *o, const char *name, forth_cell_t c);
 
+/**
+@brief Define a new word that calls a foreign function directly. The word
+pops 'arity' cells, calls 'function' with them and pushes its return value
+if 'results' is one, no status value is pushed. For example:
+
+	static forth_cell_t add3(forth_cell_t a, forth_cell_t b, forth_cell_t c)
+	{
+		return a + b + c;
+	}
+
+	forth_define_cfunction(o, "add3", (forth_cfunction_t){ .f3 = add3 }, 3, 1);
+
+Would allow "1 2 3 add3" to leave 6 on the stack. The functions are held
+by the Forth object and not in its core, so like the functions passed to
+**forth_init** they have to be given again after loading a core that refers
+to them, with forth_rebind_cfunction().
+
+@param o        Forth environment to define the word in
+@param name     Name of the new word
+@param function Function to call, the member used must agree with 'arity'
+@param arity    Number of arguments, up to FORTH_CFUNCTION_MAX_ARITY
+@param results  Number of results, zero or one
+@return zero on success, negative on failure
+**/
+int forth_define_cfunction(forth_t *o, const char *name, forth_cfunction_t function, unsigned arity, unsigned results);
+
+/**
+@brief Bind the word 'name', made by forth_define_cfunction() before a
+core was saved, to its function again after the core has been loaded. The
+word keeps the same index into the table of functions it had when it was
+made, so words compiled before the core was saved still call it, and
+functions can be bound in any order. Words loaded from a plugin with
+forth_load_library() are bound again when the core is loaded.
+
+@param o        Forth environment containing the word
+@param name     Name of the word
+@param function Function to call, the member used must agree with 'arity'
+@param arity    Number of arguments, up to FORTH_CFUNCTION_MAX_ARITY
+@param results  Number of results, zero or one
+@return zero on success, negative if there is no such foreign function word
+**/
+int forth_rebind_cfunction(forth_t *o, const char *name, forth_cfunction_t function, unsigned arity, unsigned results);
+
+/**
+@brief Load a plugin library and install the words it describes, see
+**struct forth_plugin**. The path of the library is recorded in the
+core, and **forth_load_core_file** and **forth_load_core_memory** will
+load it again and rebind the words to it. This is only available if
+libforth was compiled with USE_PLUGINS defined, which needs **dlopen**.
+
+@param o    Forth environment to install the words in
+@param path Path of the library, as passed to dlopen
+@return zero on success, negative on failure
+**/
+int forth_load_library(forth_t *o, const char *path);
+
+/**
+@brief Translate the threaded code of Forth words into C, so they can
+be compiled into the interpreter. The translated words are marked in
+the core, which should then be saved and built into the interpreter
+along with the generated C by defining USE_BUILT_IN_CORE and
+USE_NATIVE_WORDS, see the "libforth-native" make target.
+
+@param o     Forth environment containing the words
+@param out   File to write the C code to
+@param entry Execution token of a word, this word and the words it
+             calls are translated, or zero to translate all words
+             defined with ':'
+@return zero on success, negative on failure
+**/
+int forth_generate_native(forth_t *o, FILE *out, forth_xt_t entry);
+
+/**
+@brief Remove the words that are not needed by a list of entry words from
+the dictionary, moving the words that are left together, so a smaller core
+can be saved. Words naming instructions and the word run at start up are
+always kept. Addresses of words stored in variables and constants are not
+updated, see "Tree shaking" in libforth.c.
+
+@param o       Forth environment containing the words, it must not be
+               running any of them
+@param entries Execution tokens of the entry words
+@param count   Number of entry words
+@return zero on success, negative on failure, in which case the
+        dictionary is unchanged
+**/
+int forth_strip_core(forth_t *o, const forth_xt_t *entries, size_t count);
+
+/**
+@brief Write out the dictionary that **forth_init** builds as C, so it
+can be compiled into the interpreter and copied in by **forth_init**
+instead of being built each time. The interpreter should be rebuilt with
+the generated file and USE_INITIAL_IMAGE defined, see the "forth-image"
+make target.
+
+@param out File to write the C code to
+@return zero on success, negative on failure
+**/
+int forth_generate_image(FILE *out);
+
 /** 
-@brief Set the input of an environment 'o' to read from a file 'in'.
+@brief Set the input of an environment 'o' to read from a file 'in', a
+run that was stopped before it finished is cancelled first, see
+forth_run_reset().
 
 @param o   An initialized FORTH environment. Caller frees.
 @param in  Open handle for reading; "r"/"rb". Caller closes. 
@@ -457,9 +901,34 @@ void forth_set_file_input(forth_t *o, FILE *in);
 **/
 void forth_set_file_output(forth_t *o, FILE *out);
 
+/** 
+@brief Send the output of an environment 'o' to a buffer in memory, which
+is grown with **realloc** as needed. **emit**, numbers printed with **.**,
+**.s**, and **write-file** or **write-line** given the output handle held
+in **`fout** all append to it directly, without going through the C
+library.
+
+@param o An initialized FORTH environment. Caller frees. Asserted.
+@param b Buffer to append to, it must remain valid until the output is
+changed again. If NULL output goes back to standard output.
+**/
+void forth_set_buffer_output(forth_t *o, forth_buffer_t *b);
+
+/** 
+@brief Look at the output collected by the buffer set with
+**forth_set_buffer_output** without copying it.
+
+@param o      An initialized FORTH environment. Asserted.
+@param length If not NULL, set to the number of characters of output.
+@return NUL terminated output, which is only valid until the next time
+output is written, or an empty string if there is none.
+**/
+const char *forth_output_view(forth_t *o, size_t *length);
+
 /** 
 @brief Set the input of an environment 'o' to read from a block of
-memory.
+memory, a run that was stopped before it finished is cancelled first, see
+forth_run_reset().
 
 @param o      An initialized FORTH environment. Caller frees. Asserted.
 @param s      A block of memory to act as input. Asserted. 
@@ -468,7 +937,9 @@ memory.
 void forth_set_block_input(forth_t *o, const char *s, size_t length); 
 
 /** 
-@brief Set the input of an environment 'o' to read from a string 's'.
+@brief Set the input of an environment 'o' to read from a string 's', a
+run that was stopped before it finished is cancelled first, see
+forth_run_reset().
 
 @param o   An initialized FORTH environment. Caller frees. Asserted.
 @param s   A NUL terminated string to act as input. Asserted. 
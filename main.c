@@ -34,6 +34,8 @@ global variable so signal handlers can access it.
 **/
 static forth_t *global_forth_environment; 
 static int enable_signal_handling;
+static int use_subroutine_threading;
+static int use_module_cache;
 
 typedef void (*signal_handler)(int sig); /**< functions for handling signals*/
 
@@ -194,7 +196,7 @@ static void usage(const char *name)
 {
 	fprintf(stderr, 
 		"usage: %s "
-		"[-(s|l|f) file] [-e expr] [-m size] [-LSVthvnx] [-] files\n", 
+		"[-(s|l|f|D|i) file] [-e expr] [-m size] [-LSVthvnxzc] [-] files\n", 
 		name);
 }
 
@@ -215,14 +217,19 @@ static void help(void)
 "\t-e string evaluate a string\n"
 "\t-s file   save state of forth interpreter to file\n"
 "\t-S        save state to 'forth.core'\n"
+"\t-z        compress saved state\n"
 "\t-n        use the line editor, if available, when reading from stdin\n"
 "\t-f file   immediately read from and execute a file\n"
 "\t-l file   load previously saved state from file\n"
 "\t-L        load previously saved state from 'forth.core'\n"
+"\t-D file   apply a delta checkpoint to the loaded state\n"
+"\t-i file   write the initial dictionary out as C, then exit\n"
 "\t-m size   specify forth memory size in KiB (cannot be used with '-l')\n"
 "\t-t        process stdin after processing forth files\n"
 "\t-v        turn verbose mode on\n"
 "\t-x        enable signal handling\n"
+"\t-j        run words as subroutine threaded code, if available\n"
+"\t-c        cache the words defined by included files next to them\n"
 "\t-V        print out version information and exit\n"
 "\t-         stop processing options\n\n"
 "Options must come before files to execute.\n\n"
@@ -289,6 +296,10 @@ static forth_t *forth_initial_enviroment(forth_t **o, forth_cell_t size,
 
 finished:
 	forth_set_debug_level(*o, verbose);
+	if (use_subroutine_threading && forth_set_subroutine_threading(*o, 1) < 0)
+		warning("subroutine threading is not available, %s", "build with USE_SUBROUTINE_THREADING");
+	if (use_module_cache)
+		forth_set_module_cache(*o, 1);
 	forth_set_args(*o, argc, argv);
 	global_forth_environment = *o;
 	return *o;
@@ -312,6 +323,7 @@ int main(int argc, char **argv)
 	    eval = 0,            /* have we evaluated anything? */
 	    readterm = 0,        /* read from standard in */
 	    use_line_editor = 0, /* use a line editor, *if* one exists */
+	    compress = 0,        /* compress the saved core file */
 	    mset = 0;            /* memory size specified */
 	enum forth_debug_level verbose = FORTH_DEBUG_OFF; /* verbosity level */
 	static const size_t kbpc = 1024 / sizeof(forth_cell_t); /*kilobytes per cell*/
@@ -365,6 +377,16 @@ sacrifice portability.
 			   break;
 		case 'u':
 			   return libforth_unit_tests(0, 0, 0);
+		case 'i':
+			if (i >= (argc - 1))
+				goto fail;
+			dump = forth_fopen_or_die(argv[++i], "wb");
+			if (forth_generate_image(dump) < 0) {
+				fatal("%s, generating initial image failed", argv[i]);
+				return -1;
+			}
+			fclose(dump);
+			return EXIT_SUCCESS;
 		case 'e':
 			if (i >= (argc - 1))
 				goto fail;
@@ -422,6 +444,20 @@ sacrifice portability.
 			forth_set_debug_level(o, verbose);
 			fclose(dump);
 			break;
+		case 'D':
+			if (!o || (i >= argc - 1))
+				goto fail;
+			optarg = argv[++i];
+			if (verbose >= FORTH_DEBUG_NOTE)
+				note("applying delta checkpoint '%s'", optarg);
+			dump = forth_fopen_or_die(optarg, "rb");
+			if (forth_apply_delta(o, dump) < 0) {
+				fatal("%s, applying delta checkpoint failed", optarg);
+				return -1;
+			}
+			forth_set_debug_level(o, verbose);
+			fclose(dump);
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -432,6 +468,15 @@ sacrifice portability.
 		case 'x':
 			enable_signal_handling = 1;
 			break;
+		case 'j':
+			use_subroutine_threading = 1;
+			break;
+		case 'c':
+			use_module_cache = 1;
+			break;
+		case 'z':
+			compress = 1;
+			break;
 		default:
 		fail:
 			fatal("invalid argument '%s'", argv[i]);
@@ -481,7 +526,8 @@ state with invalid data.
 		}
 		if (verbose >= FORTH_DEBUG_NOTE)
 			note("saving for file to '%s'", dump_name);
-		if (forth_save_core_file(o, dump = forth_fopen_or_die(dump_name, "wb"))) {
+		dump = forth_fopen_or_die(dump_name, "wb");
+		if (forth_save_core_file_options(o, dump, FORTH_CORE_SPARSE | (compress ? FORTH_CORE_COMPRESS : 0))) {
 			fatal("core file save to '%s' failed", dump_name);
 			rval = -1;
 		}
@@ -0,0 +1,28 @@
+/** 
+@file     plugin.c
+@brief    an example plugin for libforth, loaded by the unit tests when
+          plugins are supported, see "struct forth_plugin" in libforth.h
+@author   Richard Howe
+@license  MIT (see https://opensource.org/licenses/MIT)
+@email    howe.r.j.89@gmail.com 
+**/
+#include "libforth.h"
+
+static forth_cell_t add3(forth_cell_t a, forth_cell_t b, forth_cell_t c)
+{
+	return a + b + c;
+}
+
+static forth_cell_t twice(forth_cell_t a)
+{
+	return a * 2;
+}
+
+static const struct forth_plugin_word words[] = {
+	{ "add3",  { .f3 = add3 },  3, 1 },
+	{ "twice", { .f1 = twice }, 1, 1 },
+};
+
+const struct forth_plugin forth_plugin = { 
+	FORTH_PLUGIN_VERSION, sizeof(words)/sizeof(words[0]), words 
+};
@@ -215,6 +215,35 @@ static int forth_function_2(forth_t *f)
 	return 0;
 }
 
+/* core_string copies a string into the dictionary, which is where words
+that take strings expect them to be, returning its address */
+static forth_cell_t core_string(forth_t *f, const char *s)
+{
+	const size_t length = strlen(s) + 1;
+	forth_cell_t at = 0;
+	forth_push(f, (length + sizeof(forth_cell_t) - 1) / sizeof(forth_cell_t));
+	if (forth_eval(f, "here swap allot") < 0)
+		return 0;
+	at = forth_pop(f) * sizeof(forth_cell_t);
+	for (size_t i = 0; i < length; i++) {
+		forth_push(f, s[i]);
+		forth_push(f, at + i);
+		if (forth_eval(f, "c!") < 0)
+			return 0;
+	}
+	return at;
+}
+
+/* foreign functions for forth_define_cfunction */
+static forth_cell_t cfunction_calls = 0;
+static forth_cell_t cfunction_0(void) { return 42; }
+static forth_cell_t cfunction_2(forth_cell_t a, forth_cell_t b) { return a - b; }
+static forth_cell_t cfunction_4(forth_cell_t a, forth_cell_t b, forth_cell_t c, forth_cell_t d)
+{
+	cfunction_calls++;
+	return a * 1000 + b * 100 + c * 10 + d;
+}
+
 int libforth_unit_tests(int keep_files, int colorize, int silent)
 {
 	tb.is_silent = silent;
@@ -335,6 +364,97 @@ int libforth_unit_tests(int keep_files, int colorize, int silent)
 		state(&tb, forth_free(f));
 		state(&tb, fclose(core));
 	}
+	{
+		/* test compressed cores can be saved and then loaded back in */
+		FILE *core;
+		forth_t *f;
+		long raw, compressed;
+		state(&tb, core = fopen("unit.core", "rb"));
+		must(&tb, core);
+		state(&tb, f = forth_load_core_file(core));
+		must(&tb, f);
+		state(&tb, fseek(core, 0, SEEK_END));
+		state(&tb, raw = ftell(core));
+		state(&tb, fclose(core));
+
+		state(&tb, core = fopen("unit.z.core", "wb"));
+		must(&tb, core);
+		test(&tb, forth_save_core_file_options(f, core, FORTH_CORE_COMPRESS) >= 0);
+		state(&tb, compressed = ftell(core));
+		state(&tb, fclose(core));
+		state(&tb, forth_free(f));
+		test(&tb, compressed < raw);
+
+		state(&tb, core = fopen("unit.z.core", "rb"));
+		must(&tb, core);
+		state(&tb, f = forth_load_core_file(core));
+		must(&tb, f);
+		test(&tb, forth_eval(f, "unit-01 constant-1 *") >= 0);
+		test(&tb, forth_pop(f) == 69 * 0xAA0A);
+		state(&tb, forth_free(f));
+		state(&tb, fclose(core));
+		state(&tb, remove("unit.z.core"));
+	}
+	{
+		/* test delta checkpoints can be made and applied to a core */
+		FILE *core, *d1, *d2;
+		forth_t *f;
+		forth_cell_t v;
+		long full, delta;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE * 64, stdin, stdout, NULL));
+		must(&tb, f);
+		state(&tb, core = fopen("unit.base.core", "wb"));
+		must(&tb, core);
+		test(&tb, forth_save_core_file_options(f, core, 0) >= 0);
+		state(&tb, full = ftell(core));
+		state(&tb, fclose(core));
+
+		test(&tb, forth_eval(f, ": unit-02 123 ; here 7 , ") >= 0);
+		state(&tb, v = forth_pop(f));
+		state(&tb, d1 = fopen("unit.1.delta", "wb"));
+		must(&tb, d1);
+		test(&tb, forth_checkpoint_delta(f, d1) >= 0);
+		state(&tb, delta = ftell(d1));
+		state(&tb, fclose(d1));
+		test(&tb, delta < full / 16);
+
+		state(&tb, forth_push(f, 99));
+		state(&tb, forth_push(f, v));
+		test(&tb, forth_eval(f, "!") >= 0);
+		state(&tb, d2 = fopen("unit.2.delta", "wb"));
+		must(&tb, d2);
+		test(&tb, forth_checkpoint_delta(f, d2) >= 0);
+		state(&tb, fclose(d2));
+		state(&tb, forth_free(f));
+
+		/* deltas cannot be loaded as cores */
+		state(&tb, d2 = fopen("unit.2.delta", "rb"));
+		must(&tb, d2);
+		test(&tb, !forth_load_core_file(d2));
+		state(&tb, fclose(d2));
+
+		state(&tb, core = fopen("unit.base.core", "rb"));
+		must(&tb, core);
+		state(&tb, f = forth_load_core_file(core));
+		must(&tb, f);
+		state(&tb, fclose(core));
+		test(&tb, !forth_find(f, "unit-02"));
+		state(&tb, d1 = fopen("unit.1.delta", "rb"));
+		state(&tb, d2 = fopen("unit.2.delta", "rb"));
+		must(&tb, d1 && d2);
+		test(&tb, forth_apply_delta(f, d1) >= 0);
+		test(&tb, forth_apply_delta(f, d2) >= 0);
+		state(&tb, forth_push(f, v));
+		test(&tb, forth_eval(f, "unit-02 swap @") >= 0);
+		test(&tb, forth_pop(f) == 99);
+		test(&tb, forth_pop(f) == 123);
+		state(&tb, fclose(d1));
+		state(&tb, fclose(d2));
+		state(&tb, forth_free(f));
+		state(&tb, remove("unit.base.core"));
+		state(&tb, remove("unit.1.delta"));
+		state(&tb, remove("unit.2.delta"));
+	}
 	{ /* test invalidation fails */
 		FILE *core;
 		forth_t *f;
@@ -469,11 +589,683 @@ int libforth_unit_tests(int keep_files, int colorize, int silent)
 		state(&tb, forth_free(f));
 		state(&tb, forth_delete_function_list(ff));
 	}
+	{ /* tests for executing words by their execution token */
+		forth_t *f = NULL;
+		forth_xt_t add, square, sum, divide;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		test(&tb, forth_eval(f, ": square dup * ; : sum square swap square + ; : divide / ;") >= 0);
+
+		test(&tb, 0 == forth_lookup(f, "no-such-word"));
+		must(&tb, add    = forth_lookup(f, "+"));
+		must(&tb, square = forth_lookup(f, "square"));
+		must(&tb, sum    = forth_lookup(f, "sum"));
+		must(&tb, divide = forth_lookup(f, "divide"));
+		test(&tb, forth_execute(f, 0) < 0);
+
+		/* built in instructions */
+		state(&tb, forth_push(f, 2));
+		state(&tb, forth_push(f, 3));
+		test(&tb, forth_execute(f, add) >= 0);
+		test(&tb, 5 == forth_pop(f));
+
+		/* words defined in Forth, which call other words */
+		state(&tb, forth_push(f, 7));
+		test(&tb, forth_execute(f, square) >= 0);
+		test(&tb, 49 == forth_pop(f));
+		state(&tb, forth_push(f, 3));
+		state(&tb, forth_push(f, 4));
+		test(&tb, forth_execute(f, sum) >= 0);
+		test(&tb, forth_execute(f, square) >= 0);
+		test(&tb, 625 == forth_pop(f));
+		test(&tb, 0 == forth_stack_position(f));
+
+		/* errors are returned, not recovered from */
+		state(&tb, forth_push(f, 1));
+		state(&tb, forth_push(f, 0));
+		test(&tb, forth_execute(f, divide) < 0);
+		test(&tb, 2 == forth_stack_position(f));
+		state(&tb, forth_pop(f));
+		state(&tb, forth_pop(f));
+
+		/* the interpreter still works afterwards */
+		test(&tb, forth_eval(f, "6 square") >= 0);
+		test(&tb, 36 == forth_pop(f));
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for batch transfer of cells to and from the stack */
+		forth_t *f = NULL;
+		forth_cell_t in[] = { 1, 2, 3 }, out[3] = { 0 }, depth = 0;
+		const forth_cell_t *view = NULL;
+		static forth_cell_t big[MINIMUM_CORE_SIZE];
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+
+		test(&tb, forth_push_n(f, in, 3) >= 0);
+		test(&tb, 3 == forth_stack_position(f));
+		test(&tb, 3 == forth_pop(f));
+		test(&tb, 2 == forth_pop(f));
+		test(&tb, 1 == forth_pop(f));
+
+		state(&tb, forth_push(f, 9));
+		test(&tb, forth_push_n(f, in, 3) >= 0);
+		test(&tb, forth_eval(f, "+ +") >= 0); /* works with the interpreter */
+		test(&tb, forth_pop_n(f, out, 2) >= 0);
+		test(&tb, 9 == out[0] && 6 == out[1]);
+		test(&tb, 0 == forth_stack_position(f));
+
+		test(&tb, forth_push_n(f, in, 3) >= 0);
+		test(&tb, NULL != (view = forth_stack_view(f, &depth)));
+		test(&tb, 3 == depth);
+		test(&tb, 1 == view[0] && 2 == view[1] && 3 == view[2]);
+		test(&tb, forth_pop_n(f, out, 3) >= 0);
+		test(&tb, 1 == out[0] && 2 == out[1] && 3 == out[2]);
+
+		/* failures leave the stack untouched */
+		test(&tb, forth_pop_n(f, out, 1) < 0);
+		state(&tb, forth_push(f, 5));
+		test(&tb, forth_push_n(f, big, MINIMUM_CORE_SIZE) < 0);
+		test(&tb, forth_pop_n(f, out, 2) < 0);
+		test(&tb, 1 == forth_stack_position(f));
+		test(&tb, 5 == forth_pop(f));
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for file handles */
+		forth_t *f1 = NULL, *f2 = NULL;
+		forth_cell_t h1, h2, out;
+		forth_xt_t flush;
+		char *m = NULL;
+		size_t size = 0;
+		state(&tb, f1 = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f1);
+		must(&tb, flush = forth_lookup(f1, "flush-file"));
+		test(&tb, forth_eval(f1, "temporary-file") >= 0);
+		test(&tb, 0 == forth_pop(f1));
+		test(&tb, 0 != (h1 = forth_pop(f1)));
+		state(&tb, forth_push(f1, h1));
+		test(&tb, forth_eval(f1, "close-file") >= 0);
+		test(&tb, 0 == forth_pop(f1));
+		/* a closed handle is rejected, even if its slot is reused */
+		test(&tb, forth_eval(f1, "temporary-file") >= 0);
+		test(&tb, 0 == forth_pop(f1));
+		test(&tb, h1 != (h2 = forth_pop(f1)));
+		state(&tb, forth_push(f1, h1));
+		test(&tb, forth_execute(f1, flush) < 0);
+		test(&tb, h1 == forth_pop(f1));
+		state(&tb, forth_push(f1, h2));
+		test(&tb, forth_execute(f1, flush) >= 0);
+		test(&tb, 0 == forth_pop(f1));
+		/* the standard streams cannot be closed, and still work after */
+		test(&tb, forth_eval(f1, "`stdout @ close-file `stderr @ close-file") >= 0);
+		test(&tb, 0 != forth_pop(f1));
+		test(&tb, 0 != forth_pop(f1));
+		test(&tb, forth_eval(f1, "`stdout @") >= 0);
+		test(&tb, forth_execute(f1, flush) >= 0);
+		test(&tb, 0 == forth_pop(f1));
+
+		/* open files are closed in a loaded core, standard streams are not */
+		test(&tb, forth_eval(f1, "`stdout @") >= 0);
+		state(&tb, out = forth_pop(f1));
+		must(&tb, m = forth_save_core_memory(f1, &size));
+		must(&tb, f2 = forth_load_core_memory(m, size));
+		state(&tb, forth_push(f2, h2));
+		test(&tb, forth_execute(f2, flush) < 0);
+		test(&tb, h2 == forth_pop(f2));
+		test(&tb, forth_eval(f2, "`stdout @") >= 0);
+		test(&tb, out == forth_pop(f2));
+		state(&tb, forth_push(f2, out));
+		test(&tb, forth_execute(f2, flush) >= 0);
+		test(&tb, 0 == forth_pop(f2));
+		state(&tb, free(m));
+		state(&tb, forth_free(f2));
+		state(&tb, forth_free(f1));
+	}
+	{ /* tests for named foreign functions */
+		forth_t *f = NULL;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		test(&tb, forth_define_cfunction(f, "answer", (forth_cfunction_t){ .f0 = cfunction_0 }, 0, 1) >= 0);
+		test(&tb, forth_define_cfunction(f, "minus", (forth_cfunction_t){ .f2 = cfunction_2 }, 2, 1) >= 0);
+		test(&tb, forth_define_cfunction(f, "digits", (forth_cfunction_t){ .f4 = cfunction_4 }, 4, 0) >= 0);
+		test(&tb, forth_define_cfunction(f, "bad", (forth_cfunction_t){ .f0 = cfunction_0 }, 5, 1) < 0);
+		test(&tb, forth_define_cfunction(f, "bad", (forth_cfunction_t){ .f0 = cfunction_0 }, 0, 2) < 0);
+
+		test(&tb, forth_eval(f, "answer") >= 0);
+		test(&tb, 42 == forth_pop(f));
+		test(&tb, forth_eval(f, "7 10 3 minus") >= 0);
+		test(&tb, 2 == forth_stack_position(f));
+		test(&tb, 7 == forth_pop(f));
+		test(&tb, 7 == forth_pop(f));
+		test(&tb, forth_eval(f, "9 1 2 3 4 digits") >= 0);
+		test(&tb, 1 == cfunction_calls);
+		test(&tb, 9 == forth_pop(f));
+		test(&tb, 0 == forth_stack_position(f));
+
+		/* they can be compiled into other words */
+		test(&tb, forth_eval(f, ": x answer 2 minus ; x") >= 0);
+		test(&tb, 40 == forth_pop(f));
+		test(&tb, forth_load_library(f, "./no-such-plugin.so") < 0);
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for binding foreign functions again after a core is loaded */
+		forth_t *f1 = NULL, *f2 = NULL;
+		char *m = NULL;
+		size_t size = 0;
+		int plugin = 0;
+		state(&tb, f1 = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f1);
+		/* the example plugin, "make plugins" builds it */
+		plugin = forth_load_library(f1, "./plugin.so") >= 0;
+		test(&tb, forth_define_cfunction(f1, "answer", (forth_cfunction_t){ .f0 = cfunction_0 }, 0, 1) >= 0);
+		test(&tb, forth_define_cfunction(f1, "minus", (forth_cfunction_t){ .f2 = cfunction_2 }, 2, 1) >= 0);
+		test(&tb, forth_eval(f1, ": x answer 2 minus ;") >= 0);
+		if (plugin)
+			test(&tb, forth_eval(f1, ": y 1 2 3 add3 twice ;") >= 0);
+		must(&tb, m = forth_save_core_memory(f1, &size));
+		must(&tb, f2 = forth_load_core_memory(m, size));
+		test(&tb, forth_rebind_cfunction(f2, "x", (forth_cfunction_t){ .f0 = cfunction_0 }, 0, 1) < 0);
+		test(&tb, forth_rebind_cfunction(f2, "answer", (forth_cfunction_t){ .f0 = cfunction_0 }, 5, 1) < 0);
+		/* in any order, and new functions do not take their places */
+		test(&tb, forth_rebind_cfunction(f2, "minus", (forth_cfunction_t){ .f2 = cfunction_2 }, 2, 1) >= 0);
+		test(&tb, forth_define_cfunction(f2, "zero", (forth_cfunction_t){ .f0 = cfunction_0 }, 0, 1) >= 0);
+		test(&tb, forth_rebind_cfunction(f2, "answer", (forth_cfunction_t){ .f0 = cfunction_0 }, 0, 1) >= 0);
+		test(&tb, forth_eval(f2, "x answer zero") >= 0);
+		test(&tb, 3 == forth_stack_position(f2));
+		test(&tb, 42 == forth_pop(f2));
+		test(&tb, 42 == forth_pop(f2));
+		test(&tb, 40 == forth_pop(f2));
+		if (plugin) {
+			test(&tb, forth_eval(f2, "y") >= 0);
+			test(&tb, 12 == forth_pop(f2));
+		}
+		state(&tb, free(m));
+		state(&tb, forth_free(f2));
+		state(&tb, forth_free(f1));
+		/* a library that does not fit leaves the dictionary as it was */
+		if (plugin) {
+			struct forth_stats s;
+			forth_cell_t here = 0;
+			state(&tb, f1 = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+			must(&tb, f1);
+			test(&tb, forth_stats(f1, &s) >= 0);
+			test(&tb, forth_eval(f1, "here") >= 0);
+			here = forth_pop(f1);
+			state(&tb, forth_push(f1, s.dictionary_size / sizeof(forth_cell_t) - here - 8));
+			test(&tb, forth_eval(f1, "allot here") >= 0);
+			here = forth_pop(f1);
+			test(&tb, forth_load_library(f1, "./plugin.so") < 0);
+			test(&tb, 0 == forth_lookup(f1, "add3"));
+			test(&tb, forth_eval(f1, "here") >= 0);
+			test(&tb, here == forth_pop(f1));
+			state(&tb, forth_free(f1));
+		}
+	}
+	{ /* tests for compiling words to C */
+		forth_t *f = NULL;
+		FILE *out = NULL;
+		forth_xt_t quad, square;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		state(&tb, out = tmpfile());
+		must(&tb, out);
+		test(&tb, forth_eval(f, ": square dup * ; : quad square square ;") >= 0);
+		must(&tb, quad = forth_lookup(f, "quad"));
+		must(&tb, square = forth_lookup(f, "square"));
+		test(&tb, forth_generate_native(f, out, forth_lookup(f, "dup")) < 0);
+		test(&tb, forth_generate_native(f, out, quad) >= 0);
+		test(&tb, ftell(out) > 0);
+		/* words not compiled into this interpreter still run */
+		state(&tb, forth_push(f, 3));
+		test(&tb, forth_execute(f, quad) >= 0);
+		test(&tb, 81 == forth_pop(f));
+		test(&tb, forth_eval(f, "2 square") >= 0);
+		test(&tb, 4 == forth_pop(f));
+		state(&tb, fclose(out));
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for subroutine threading, if it is available */
+		forth_t *f = NULL;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		test(&tb, forth_set_subroutine_threading(f, 0) >= 0);
+		if (forth_set_subroutine_threading(f, 1) >= 0) {
+			test(&tb, forth_eval(f, ": sq dup * ; : small? 3 u< if 1 else 2 then ; : y sq small? ; 1 y 2 y") >= 0);
+			test(&tb, 2 == forth_pop(f));
+			test(&tb, 1 == forth_pop(f));
+			test(&tb, forth_eval(f, ": one 1 ; : two 2 ; : x one ; x") >= 0);
+			test(&tb, 1 == forth_pop(f));
+			/* compiled words notice when their threaded code changes */
+			test(&tb, forth_eval(f, "find two find x 1 + ! x") >= 0);
+			test(&tb, 2 == forth_pop(f));
+			test(&tb, 0 == forth_stack_position(f));
+		}
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for inlining small words */
+		forth_t *f = NULL;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		/* "inc" is copied into "x", and "x" does not call it */
+		test(&tb, forth_eval(f, ": inc inline 1 + ; : x inc inc ; 1 x") >= 0);
+		test(&tb, 3 == forth_pop(f));
+		test(&tb, forth_eval(f, "find x 1 + @ find inc = ") >= 0);
+		test(&tb, 0 == forth_pop(f));
+		/* words not marked with "inline" are always called */
+		test(&tb, forth_eval(f, ": dec 1 - ; : w dec 5 ; 3 w") >= 0);
+		test(&tb, 5 == forth_pop(f));
+		test(&tb, 2 == forth_pop(f));
+		test(&tb, forth_eval(f, "find w 1 + @ find dec =") >= 0);
+		test(&tb, 0 != forth_pop(f));
+		/* branches still work after being copied */
+		test(&tb, forth_eval(f, ": small? inline 3 u< if 1 else 2 then ; : y small? ; 1 y 5 y") >= 0);
+		test(&tb, 2 == forth_pop(f));
+		test(&tb, 1 == forth_pop(f));
+		/* words using the return address are called */
+		test(&tb, forth_eval(f, ": ret inline r> ; : z ret ; find z 1 + @ find ret =") >= 0);
+		test(&tb, 0 != forth_pop(f));
+		/* redefining a word does not change words already compiled */
+		test(&tb, forth_eval(f, ": inc 2 + ; 1 x 1 inc") >= 0);
+		test(&tb, 3 == forth_pop(f));
+		test(&tb, 3 == forth_pop(f));
+		test(&tb, 0 == forth_stack_position(f));
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for tail calls */
+		forth_t *f = NULL;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		/* "a" is too big to be inlined, so "b" jumps to it */
+		test(&tb, forth_eval(f, ": a inline 1 + 1 + 1 + ; : b dup * a ; 3 b") >= 0);
+		test(&tb, 12 == forth_pop(f));
+		test(&tb, forth_eval(f, "find b 3 + @ find a =") >= 0);
+		test(&tb, 0 == forth_pop(f));
+		/* branches to the end of the word still work */
+		test(&tb, forth_eval(f, ": c if a then ; 1 0 c 1 1 c") >= 0);
+		test(&tb, 4 == forth_pop(f));
+		test(&tb, 1 == forth_pop(f));
+		/* words using the return stack are still called */
+		test(&tb, forth_eval(f, ": ret inline r> drop ; : d ret ; : e d 5 ; e") >= 0);
+		test(&tb, 5 == forth_pop(f));
+		test(&tb, forth_eval(f, "find d 1 + @ find ret =") >= 0);
+		test(&tb, 0 != forth_pop(f));
+		test(&tb, 0 == forth_stack_position(f));
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for stack effects */
+		forth_t *f = NULL;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		test(&tb, forth_eval(f, ": sq dup * ; : y 0 swap sq sq swap ; find y stack-effect") >= 0);
+		test(&tb, (forth_cell_t)-1 == forth_pop(f));
+		test(&tb, 1 == forth_pop(f));
+		test(&tb, 1 == forth_pop(f));
+		/* both paths through a word must have the same effect */
+		test(&tb, forth_eval(f, ": z if 1 then ; find z stack-effect") >= 0);
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, forth_eval(f, "2 y") >= 0);
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, 16 == forth_pop(f));
+		/* underflow is caught before the word runs */
+		test(&tb, forth_eval(f, ": under drop drop drop ; 1 2 under") >= 0);
+		test(&tb, 0 == forth_stack_position(f));
+		/* changing a word forgets its effect, and those of its callers */
+		test(&tb, forth_eval(f, ": p 1 2 + 3 + ; : x p drop ; : w x ; w find w stack-effect") >= 0);
+		test(&tb, (forth_cell_t)-1 == forth_pop(f));
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, forth_eval(f, "find drop find x 1 + ! find w stack-effect") >= 0);
+		test(&tb, (forth_cell_t)-1 == forth_pop(f));
+		test(&tb, (forth_cell_t)-2 == forth_pop(f));
+		test(&tb, 2 == forth_pop(f));
+		test(&tb, forth_eval(f, "w") >= 0);
+		test(&tb, 0 == forth_stack_position(f));
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for removing unused words */
+		forth_t *f = NULL;
+		forth_xt_t entries[3], bad = 1;
+		forth_cell_t before = 0;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		test(&tb, forth_eval(f, ": unused 1 2 3 ; : a 1 + 1 + 1 + ; : b dup * a ; : c ' a ; h @") >= 0);
+		before = forth_pop(f);
+		must(&tb, entries[0] = forth_lookup(f, "b"));
+		must(&tb, entries[1] = forth_lookup(f, "c"));
+		must(&tb, entries[2] = forth_lookup(f, "h"));
+		test(&tb, forth_strip_core(f, &bad, 1) < 0);
+		test(&tb, forth_strip_core(f, entries, 3) >= 0);
+		test(&tb, 0 == forth_lookup(f, "unused"));
+		test(&tb, 0 == forth_lookup(f, "here"));
+		/* calls, jumps and execution tokens refer to where words are now */
+		test(&tb, forth_eval(f, "3 b c h @") >= 0);
+		test(&tb, forth_pop(f) < before);
+		test(&tb, forth_lookup(f, "a") == forth_pop(f));
+		test(&tb, 12 == forth_pop(f));
+		test(&tb, forth_eval(f, "find a 1 strip-core find b 2 3 +") >= 0);
+		test(&tb, 5 == forth_pop(f));
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, 0 == forth_stack_position(f));
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for running with a budget */
+		forth_t *f = NULL;
+		forth_cell_t at = 0;
+		int r = 0, yields = 0;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		forth_set_string_input(f, ": down begin 1 - dup 0 = until ; 10000 down 7");
+		while ((r = forth_run_budget(f, 100)) == FORTH_YIELDED)
+			yields++;
+		test(&tb, r >= 0);
+		test(&tb, yields >= 100);
+		test(&tb, 7 == forth_pop(f));
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, 0 == forth_stack_position(f));
+		/* a program that never stops can be interrupted and carried on */
+		forth_set_string_input(f, ": forever begin 0 until ; forever");
+		test(&tb, FORTH_YIELDED == forth_run_budget(f, 1000));
+		test(&tb, FORTH_YIELDED == forth_run_budget(f, 1000));
+		test(&tb, 0 == forth_stack_position(f));
+		/* new input cancels it, and so does forth_run_reset */
+		test(&tb, forth_eval(f, "1 2 +") >= 0);
+		test(&tb, 3 == forth_pop(f));
+		forth_set_string_input(f, "forever");
+		test(&tb, FORTH_YIELDED == forth_run_budget(f, 1000));
+		state(&tb, forth_run_reset(f));
+		test(&tb, forth_run_budget(f, 1000) >= 0);
+		test(&tb, forth_eval(f, "4") >= 0);
+		test(&tb, 4 == forth_pop(f));
+		test(&tb, 0 == forth_stack_position(f));
+		/* including the input it was evaluating */
+		test(&tb, at = core_string(f, "forever"));
+		for (r = 0, yields = 0; yields < 64; yields++) {
+			forth_push(f, at);
+			forth_push(f, 7);
+			forth_set_string_input(f, "evaluate 9");
+			r |= FORTH_YIELDED != forth_run_budget(f, 1000);
+			r |= forth_eval(f, "1 2 +") < 0;
+			r |= 3 != forth_pop(f);
+		}
+		test(&tb, 0 == r);
+		test(&tb, 0 == forth_stack_position(f));
+		state(&tb, forth_free(f));
+		/* an error after stopping restarts the interpreter, not the word */
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		forth_set_string_input(f, ": f 50 begin 1 - dup 0 = until drop 1 0 / ; f 7 8");
+		for (yields = 0; (r = forth_run_budget(f, 10)) == FORTH_YIELDED && yields < 1000;)
+			yields++;
+		test(&tb, r >= 0 && yields < 1000);
+		test(&tb, 8 == forth_pop(f));
+		test(&tb, 7 == forth_pop(f));
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for nested input sources */
+		forth_t *f = NULL;
+		const char src[] = ": down begin 1 - dup 0 = until ; 1000 down self";
+		forth_cell_t at = 0, len = sizeof(src) - 6;
+		char self[64];
+		int r = 0, yields = 0;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE * 16, stdin, stdout, NULL));
+		must(&tb, f);
+		test(&tb, at = core_string(f, src));
+		/* a run can stop and carry on within evaluate */
+		forth_push(f, at);
+		forth_push(f, len);
+		forth_set_string_input(f, "evaluate 7");
+		while ((r = forth_run_budget(f, 50)) == FORTH_YIELDED)
+			yields++;
+		test(&tb, r >= 0);
+		test(&tb, yields >= 20);
+		test(&tb, 7 == forth_pop(f));
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, 0 == forth_stack_position(f));
+		/* nesting too deeply is an error, not a crash */
+		sprintf(self, ": self %u 4 evaluate ; self 2 3 +", (unsigned)(at + len + 1));
+		test(&tb, forth_eval(f, self) >= 0);
+		test(&tb, 5 == forth_pop(f));
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for the module cache */
+		forth_t *f = NULL;
+		FILE *module = NULL;
+		char include[160];
+		const forth_cell_t loaded[] = { 0, -1, 0 };
+		remove("unit.module.fth.cache");
+		state(&tb, module = fopen("unit.module.fth", "wb"));
+		must(&tb, module);
+		state(&tb, fputs(": sq dup * ; : cube dup sq * ; 16 base !", module));
+		state(&tb, fclose(module));
+		/* the first time the file is read and the changes it makes are
+		 * saved, the second time they are loaded, but not the third as
+		 * the dictionary has changed */
+		for (int i = 0; i < 3; i++) {
+			forth_cell_t at = 0;
+			state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+			must(&tb, f);
+			test(&tb, forth_set_module_cache(f, 1) >= 0);
+			if (i == 2)
+				test(&tb, forth_eval(f, ": changed ;") >= 0);
+			test(&tb, at = core_string(f, "unit.module.fth"));
+			sprintf(include, ": include %u 15 (module) dup if exit then"
+				" %u 15 1 open-file drop dup 0 1 evaluator drop close-file drop ;",
+				(unsigned)at, (unsigned)at);
+			test(&tb, forth_eval(f, include) >= 0);
+			test(&tb, forth_eval(f, "include 10 cube a base !") >= 0);
+			test(&tb, 4096 == forth_pop(f));
+			test(&tb, loaded[i] == forth_pop(f));
+			test(&tb, 0 == forth_stack_position(f));
+			state(&tb, forth_free(f));
+		}
+		test(&tb, remove("unit.module.fth") == 0);
+		test(&tb, remove("unit.module.fth.cache") == 0);
+	}
+	{ /* tests for the module cache with files that include other files */
+		forth_t *f = NULL;
+		FILE *file = NULL;
+		char line[160];
+		const char *inner[] = { ": bw 1 ;", ": bw 10 ;", ": bw 10 ;" };
+		const forth_cell_t aw[] = { 3, 12, 12 };
+		/* 'aw' uses 'bw' from the inner file, which changes after the
+		 * outer file has been cached, invalidating that cache */
+		for (int i = 0; i < 3; i++) {
+			forth_cell_t a = 0, b = 0;
+			state(&tb, file = fopen("unit.inner.fth", "wb"));
+			must(&tb, file);
+			state(&tb, fputs(inner[i], file));
+			state(&tb, fclose(file));
+			state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+			must(&tb, f);
+			test(&tb, forth_set_module_cache(f, 1) >= 0);
+			test(&tb, a = core_string(f, "unit.outer.fth"));
+			test(&tb, b = core_string(f, "unit.inner.fth"));
+			test(&tb, forth_eval(f, ": inc over over (module) if 2drop exit then"
+				" 1 open-file drop dup 0 1 evaluator drop close-file drop ;") >= 0);
+			if (!i) {
+				state(&tb, file = fopen("unit.outer.fth", "wb"));
+				must(&tb, file);
+				state(&tb, fprintf(file, "%u 14 inc : aw bw 2 + ;", (unsigned)b));
+				state(&tb, fclose(file));
+			}
+			sprintf(line, "%u 14 inc aw", (unsigned)a);
+			test(&tb, forth_eval(f, line) >= 0);
+			test(&tb, aw[i] == forth_pop(f));
+			test(&tb, 0 == forth_stack_position(f));
+			state(&tb, forth_free(f));
+		}
+		test(&tb, remove("unit.outer.fth") == 0);
+		test(&tb, remove("unit.outer.fth.cache") == 0);
+		test(&tb, remove("unit.inner.fth") == 0);
+		test(&tb, remove("unit.inner.fth.cache") == 0);
+	}
+	{ /* tests for compiling source once */
+		forth_t *f = NULL;
+		forth_xt_t square = 0, twice = 0;
+		forth_cell_t here = 0;
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		test(&tb, forth_eval(f, "here") >= 0);
+		here = forth_pop(f);
+		test(&tb, square = forth_compile(f, "dup *", 5));
+		test(&tb, twice = forth_compile(f, "dup + ", 6));
+		for (forth_cell_t i = 0; i < 4; i++) {
+			state(&tb, forth_push(f, i));
+			test(&tb, forth_invoke(f, square) >= 0);
+			test(&tb, forth_invoke(f, twice) >= 0);
+			test(&tb, i * i * 2 == forth_pop(f));
+		}
+		test(&tb, 0 == forth_stack_position(f));
+		/* words that fail to compile leave nothing behind */
+		test(&tb, 0 == forth_compile(f, "dup no-such-word", 16));
+		test(&tb, 0 == forth_compile(f, "1 ;", 3));
+		test(&tb, 0 == forth_compile(f, "0 if 1", 6));
+		test(&tb, 0 == forth_compile(f, "1 : x 5 ;", 9));
+		test(&tb, 0 == forth_compile(f, "1 : x 5", 7));
+		test(&tb, 0 == forth_stack_position(f));
+		/* space is given back in the reverse order it was taken */
+		test(&tb, forth_release(f, square) < 0);
+		test(&tb, forth_release(f, twice) >= 0);
+		test(&tb, forth_release(f, square) >= 0);
+		test(&tb, forth_eval(f, "here") >= 0);
+		test(&tb, here == forth_pop(f));
+		/* and the dictionary can still be added to */
+		test(&tb, forth_eval(f, ": y 7 ; : z 8 ; y z") >= 0);
+		test(&tb, 8 == forth_pop(f));
+		test(&tb, 7 == forth_pop(f));
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for feeding in input a piece at a time */
+		forth_t *f = NULL;
+		static const char program[] = ": square dup * ; 12 square 3 square";
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		/* a word is only run once the whole of it has arrived */
+		test(&tb, forth_feed(f, "1", 1, 0) >= 0);
+		test(&tb, 0 == forth_stack_position(f));
+		test(&tb, forth_feed(f, "2 ", 2, 0) >= 0);
+		test(&tb, 1 == forth_stack_position(f));
+		test(&tb, 12 == forth_pop(f));
+		test(&tb, forth_feed(f, "3", 1, 1) >= 0);
+		test(&tb, 3 == forth_pop(f));
+		/* the same for any size of piece, including words read by ':' */
+		for (size_t size = 1; size < 8; size++) {
+			state(&tb, forth_free(f));
+			state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+			must(&tb, f);
+			for (size_t i = 0, n = 0; i < sizeof(program) - 1; i += n) {
+				n = sizeof(program) - 1 - i < size ? sizeof(program) - 1 - i : size;
+				test(&tb, forth_feed(f, program + i, n, i + n >= sizeof(program) - 1) >= 0);
+			}
+			test(&tb, 2 == forth_stack_position(f));
+			test(&tb, 9 == forth_pop(f));
+			test(&tb, 144 == forth_pop(f));
+		}
+		state(&tb, forth_free(f));
+	}
+	{ /* tests for output to a buffer */
+		forth_t *f = NULL;
+		forth_buffer_t b = { 0 };
+		forth_cell_t at = 0;
+		size_t length = 0;
+		char line[80];
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		test(&tb, !strcmp(forth_output_view(f, &length), "") && !length);
+		state(&tb, forth_set_buffer_output(f, &b));
+		test(&tb, forth_eval(f, "65 emit 123 . 2 3 .s 2drop") >= 0);
+		test(&tb, !strcmp(forth_output_view(f, &length), "A123 2: 2 3 \n"));
+		test(&tb, length == b.length && forth_output_view(f, NULL) == b.data);
+		/* the buffer grows, and can be emptied for reuse */
+		b.length = 0;
+		test(&tb, forth_eval(f, ": lots 1000 begin 7 . 1 - dup 0 = until drop ; lots") >= 0);
+		test(&tb, b.length == 2000 && b.size > b.length && !b.data[b.length]);
+		b.length = 0;
+		test(&tb, at = core_string(f, "line"));
+		sprintf(line, "%u 4 `fout @ write-file %u 4 `fout @ write-line", (unsigned)at, (unsigned)at);
+		test(&tb, forth_eval(f, line) >= 0);
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, 4 == forth_pop(f));
+		test(&tb, !strcmp(forth_output_view(f, NULL), "lineline\n"));
+		state(&tb, forth_set_buffer_output(f, NULL));
+		test(&tb, !strcmp(forth_output_view(f, &length), "") && !length);
+		state(&tb, forth_free(f));
+		state(&tb, free(b.data));
+	}
+	{ /* tests for statistics */
+		forth_t *f = NULL;
+		struct forth_stats s1, s2;
+		forth_cell_t blocks[100];
+		forth_buffer_t b = { 0 };
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
+		must(&tb, f);
+		test(&tb, forth_stats(f, &s1) >= 0);
+		test(&tb, s1.stack_high < s1.stack_size && s1.return_high < s1.return_size);
+		test(&tb, s1.dictionary_used < s1.dictionary_size && s1.files == 0);
+		test(&tb, forth_eval(f, ": deep 1 2 3 4 5 6 7 8 9 10 ; deep 100 allocate drop") >= 0);
+		test(&tb, forth_stats(f, &s2) >= 0);
+		test(&tb, s2.instructions > s1.instructions && s2.calls > s1.calls);
+		test(&tb, s2.stack_high >= 11 && s2.dictionary_used > s1.dictionary_used);
+		test(&tb, s2.allocations == s1.allocations + 1 && s2.allocated == s1.allocated + 1);
+		test(&tb, forth_eval(f, "free drop 2drop 2drop 2drop 2drop 2drop") >= 0);
+		test(&tb, forth_stats(f, &s1) >= 0);
+		test(&tb, s1.stack_high == s2.stack_high && s1.allocated == s2.allocated - 1);
+		/* only blocks given out and not yet freed can be freed */
+		test(&tb, forth_eval(f, "100 allocate drop 200 resize drop dup free swap free") >= 0);
+		test(&tb, 0 != forth_pop(f));
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, forth_eval(f, "here free 0 free") >= 0);
+		test(&tb, 0 == forth_pop(f));
+		test(&tb, 0 != forth_pop(f));
+		test(&tb, forth_stats(f, &s2) >= 0);
+		test(&tb, s1.allocated == s2.allocated);
+		/* zeros count as much as anything else does */
+		test(&tb, forth_eval(f, ": zeros 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 ; zeros") >= 0);
+		test(&tb, forth_stats(f, &s2) >= 0);
+		test(&tb, s2.stack_high >= 20 && s2.stack_high < 24);
+		test(&tb, forth_eval(f, "2drop 2drop 2drop 2drop 2drop 2drop 2drop 2drop 2drop 2drop") >= 0);
+		test(&tb, 0 == forth_stack_position(f));
+		/* the set of blocks grows and shrinks */
+		for (int i = 0; i < 100; i++) {
+			state(&tb, forth_eval(f, "8 allocate drop"));
+			state(&tb, blocks[i] = forth_pop(f));
+		}
+		for (int i = 0; i < 100; i++) {
+			state(&tb, forth_push(f, blocks[i]));
+			state(&tb, forth_eval(f, "free drop"));
+		}
+		test(&tb, forth_stats(f, &s2) >= 0);
+		test(&tb, s1.allocated == s2.allocated && s2.allocations == s1.allocations + 101);
+		test(&tb, 0 == forth_stack_position(f));
+		state(&tb, forth_set_buffer_output(f, &b));
+		test(&tb, forth_eval(f, "stats") >= 0);
+		test(&tb, b.length && strstr(b.data, "instructions"));
+		state(&tb, forth_free(f));
+		state(&tb, free(b.data));
+	}
+	{ /* tests for the initial image */
+		forth_t *f = NULL;
+		FILE *out = NULL;
+		state(&tb, out = tmpfile());
+		must(&tb, out);
+		test(&tb, forth_generate_image(out) >= 0);
+		test(&tb, ftell(out) > 0);
+		state(&tb, fclose(out));
+		/* the cells that depend on the size of the core are correct */
+		state(&tb, f = forth_init(MINIMUM_CORE_SIZE * 2, stdin, stdout, NULL));
+		must(&tb, f);
+		test(&tb, forth_eval(f, "max-core `stack-size @ dup + - stack-start = max-core") >= 0);
+		test(&tb, MINIMUM_CORE_SIZE * 2 == forth_pop(f));
+		test(&tb, 0 != forth_pop(f));
+		state(&tb, forth_free(f));
+	}
 	{ 
 		FILE *core = NULL;
 		forth_t *f1 = NULL, *f2 = NULL;
 		char *m1 = NULL, *m2 = NULL;
-		forth_cell_t size1, size2;
+		size_t size1, size2;
 		must(&tb, f1 = forth_init(MINIMUM_CORE_SIZE, stdin, stdout, NULL));
 		state(&tb, core = fopen("unit.core", "wb+"));
 		must(&tb, core);
@@ -484,7 +1276,8 @@ int libforth_unit_tests(int keep_files, int colorize, int silent)
 		must(&tb, f2 = forth_load_core_memory(m1,  size1));
 		must(&tb, m2 = forth_save_core_memory(f2, &size2));
 		must(&tb, size2 == size1);
-		test(&tb, size1/sizeof(forth_cell_t) > MINIMUM_CORE_SIZE);
+		/* only the parts of the core in use are saved */
+		test(&tb, size1/sizeof(forth_cell_t) < MINIMUM_CORE_SIZE);
 
 		state(&tb, fclose(core));
 		state(&tb, forth_free(f1));